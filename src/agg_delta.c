@@ -0,0 +1,125 @@
+#include <string.h>
+
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+
+#include "agg_delta.h"
+
+void agg_delta_init(struct agg_delta *c)
+{
+    memset(c, 0, sizeof(*c));
+}
+
+void agg_delta_resync_all(struct agg_delta *c)
+{
+    for (int i = 0; i < ARRAY_SIZE(c->streams); i++) {
+        c->streams[i].channels = 0;
+    }
+}
+
+static struct agg_delta_stream *stream_find(struct agg_delta *c, uint8_t dev, uint8_t sensor)
+{
+    for (int i = 0; i < ARRAY_SIZE(c->streams); i++) {
+        struct agg_delta_stream *s = &c->streams[i];
+
+        if (s->used && s->dev == dev && s->sensor == sensor) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/* Take the least recently used slot; its stream restarts with a keyframe */
+static struct agg_delta_stream *stream_claim(struct agg_delta *c, uint8_t dev, uint8_t sensor)
+{
+    struct agg_delta_stream *lru = &c->streams[0];
+
+    for (int i = 1; i < ARRAY_SIZE(c->streams); i++) {
+        if (c->streams[i].used < lru->used) {
+            lru = &c->streams[i];
+        }
+    }
+    lru->dev = dev;
+    lru->sensor = sensor;
+    lru->channels = 0;
+    return lru;
+}
+
+static inline int put_varint(uint8_t *out, uint16_t v)
+{
+    int n = 0;
+
+    while (v >= 0x80) {
+        out[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    out[n++] = v;
+    return n;
+}
+
+uint8_t agg_delta_encode(struct agg_delta *c, uint8_t *dev, uint8_t sensor,
+                         const uint8_t *data, uint8_t len, uint8_t *out)
+{
+    int off = sensor ? 1 : 0;
+    int channels = (len - off) / 2;
+    struct agg_delta_stream *s;
+    uint8_t coded = 0;
+
+    c->raw_bytes += len;
+
+    if (((len - off) & 1) || channels == 0 || channels > AGG_DELTA_MAX_CH) {
+        // Not int16 channels: sent as is, no stream state
+        goto raw;
+    }
+
+    s = stream_find(c, *dev, sensor);
+    if (!s) {
+        s = stream_claim(c, *dev, sensor);
+    }
+    s->used = ++c->clock;
+
+    if (s->channels == channels && s->since_key < CONFIG_BHI_AGG_DELTA_KEYFRAME) {
+        const uint8_t *v = &data[off];
+
+        memcpy(out, data, off);
+        coded = off;
+        // A varint is at most 3 bytes; give up once it is no smaller
+        for (int ch = 0; ch < channels && coded < len; ch++) {
+            int16_t x = sys_get_le16(&v[2 * ch]);
+            int16_t d = (int16_t)(x - s->last[ch]);
+
+            coded += put_varint(&out[coded], (uint16_t)(((uint16_t)d << 1) ^ (d >> 15)));
+        }
+        if (coded < len) {
+            for (int ch = 0; ch < channels; ch++) {
+                s->last[ch] = sys_get_le16(&v[2 * ch]);
+            }
+            s->since_key++;
+            *dev |= AGG_REC_DELTA;
+            c->coded_bytes += coded;
+            return coded;
+        }
+    }
+
+    // Keyframe
+    for (int ch = 0; ch < channels; ch++) {
+        s->last[ch] = sys_get_le16(&data[off + 2 * ch]);
+    }
+    s->channels = channels;
+    s->since_key = 0;
+    c->keyframes++;
+
+raw:
+    memcpy(out, data, len);
+    c->coded_bytes += len;
+    return len;
+}
+
+void agg_delta_resync(struct agg_delta *c, uint8_t dev, uint8_t sensor)
+{
+    struct agg_delta_stream *s = stream_find(c, dev & ~AGG_REC_DELTA, sensor);
+
+    if (s) {
+        s->channels = 0;
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef AGG_DELTA_H_
+#define AGG_DELTA_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+
+/* Lossless delta coding of the binary aggregate stream, announced by
+ * AGG_FRAME_FLAG_DELTA in every frame header.
+ *
+ * A stream is one (dev, BHI sensor) pair. Its sample values are read as
+ * little-endian int16 channels after the sensor id, if any. A record
+ * with AGG_REC_DELTA set in dev holds one zig-zag LEB128 varint per
+ * channel: the difference to the stream's previous value, modulo 2^16.
+ * Any other record is a keyframe carrying the values unchanged.
+ *
+ * Keyframes go out every CONFIG_BHI_AGG_DELTA_KEYFRAME samples of a
+ * stream, whenever the delta would not be smaller, and after the phone
+ * reconnects. A phone that sees a frame_seq gap ignores a stream's
+ * deltas until its next keyframe.
+ */
+#define AGG_REC_DELTA 0x80
+
+#if defined(CONFIG_BHI_AGG_DELTA)
+
+#define AGG_DELTA_MAX_CH CONFIG_BHI_AGG_DELTA_MAX_CHANNELS
+
+/* The last varint may run 2 bytes past the raw length before the
+ * encoder falls back to a keyframe
+ */
+#define AGG_DELTA_OUT_LEN(len) ((len) + 2)
+
+struct agg_delta_stream {
+    uint32_t used;          // Codec clock at the last sample, for eviction
+    uint8_t dev;
+    uint8_t sensor;
+    uint8_t channels;       // 0: slot free or next sample is a keyframe
+    uint8_t since_key;      // Deltas sent since the last keyframe
+    int16_t last[AGG_DELTA_MAX_CH];
+};
+
+struct agg_delta {
+    struct agg_delta_stream streams[CONFIG_BHI_AGG_DELTA_STREAMS];
+    uint32_t clock;
+    uint32_t raw_bytes;     // Sample bytes before coding
+    uint32_t coded_bytes;   // Sample bytes after coding
+    uint32_t keyframes;
+};
+
+void agg_delta_init(struct agg_delta *c);
+
+/* Every stream starts over with a keyframe; statistics are kept */
+void agg_delta_resync_all(struct agg_delta *c);
+
+/* Code one sample into out, which has room for AGG_DELTA_OUT_LEN(len)
+ * bytes. Returns the coded
+ * length and ORs AGG_REC_DELTA into *dev for a delta record.
+ */
+uint8_t agg_delta_encode(struct agg_delta *c, uint8_t *dev, uint8_t sensor,
+                         const uint8_t *data, uint8_t len, uint8_t *out);
+
+/* The last coded sample of the stream never reached the frame */
+void agg_delta_resync(struct agg_delta *c, uint8_t dev, uint8_t sensor);
+
+#endif /* CONFIG_BHI_AGG_DELTA */
+
+#endif /* AGG_DELTA_H_ */
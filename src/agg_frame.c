@@ -0,0 +1,71 @@
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/sys/byteorder.h>
+
+#include "agg_frame.h"
+
+void agg_framer_init(struct agg_framer *f)
+{
+    memset(f, 0, sizeof(*f));
+    agg_framer_reset(f, AGG_FRAME_MAX_LEN);
+}
+
+void agg_framer_reset(struct agg_framer *f, uint16_t cap)
+{
+    if (cap > AGG_FRAME_MAX_LEN) {
+        cap = AGG_FRAME_MAX_LEN;
+    }
+    f->cap = cap;
+    f->len = sizeof(struct agg_frame_hdr);
+    f->count = 0;
+    f->base_ts = 0;
+}
+
+int agg_framer_add(struct agg_framer *f, uint8_t dev, uint16_t seq, uint32_t ts,
+                   const uint8_t *data, uint8_t len)
+{
+    uint16_t rec_len = sizeof(struct agg_rec_hdr) + len;
+
+    if (sizeof(struct agg_frame_hdr) + rec_len > f->cap) {
+        return -EMSGSIZE;
+    }
+
+    if (f->count == 0) {
+        f->base_ts = ts;
+    } else if (f->len + rec_len > f->cap || f->count == UINT8_MAX ||
+               ts - f->base_ts > UINT16_MAX) {
+        // Frame full, or the offset no longer fits: caller must flush
+        return -ENOSPC;
+    }
+
+    struct agg_rec_hdr *rec = (struct agg_rec_hdr *)&f->buf[f->len];
+    rec->dev = dev;
+    rec->len = len;
+    rec->seq = sys_cpu_to_le16(seq);
+    rec->ts_off = sys_cpu_to_le16((uint16_t)(ts - f->base_ts));
+    memcpy(&f->buf[f->len + sizeof(*rec)], data, len);
+
+    f->len += rec_len;
+    f->count++;
+
+    return 0;
+}
+
+uint16_t agg_framer_finish(struct agg_framer *f)
+{
+    struct agg_frame_hdr *hdr = (struct agg_frame_hdr *)f->buf;
+
+    if (f->count == 0) {
+        return 0;
+    }
+
+    hdr->version = AGG_FRAME_VERSION;
+    hdr->flags = f->flags;
+    hdr->frame_seq = sys_cpu_to_le16(f->seq);
+    hdr->base_ts = sys_cpu_to_le32(f->base_ts);
+    hdr->count = f->count;
+    f->seq++;
+
+    return f->len;
+}
@@ -0,0 +1,102 @@
+#ifndef AGG_FRAME_H_
+#define AGG_FRAME_H_
+
+#include <zephyr/types.h>
+#include <zephyr/toolchain.h>
+#include <zephyr/sys/util.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Binary framing of the aggregate stream sent to the phone.
+ *
+ * One notification carries one frame: a frame header followed by as many
+ * records as fit into the negotiated ATT payload. All fields little-endian.
+ *
+ *   frame:  | ver | flags | frame_seq (2) | base_ts_us (4) | count | record... |
+ *   record: | dev | len | seq (2) | ts_off_us (2) | payload (len) |
+ *
+ * A record's timestamp is base_ts_us + ts_off_us, both taken from the
+ * central's uptime clock when the notification arrived.
+ *
+ * With AGG_FRAME_FLAG_MERGED set, each record is one fusion epoch (see
+ * src/merge.h): dev is a bitmap of the links present, seq the epoch
+ * counter, the timestamp the epoch time, and the payload holds, for
+ * every link in the bitmap, lowest first, a u8 count of its streams
+ * followed by u8 len + sample for each.
+ *
+ * With AGG_FRAME_FLAG_DECODED set, a sample is one sensor hub event (see
+ * src/bhi_decode.h): the BHI sensor id followed by its payload as the hub
+ * sent it, time-stamped with the hub's sample time mapped to the central
+ * clock.
+ *
+ * With AGG_FRAME_FLAG_DELTA set, sample payloads are delta coded per
+ * stream, see src/agg_delta.h.
+ *
+ * AGG_FRAME_FLAG_REPLAY marks a frame replayed from the flash log (see
+ * src/store.h); its records are the raw sensor notifications. One too
+ * large for a record is split over consecutive records of its dev, in
+ * the same frame or the next; all but the last have AGG_REC_MORE set.
+ */
+#define AGG_FRAME_VERSION 1
+
+#define AGG_FRAME_FLAG_MERGED BIT(0)
+#define AGG_FRAME_FLAG_DECODED BIT(1)
+#define AGG_FRAME_FLAG_DELTA BIT(2)
+#define AGG_FRAME_FLAG_REPLAY BIT(3)
+
+#define AGG_REC_MORE 0x40
+
+struct agg_frame_hdr {
+    uint8_t version;
+    uint8_t flags;
+    uint16_t frame_seq;
+    uint32_t base_ts;
+    uint8_t count;
+} __packed;
+
+struct agg_rec_hdr {
+    uint8_t dev;
+    uint8_t len;
+    uint16_t seq;
+    uint16_t ts_off;
+} __packed;
+
+/* Largest frame we ever build: ATT_MTU 247 minus the 3 byte notify header */
+#define AGG_FRAME_MAX_LEN 244
+
+/* Largest record payload, alone in a frame of AGG_FRAME_MAX_LEN */
+#define AGG_REC_MAX_LEN \
+    (AGG_FRAME_MAX_LEN - sizeof(struct agg_frame_hdr) - sizeof(struct agg_rec_hdr))
+
+BUILD_ASSERT(AGG_REC_MAX_LEN == 229, "Update the BHI_AGG_MAX_PAYLOAD range in Kconfig");
+
+struct agg_framer {
+    uint8_t buf[AGG_FRAME_MAX_LEN];
+    uint16_t len;       // Bytes used in buf, header included
+    uint16_t cap;       // Frame size limit for the current frame
+    uint16_t seq;       // Sequence number of the next frame
+    uint32_t base_ts;   // Timestamp of the first record
+    uint8_t count;      // Records in the current frame
+    uint8_t flags;      // AGG_FRAME_FLAG_* for every frame
+};
+
+void agg_framer_init(struct agg_framer *f);
+
+/* Start a new, empty frame limited to cap bytes (clamped to AGG_FRAME_MAX_LEN) */
+void agg_framer_reset(struct agg_framer *f, uint16_t cap);
+
+/* Append a record. Returns -ENOSPC if the frame must be flushed first and
+ * -EMSGSIZE if the record would not fit even into an empty frame.
+ */
+int agg_framer_add(struct agg_framer *f, uint8_t dev, uint16_t seq, uint32_t ts,
+                   const uint8_t *data, uint8_t len);
+
+/* Finalize the header and return the frame length (0 when empty) */
+uint16_t agg_framer_finish(struct agg_framer *f);
+
+static inline bool agg_framer_empty(const struct agg_framer *f)
+{
+    return f->count == 0;
+}
+
+#endif /* AGG_FRAME_H_ */
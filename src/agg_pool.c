@@ -0,0 +1,87 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+
+#include "agg_pool.h"
+#include "metrics.h"
+
+#define AGG_ITEM_SIZE ROUND_UP(sizeof(struct agg_data_item), 4)
+
+K_MEM_SLAB_DEFINE_STATIC(agg_slab, AGG_ITEM_SIZE, CONFIG_BHI_AGG_POOL_COUNT, 4);
+static K_FIFO_DEFINE(agg_fifo);
+
+static atomic_t in_use;
+static atomic_t queued;
+static atomic_t high_water;
+static atomic_t alloc_fail;
+static atomic_t dropped;
+
+static void track_alloc(void)
+{
+    atomic_val_t used = atomic_inc(&in_use) + 1;
+    atomic_val_t max = atomic_get(&high_water);
+
+    while (used > max && !atomic_cas(&high_water, max, used)) {
+        max = atomic_get(&high_water);
+    }
+}
+
+struct agg_data_item *agg_pool_alloc(void)
+{
+    struct agg_data_item *item;
+
+    if (k_mem_slab_alloc(&agg_slab, (void **)&item, K_NO_WAIT) == 0) {
+        track_alloc();
+        return item;
+    }
+
+    atomic_inc(&alloc_fail);
+    atomic_inc(&dropped);
+
+    if (IS_ENABLED(CONFIG_BHI_AGG_POOL_DROP_OLDEST)) {
+        /* Recycle the head of the queue; it stays counted as in use */
+        item = k_fifo_get(&agg_fifo, K_NO_WAIT);
+        if (item) {
+            atomic_dec(&queued);
+            metrics_drop_queued(item);
+        }
+        return item;
+    }
+
+    return NULL;
+}
+
+void agg_pool_free(struct agg_data_item *item)
+{
+    k_mem_slab_free(&agg_slab, item);
+    atomic_dec(&in_use);
+}
+
+void agg_pool_put(struct agg_data_item *item)
+{
+    atomic_inc(&queued);
+    k_fifo_put(&agg_fifo, item);
+}
+
+struct agg_data_item *agg_pool_get(k_timeout_t timeout)
+{
+    struct agg_data_item *item = k_fifo_get(&agg_fifo, timeout);
+
+    if (item) {
+        atomic_dec(&queued);
+    }
+    return item;
+}
+
+uint32_t agg_pool_depth(void)
+{
+    return atomic_get(&queued);
+}
+
+void agg_pool_stats_get(struct agg_pool_stats *stats)
+{
+    stats->in_use = atomic_get(&in_use);
+    stats->queued = atomic_get(&queued);
+    stats->high_water = atomic_get(&high_water);
+    stats->alloc_fail = atomic_get(&alloc_fail);
+    stats->dropped = atomic_get(&dropped);
+}
@@ -0,0 +1,49 @@
+#ifndef AGG_POOL_H_
+#define AGG_POOL_H_
+
+#include <zephyr/kernel.h>
+
+/* Preallocated sample buffers and the queue from the BT RX path to the
+ * phone worker. Buffers come from a fixed k_mem_slab sized by
+ * CONFIG_BHI_AGG_POOL_COUNT, so the RX callback never touches the heap.
+ */
+struct agg_data_item {
+    void *fifo_reserved; /* 1st word reserved for use by kernel FIFO */
+    uint32_t timestamp;  /* Central uptime in us when the notification arrived */
+    uint32_t rx_cyc;     /* Cycle counter at notify_func entry, for metrics */
+    uint32_t enq_cyc;    /* Cycle counter when queued, for metrics */
+    uint16_t seq;        /* Per-device sample counter */
+    uint8_t dev;
+    uint8_t sensor;      /* BHI sensor id of a decoded record, 0 for a raw notification */
+    uint8_t len;
+    uint8_t data[CONFIG_BHI_AGG_MAX_PAYLOAD];
+};
+
+struct agg_pool_stats {
+    uint32_t in_use;      // Buffers currently allocated
+    uint32_t queued;      // Buffers waiting for the phone worker
+    uint32_t high_water;  // Most buffers ever allocated at once
+    uint32_t alloc_fail;  // Allocations that found the pool empty
+    uint32_t dropped;     // Samples lost to the drop policy
+};
+
+/* Get a free buffer without blocking. When the pool is exhausted the
+ * configured drop policy applies: either the oldest queued sample is
+ * recycled, or NULL is returned and the new sample is lost.
+ */
+struct agg_data_item *agg_pool_alloc(void);
+
+void agg_pool_free(struct agg_data_item *item);
+
+/* Queue a filled buffer for the phone worker */
+void agg_pool_put(struct agg_data_item *item);
+
+/* Take the next queued buffer, NULL on timeout */
+struct agg_data_item *agg_pool_get(k_timeout_t timeout);
+
+/* Number of buffers waiting for the phone worker */
+uint32_t agg_pool_depth(void);
+
+void agg_pool_stats_get(struct agg_pool_stats *stats);
+
+#endif /* AGG_POOL_H_ */
@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+
+#include "bhi_decode.h"
+
+struct bhi_event_desc {
+    uint8_t kind;
+    uint8_t len;      // Payload bytes after the id
+};
+
+#define VEC3(id)  [id] = { BHI_KIND_VEC3, 6 }
+#define QUAT(id)  [id] = { BHI_KIND_QUAT, 10 }
+#define EULER(id) [id] = { BHI_KIND_EULER, 6 }
+#define EVENT(id) [id] = { BHI_KIND_EVENT, 0 }
+
+/* Indexed by id so the hot loop is one load per event. Sizes follow the
+ * BHI260AP/BHI360 datasheets' FIFO event table.
+ */
+static const struct bhi_event_desc events[256] = {
+    [0x00] = { BHI_KIND_PAD, 0 },
+    [0xff] = { BHI_KIND_PAD, 0 },
+    [0xf5] = { BHI_KIND_TS, 1 },
+    [0xfb] = { BHI_KIND_TS, 1 },
+    [0xf6] = { BHI_KIND_TS, 2 },
+    [0xfc] = { BHI_KIND_TS, 2 },
+    [0xf7] = { BHI_KIND_TS, 5 },
+    [0xfd] = { BHI_KIND_TS, 5 },
+    [0xf8] = { BHI_KIND_META, 3 },
+    [0xfe] = { BHI_KIND_META, 3 },
+    [0xfa] = { BHI_KIND_META, 17 },
+
+    // Accelerometer: passthrough, raw, corrected, offset, wake-up, raw wake-up
+    VEC3(1), VEC3(3), VEC3(4), VEC3(5), VEC3(6), VEC3(7),
+    // Gyroscope
+    VEC3(10), VEC3(12), VEC3(13), VEC3(14), VEC3(15), VEC3(16),
+    // Magnetometer
+    VEC3(19), VEC3(21), VEC3(22), VEC3(23), VEC3(24), VEC3(25),
+    // Gravity, linear acceleration
+    VEC3(28), VEC3(29), VEC3(31), VEC3(32),
+    // Rotation vector, game rotation vector, geomagnetic rotation vector
+    QUAT(34), QUAT(35), QUAT(37), QUAT(38), QUAT(40), QUAT(41),
+    // Orientation
+    EULER(43), EULER(44),
+    // Tilt, step detector, significant motion, wake, glance, pick-up gestures
+    EVENT(48), EVENT(50), EVENT(55), EVENT(57), EVENT(59), EVENT(61), EVENT(94),
+
+    [52] = { BHI_KIND_U32, 4 },    // Step counter
+    [136] = { BHI_KIND_U32, 4 },
+    [128] = { BHI_KIND_S16, 2 },   // Temperature, 1/100 degC
+    [132] = { BHI_KIND_S16, 2 },
+    [129] = { BHI_KIND_U24, 3 },   // Pressure, 1/128 Pa
+    [133] = { BHI_KIND_U24, 3 },
+    [130] = { BHI_KIND_U8, 1 },    // Relative humidity, %
+    [134] = { BHI_KIND_U8, 1 },
+    [131] = { BHI_KIND_U32, 4 },   // Gas resistance, ohm
+    [135] = { BHI_KIND_U32, 4 },
+};
+
+static struct bhi_decode_stats stats;
+
+enum bhi_kind bhi_sensor_kind(uint8_t sensor)
+{
+    return events[sensor].kind;
+}
+
+uint8_t bhi_sensor_len(uint8_t sensor)
+{
+    return events[sensor].len;
+}
+
+static inline uint64_t ts_apply(uint64_t ts, const uint8_t *p, uint8_t len)
+{
+    switch (len) {
+    case 1:
+        return ts + p[0];
+    case 2:
+        return ts + sys_get_le16(p);
+    default:
+        return sys_get_le32(p) | ((uint64_t)p[4] << 32);
+    }
+}
+
+int bhi_decode(struct bhi_decoder *dec, const uint8_t *buf, uint16_t len,
+               struct bhi_record *recs, int max)
+{
+    uint32_t start = k_cycle_get_32();
+    const uint8_t *p = buf;
+    const uint8_t *end = buf + len;
+    uint64_t ts = dec->ts;
+    uint32_t truncated = 0;
+    int n = 0;
+    int err = 0;
+
+    while (p < end) {
+        const struct bhi_event_desc *desc = &events[*p];
+
+        if (desc->kind == BHI_KIND_NONE || end - p - 1 < desc->len) {
+            err = -EBADMSG;
+            break;
+        }
+
+        switch (desc->kind) {
+        case BHI_KIND_PAD:
+        case BHI_KIND_META:
+            break;
+        case BHI_KIND_TS:
+            ts = ts_apply(ts, p + 1, desc->len);
+            break;
+        default:
+            if (n == max) {
+                truncated++;
+                break;
+            }
+            recs[n].data = p + 1;
+            recs[n].ts = ts;
+            recs[n].sensor = *p;
+            recs[n].len = desc->len;
+            n++;
+            break;
+        }
+        if (err) {
+            break;
+        }
+        p += 1 + desc->len;
+    }
+
+    uint32_t cyc = k_cycle_get_32() - start;
+
+    stats.frames++;
+    stats.cycles += cyc;
+    stats.cycles_max = MAX(stats.cycles_max, cyc);
+    if (err) {
+        stats.errors++;
+        return err;
+    }
+    // Only a fully parsed frame moves the hub clock
+    dec->ts = ts;
+    stats.events += n;
+    stats.truncated += truncated;
+    return n;
+}
+
+void bhi_decode_stats_get(struct bhi_decode_stats *out)
+{
+    *out = stats;
+}
+
+void bhi_decode_stats_reset(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
@@ -0,0 +1,87 @@
+#ifndef BHI_DECODE_H_
+#define BHI_DECODE_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+
+/* Decoder for the FIFO event frames a BHI2xx sensor hub sends in its
+ * notifications. A frame is a run of events, each one a sensor id byte
+ * followed by a payload whose size is fixed per id:
+ *
+ *   0x00, 0xff        padding, 1 byte
+ *   0xf5 / 0xfb       timestamp small delta: u8 ticks
+ *   0xf6 / 0xfc       timestamp large delta: le16 ticks
+ *   0xf7 / 0xfd       full timestamp: le40 ticks
+ *   0xf8 / 0xfe       meta event: type, byte1, byte2
+ *   0xfa              debug data: 17 bytes
+ *   other             virtual sensor sample, see bhi_sensor_kind()
+ *
+ * Hub ticks are 1/64000 s. Ids 0xfb-0xfe are the wake-up FIFO copies of
+ * 0xf5-0xf8. Sample events take the current timestamp.
+ */
+#define BHI_TICK_HZ 64000
+
+enum bhi_kind {
+    BHI_KIND_NONE,     // Unknown id: the frame cannot be parsed further
+    BHI_KIND_EVENT,    // No payload (step detector, gestures)
+    BHI_KIND_VEC3,     // le16 x, y, z
+    BHI_KIND_QUAT,     // le16 x, y, z, w, accuracy
+    BHI_KIND_EULER,    // le16 heading, pitch, roll
+    BHI_KIND_S16,      // le16 (temperature)
+    BHI_KIND_U8,       // u8 (humidity)
+    BHI_KIND_U24,      // le24 (pressure)
+    BHI_KIND_U32,      // le32 (step counter, gas)
+    BHI_KIND_TS,       // Timestamp event
+    BHI_KIND_META,     // Meta or debug event, skipped
+    BHI_KIND_PAD,
+};
+
+/* One sample event, pointing into the frame it was parsed from */
+struct bhi_record {
+    const uint8_t *data;  // Payload, after the sensor id
+    uint64_t ts;          // Hub time in ticks
+    uint8_t sensor;
+    uint8_t len;
+};
+
+/* Hub clock of one link, carried across notifications */
+struct bhi_decoder {
+    uint64_t ts;
+};
+
+struct bhi_decode_stats {
+    uint32_t frames;
+    uint32_t events;      // Sample events returned
+    uint32_t errors;      // Frames rejected
+    uint32_t truncated;   // Sample events beyond the records given, dropped
+    uint64_t cycles;      // Cycles spent in bhi_decode(), total
+    uint32_t cycles_max;  // Most cycles spent on one frame
+};
+
+enum bhi_kind bhi_sensor_kind(uint8_t sensor);
+
+/* Payload bytes following the id, 0 for BHI_KIND_NONE */
+uint8_t bhi_sensor_len(uint8_t sensor);
+
+/* Payload is a vector of le16 values the reduction stage can work on */
+static inline bool bhi_sensor_s16(uint8_t sensor)
+{
+    enum bhi_kind kind = bhi_sensor_kind(sensor);
+
+    return kind == BHI_KIND_VEC3 || kind == BHI_KIND_QUAT || kind == BHI_KIND_EULER ||
+           kind == BHI_KIND_S16;
+}
+
+/* Parse the frame in place into at most max sample records, advancing
+ * dec->ts. Returns the record count, -EBADMSG for an unknown sensor id or
+ * an event running past the end. Sample events beyond max are counted
+ * as truncated and dropped; the rest of the frame still moves the clock.
+ */
+int bhi_decode(struct bhi_decoder *dec, const uint8_t *buf, uint16_t len,
+               struct bhi_record *recs, int max);
+
+void bhi_decode_stats_get(struct bhi_decode_stats *stats);
+
+void bhi_decode_stats_reset(void);
+
+#endif /* BHI_DECODE_H_ */
@@ -0,0 +1,164 @@
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/uuid.h>
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+#include "agg_frame.h"
+#include "broadcast.h"
+
+/* The aggregate service of src/main.c, so listeners find the train by it */
+#define AGG_SERVICE_UUID \
+    BT_UUID_128_ENCODE(0xabcdef01, 0x2345, 0x6789, 0x0123, 0x456789abcdef)
+
+/* Periodic advertising interval, 1.25 ms units */
+#define PER_ADV_INTERVAL (CONFIG_BHI_BROADCAST_INTERVAL_MS * 4 / 5)
+
+BUILD_ASSERT(BROADCAST_FRAME_MAX <= AGG_FRAME_MAX_LEN);
+
+static const struct bt_data ext_ad[] = {
+    BT_DATA_BYTES(BT_DATA_UUID128_ALL, AGG_SERVICE_UUID),
+    BT_DATA(BT_DATA_NAME_COMPLETE, CONFIG_BT_DEVICE_NAME, (sizeof(CONFIG_BT_DEVICE_NAME) - 1)),
+};
+
+static struct bt_le_ext_adv *bcast_adv;
+static atomic_t bcast_up;
+
+/* Newest frame from the aggregate stage, guarded by bcast_lock */
+static struct k_spinlock bcast_lock;
+static uint8_t next_frame[BROADCAST_FRAME_MAX];
+static uint16_t next_len;
+
+/* Service data being advertised, system work queue only */
+static uint8_t svc_data[BROADCAST_HDR_LEN - 2 + BROADCAST_FRAME_MAX] = {AGG_SERVICE_UUID};
+static uint16_t bcast_seq;
+
+static struct broadcast_stats stats;
+
+static void bcast_update(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(bcast_work, bcast_update);
+
+/* Runs on the system work queue: the data update waits for the
+ * controller to take it.
+ */
+static void bcast_update(struct k_work *work)
+{
+    uint8_t *frame = &svc_data[BROADCAST_HDR_LEN - 2];
+    k_spinlock_key_t key = k_spin_lock(&bcast_lock);
+    uint16_t len = next_len;
+
+    if (len) {
+        memcpy(frame, next_frame, len);
+        next_len = 0;
+    }
+    k_spin_unlock(&bcast_lock, key);
+
+    if (len) {
+        struct bt_data ad = BT_DATA(BT_DATA_SVC_DATA128, svc_data,
+                                    BROADCAST_HDR_LEN - 2 + len);
+        int err;
+
+        sys_put_le16(bcast_seq, &svc_data[16]);
+        err = bt_le_per_adv_set_data(bcast_adv, &ad, 1);
+        if (err) {
+            printk("Broadcast update failed (err %d)\n", err);
+            stats.failed++;
+        } else {
+            bcast_seq++;
+            stats.updates++;
+        }
+    }
+
+    k_work_reschedule(&bcast_work, K_MSEC(CONFIG_BHI_BROADCAST_INTERVAL_MS));
+}
+
+int broadcast_init(void)
+{
+    int err;
+
+    err = bt_le_ext_adv_create(BT_LE_ADV_PARAM(BT_LE_ADV_OPT_EXT_ADV, BT_GAP_ADV_SLOW_INT_MIN,
+                                               BT_GAP_ADV_SLOW_INT_MAX, NULL),
+                               NULL, &bcast_adv);
+    if (err) {
+        printk("Broadcast set creation failed (err %d)\n", err);
+        return err;
+    }
+
+    err = bt_le_ext_adv_set_data(bcast_adv, ext_ad, ARRAY_SIZE(ext_ad), NULL, 0);
+    if (!err) {
+        err = bt_le_per_adv_set_param(bcast_adv, BT_LE_PER_ADV_PARAM(PER_ADV_INTERVAL,
+                                                                     PER_ADV_INTERVAL,
+                                                                     BT_LE_PER_ADV_OPT_NONE));
+    }
+    if (!err) {
+        err = bt_le_per_adv_start(bcast_adv);
+    }
+    if (!err) {
+        err = bt_le_ext_adv_start(bcast_adv, BT_LE_EXT_ADV_START_DEFAULT);
+    }
+    if (err) {
+        printk("Broadcast start failed (err %d)\n", err);
+        bt_le_ext_adv_delete(bcast_adv);
+        bcast_adv = NULL;
+        return err;
+    }
+
+    atomic_set(&bcast_up, 1);
+    k_work_reschedule(&bcast_work, K_MSEC(CONFIG_BHI_BROADCAST_INTERVAL_MS));
+    printk("Broadcasting the aggregate every %u ms\n", CONFIG_BHI_BROADCAST_INTERVAL_MS);
+    return 0;
+}
+
+bool broadcast_active(void)
+{
+    return atomic_get(&bcast_up);
+}
+
+void broadcast_frame(const void *data, uint16_t len)
+{
+    if (!broadcast_active() || len > BROADCAST_FRAME_MAX) {
+        return;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&bcast_lock);
+
+    if (next_len) {
+        stats.superseded++;
+    }
+    memcpy(next_frame, data, len);
+    next_len = len;
+    stats.frames++;
+    k_spin_unlock(&bcast_lock, key);
+}
+
+void broadcast_stats_get(struct broadcast_stats *out)
+{
+    k_spinlock_key_t key = k_spin_lock(&bcast_lock);
+
+    *out = stats;
+    k_spin_unlock(&bcast_lock, key);
+}
+
+#if defined(CONFIG_SHELL)
+static int cmd_broadcast(const struct shell *sh, size_t argc, char **argv)
+{
+    struct broadcast_stats s;
+
+    broadcast_stats_get(&s);
+    shell_print(sh, "%s, every %u ms: %u frames, %u updates, %u superseded, %u failed",
+                broadcast_active() ? "on" : "off", CONFIG_BHI_BROADCAST_INTERVAL_MS, s.frames,
+                s.updates, s.superseded, s.failed);
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((bhi), broadcast, NULL, "Periodic advertising of the aggregate",
+                 cmd_broadcast, 1, 0);
+#endif
@@ -0,0 +1,48 @@
+#ifndef BROADCAST_H_
+#define BROADCAST_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+
+/* Connectionless copy of the aggregate stream (CONFIG_BHI_BROADCAST). A
+ * non-connectable extended advertising set, running next to the
+ * connectable one phones use for control, carries a periodic advertising
+ * train. Every CONFIG_BHI_BROADCAST_INTERVAL_MS its data is replaced with
+ * the newest frame the aggregate stage finished, if there is one. Any
+ * number of listeners can sync to the train; an update costs one HCI
+ * command however many there are.
+ *
+ * Periodic advertising data, one service data AD structure:
+ *
+ *   | len | 0x21 | aggregate service UUID (16) | bcast_seq (2) | frame |
+ *
+ * frame is encoded exactly like the GATT notifications, see
+ * src/agg_frame.h. bcast_seq counts updates, so listeners see how many
+ * they missed. Frames finished between two updates only reach the
+ * connected phones.
+ */
+#define BROADCAST_HDR_LEN (2 + 16 + 2)
+/* The whole AD structure fits one AUX_SYNC_IND, no chaining needed */
+#define BROADCAST_FRAME_MAX (251 - BROADCAST_HDR_LEN)
+
+struct broadcast_stats {
+    uint32_t frames;       // Offered by the aggregate stage
+    uint32_t updates;      // Went on air
+    uint32_t superseded;   // Replaced by a newer frame before an update
+    uint32_t failed;
+};
+
+/* Create the advertising set and start the periodic train */
+int broadcast_init(void);
+
+/* True while the periodic train runs */
+bool broadcast_active(void);
+
+/* Offer a finished frame of at most BROADCAST_FRAME_MAX bytes. Called by
+ * the aggregate stage; copies and never blocks.
+ */
+void broadcast_frame(const void *data, uint16_t len);
+
+void broadcast_stats_get(struct broadcast_stats *stats);
+
+#endif /* BROADCAST_H_ */
@@ -0,0 +1,267 @@
+#include <errno.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/bluetooth/conn.h>
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+#include "conn_sched.h"
+#include "link.h"
+#include "link_params.h"
+#include "metrics.h"
+#include "subs.h"
+
+#define MAX_MULT CONFIG_BHI_CONN_SCHED_MAX_MULT
+
+BUILD_ASSERT(IS_POWER_OF_TWO(MAX_MULT), "Intervals are base * 2^n");
+
+/* Inter frame space between a packet and its acknowledgement */
+#define T_IFS_US 150
+
+/* What the scheduler knows about one connection, by bt_conn_index() */
+struct sched_conn {
+    const struct bt_conn *conn;   // NULL while the slot is unused
+    bool sensor;
+    bool primed;                  // msgs and bytes hold a measurement
+    uint8_t applied;              // Multiple last requested for it
+    uint32_t msgs;                // Counters at the last measurement
+    uint32_t bytes;
+    struct conn_sched_link load;
+    struct conn_sched_slot slot;  // mult 0 until the first plan
+};
+
+static struct sched_conn sched_conns[CONFIG_BT_MAX_CONN];
+static struct conn_sched_stats stats;
+static int64_t last_run;
+
+static void sched_run(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(sched_work, sched_run);
+
+/* On-air time of an LL data PDU without encryption: preamble, access
+ * address, header, payload and CRC
+ */
+static uint32_t air_us(uint8_t phy, uint16_t len)
+{
+    switch (phy) {
+    case BT_GAP_LE_PHY_2M:
+        return (2 + 4 + 2 + len + 3) * 4;
+    case BT_GAP_LE_PHY_CODED:
+        // S=8: 80 us preamble, 256 us access address, CI and TERM1, then 64 us/octet
+        return 80 + 256 + 16 + 24 + (2 + len + 3) * 64 + 24;
+    default:
+        return (1 + 4 + 2 + len + 3) * 8;
+    }
+}
+
+uint32_t conn_sched_packet_us(uint8_t phy, uint16_t len)
+{
+    return air_us(phy, len) + T_IFS_US + air_us(phy, 0) + T_IFS_US;
+}
+
+/* An event always carries one exchange, even without data */
+static uint32_t event_us(const struct conn_sched_link *l, uint32_t interval_us)
+{
+    uint32_t pkts = DIV_ROUND_UP((uint64_t)l->pkts_per_s * interval_us, USEC_PER_SEC);
+
+    return conn_sched_packet_us(l->phy, 0) + pkts * conn_sched_packet_us(l->phy, l->pkt_len);
+}
+
+int conn_sched_plan(const struct conn_sched_link *links, int n, uint32_t base_us,
+                    struct conn_sched_slot *slots)
+{
+    uint32_t budget = base_us * CONFIG_BHI_CONN_SCHED_LOAD_PCT / 100;
+    uint32_t booked = 0;
+
+    for (int i = 0; i < n; i++) {
+        slots[i].mult = 1;
+        slots[i].event_us = MIN(event_us(&links[i], base_us), UINT16_MAX);
+        booked += slots[i].event_us;
+    }
+
+    /* A link at mult m takes event_us / m of every base period */
+    while (booked > budget) {
+        int best = -1;
+        uint32_t best_event = 0;
+
+        for (int i = 0; i < n; i++) {
+            uint8_t mult = slots[i].mult * 2;
+
+            if (mult > MAX_MULT) {
+                continue;
+            }
+            uint32_t ev = event_us(&links[i], base_us * mult);
+
+            // Its events must still fit into one base period
+            if (ev > budget) {
+                continue;
+            }
+            if (best < 0 || slots[i].mult < slots[best].mult ||
+                (slots[i].mult == slots[best].mult &&
+                 links[i].pkts_per_s < links[best].pkts_per_s)) {
+                best = i;
+                best_event = ev;
+            }
+        }
+        if (best < 0) {
+            // Overbooked even at the longest intervals
+            break;
+        }
+
+        booked -= slots[best].event_us / slots[best].mult;
+        slots[best].mult *= 2;
+        slots[best].event_us = best_event;
+        booked += slots[best].event_us / slots[best].mult;
+    }
+
+    return booked * 100 / base_us;
+}
+
+/* Packet rate and size of a connection over the last period. Sensors
+ * send to us, we send to phones; each notification carries the L2CAP
+ * and ATT headers and is cut into LL payloads.
+ */
+static void sched_measure(struct sched_conn *sc, uint32_t msgs, uint32_t bytes,
+                          uint32_t elapsed_ms)
+{
+    const struct link_params_info *info = link_params_get(sc->conn);
+    uint32_t d_msgs = msgs >= sc->msgs ? msgs - sc->msgs : msgs;
+    uint32_t d_bytes = bytes >= sc->bytes ? bytes - sc->bytes : bytes;
+    uint16_t ll_len = info ? (sc->sensor ? info->rx_len : info->tx_len) : 27;
+    uint32_t octets = d_bytes + d_msgs * 7;
+    uint32_t pkts = MAX(d_msgs, DIV_ROUND_UP(octets, ll_len));
+    uint32_t rate = (uint64_t)pkts * MSEC_PER_SEC / MAX(elapsed_ms, 1);
+
+    sc->msgs = msgs;
+    sc->bytes = bytes;
+    if (!sc->primed) {
+        // The counters run across reconnects; this is only the baseline
+        sc->primed = true;
+        return;
+    }
+    // Smoothed so a burst does not move the link right away
+    sc->load.pkts_per_s = sc->slot.mult ? (sc->load.pkts_per_s * 3 + rate) / 4 : rate;
+    sc->load.pkt_len = pkts ? MIN(octets / pkts, ll_len) : 0;
+    sc->load.phy = info ? (sc->sensor ? info->rx_phy : info->tx_phy) : BT_GAP_LE_PHY_1M;
+}
+
+static void sched_run(struct k_work *work)
+{
+    struct bt_conn *conns[CONFIG_BT_MAX_CONN];
+    struct conn_sched_link links[CONFIG_BT_MAX_CONN];
+    struct conn_sched_slot slots[CONFIG_BT_MAX_CONN];
+    int64_t now = k_uptime_get();
+    uint32_t elapsed = now - last_run;
+    uint16_t base = link_params_conn_param()->interval_min;
+    int n = link_params_conns(conns, ARRAY_SIZE(conns));
+
+    last_run = now;
+
+    for (int i = 0; i < n; i++) {
+        struct sched_conn *sc = &sched_conns[bt_conn_index(conns[i])];
+        struct link *link = link_from_conn(conns[i]);
+        uint32_t msgs = 0;
+        uint32_t bytes = 0;
+
+        if (link) {
+            struct metrics_link m;
+
+            metrics_link_get(link->idx, &m);
+            msgs = m.rx_pkts;
+            bytes = m.rx_bytes;
+        } else {
+            (void)subs_traffic(conns[i], &msgs, &bytes);
+        }
+        sc->sensor = link != NULL;
+        sched_measure(sc, msgs, bytes, elapsed);
+        links[i] = sc->load;
+    }
+
+    stats.base = base;
+    stats.links = n;
+    stats.booked_pct = MIN(conn_sched_plan(links, n, base * 1250, slots), UINT8_MAX);
+    stats.plans++;
+
+    for (int i = 0; i < n; i++) {
+        struct sched_conn *sc = &sched_conns[bt_conn_index(conns[i])];
+
+        sc->slot = slots[i];
+        if (sc->slot.mult != sc->applied) {
+            stats.updates++;
+            link_params_refresh(conns[i]);
+        }
+        bt_conn_unref(conns[i]);
+    }
+
+    k_work_reschedule(&sched_work, K_MSEC(CONFIG_BHI_CONN_SCHED_PERIOD_MS));
+}
+
+void conn_sched_param(const struct bt_conn *conn, struct bt_le_conn_param *param)
+{
+    struct sched_conn *sc = &sched_conns[bt_conn_index(conn)];
+    uint8_t mult = sc->conn == conn && sc->slot.mult ? sc->slot.mult : 1;
+
+    sc->applied = mult;
+    param->interval_min = link_params_conn_param()->interval_min * mult;
+    param->interval_max = param->interval_min;
+}
+
+static void connected(struct bt_conn *conn, uint8_t err)
+{
+    struct sched_conn *sc = &sched_conns[bt_conn_index(conn)];
+
+    if (err) {
+        return;
+    }
+    *sc = (struct sched_conn) {
+        .conn = conn,
+    };
+}
+
+static void disconnected(struct bt_conn *conn, uint8_t reason)
+{
+    sched_conns[bt_conn_index(conn)].conn = NULL;
+}
+
+BT_CONN_CB_DEFINE(conn_sched_conn_callbacks) = {
+    .connected = connected,
+    .disconnected = disconnected,
+};
+
+void conn_sched_stats_get(struct conn_sched_stats *out)
+{
+    *out = stats;
+}
+
+void conn_sched_init(void)
+{
+    last_run = k_uptime_get();
+    k_work_reschedule(&sched_work, K_MSEC(CONFIG_BHI_CONN_SCHED_PERIOD_MS));
+}
+
+#if defined(CONFIG_SHELL)
+static int cmd_sched(const struct shell *sh, size_t argc, char **argv)
+{
+    shell_print(sh, "base %u.%02u ms, %u links, %u%% booked, %u plans, %u moves",
+                stats.base * 125 / 100, stats.base * 125 % 100, stats.links,
+                stats.booked_pct, stats.plans, stats.updates);
+    shell_print(sh, "conn %-7s %4s %8s %6s %6s %8s", "role", "mult", "interval", "pkt/s",
+                "len", "event_us");
+    for (int i = 0; i < ARRAY_SIZE(sched_conns); i++) {
+        const struct sched_conn *sc = &sched_conns[i];
+        uint32_t interval = stats.base * MAX(sc->slot.mult, 1) * 125;
+
+        if (!sc->conn) {
+            continue;
+        }
+        shell_print(sh, "%4d %-7s %4u %5u.%02u %6u %6u %8u", i, sc->sensor ? "sensor" : "phone",
+                    sc->slot.mult, interval / 100, interval % 100, sc->load.pkts_per_s,
+                    sc->load.pkt_len, sc->slot.event_us);
+    }
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((bhi), sched, NULL, "Connection event schedule", cmd_sched, 1, 0);
+#endif
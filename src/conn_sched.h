@@ -0,0 +1,63 @@
+#ifndef CONN_SCHED_H_
+#define CONN_SCHED_H_
+
+#include <zephyr/bluetooth/conn.h>
+
+/* Connection event scheduler for the sensor links and the phones.
+ *
+ * Every connection runs at a harmonic of one base period, the active
+ * profile's shortest interval: base, 2 * base, 4 * base, ... up to
+ * CONFIG_BHI_CONN_SCHED_MAX_MULT. With harmonic intervals the controller
+ * can lay the connection events out next to each other once and they
+ * never drift into each other, where free-running intervals collide and
+ * cost skipped events.
+ *
+ * Every CONFIG_BHI_CONN_SCHED_PERIOD_MS the scheduler measures each
+ * link's traffic, sizes the radio time one of its connection events
+ * needs at a given interval, and books the events into the base period.
+ * All links start at the base; while the booking exceeds
+ * CONFIG_BHI_CONN_SCHED_LOAD_PCT of it, the quietest link moves to the
+ * next harmonic, which saves its fixed per-event cost. Links whose
+ * multiple changed are renegotiated through link_params: sensors with
+ * their exact interval, phones with a request (bt_conn_le_param_update)
+ * that the phone may round, but only to another multiple of the base
+ * when the base is a multiple of 15 ms.
+ */
+struct conn_sched_link {
+    uint32_t pkts_per_s;   // LL data packets per second
+    uint16_t pkt_len;      // Average LL payload, octets
+    uint8_t phy;           // BT_GAP_LE_PHY_*
+};
+
+struct conn_sched_slot {
+    uint8_t mult;          // Interval is mult base periods
+    uint16_t event_us;     // Radio time one connection event needs
+};
+
+struct conn_sched_stats {
+    uint16_t base;         // Base period, 1.25 ms units
+    uint8_t links;
+    uint8_t booked_pct;    // Share of the base period booked
+    uint32_t plans;
+    uint32_t updates;      // Connections moved to another multiple
+};
+
+/* Radio time of one data packet of len octets and its acknowledgement */
+uint32_t conn_sched_packet_us(uint8_t phy, uint16_t len);
+
+/* Book n links into base periods of base_us. Fills slots and returns the
+ * share of the base period booked, in percent.
+ */
+int conn_sched_plan(const struct conn_sched_link *links, int n, uint32_t base_us,
+                    struct conn_sched_slot *slots);
+
+/* Give param the scheduled interval of conn. Connections not planned
+ * yet start at the base period.
+ */
+void conn_sched_param(const struct bt_conn *conn, struct bt_le_conn_param *param);
+
+void conn_sched_stats_get(struct conn_sched_stats *stats);
+
+void conn_sched_init(void);
+
+#endif /* CONN_SCHED_H_ */
@@ -0,0 +1,351 @@
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/bluetooth/uuid.h>
+#include <zephyr/settings/settings.h>
+
+#include "discovery.h"
+#include "metrics.h"
+#include "peers.h"
+#include "trace.h"
+
+/* Discovery stages, in the order they run */
+enum {
+    DISC_SVC,       // Peer's primary service, by UUID
+    DISC_CHRC,      // Stream characteristic inside it
+    DISC_CCC,       // Its CCCD
+    DISC_CMD_CCC,   // Command characteristic's CCCD
+    DISC_GATT_SVC,  // Generic Attribute service
+    DISC_SC_CHRC,   // Service Changed characteristic
+    DISC_SC_CCC,    // Its CCCD
+};
+
+#define CACHE_SUBTREE "bhi/gatt"
+/* "bhi/gatt/" + 12 hex address digits + address type */
+#define CACHE_KEY_LEN (sizeof(CACHE_SUBTREE) + 2 * BT_ADDR_SIZE + 2)
+
+static struct disc_handles cache[PEER_COUNT];
+static bool cache_valid[PEER_COUNT];
+static ATOMIC_DEFINE(cache_dirty, PEER_COUNT);
+
+static void cache_save_handler(struct k_work *work);
+static K_WORK_DEFINE(cache_save_work, cache_save_handler);
+
+/* Settings name suffix for a peer, e.g. "1c0ef0390aed1" */
+static void cache_key_suffix(int idx, char *buf, size_t len)
+{
+    const bt_addr_le_t *addr = &peer_get(idx)->addr;
+    size_t n = bin2hex(addr->a.val, sizeof(addr->a.val), buf, len);
+
+    if (n + 2 <= len) {
+        buf[n] = '0' + addr->type;
+        buf[n + 1] = '\0';
+    }
+}
+
+static void cache_key(int idx, char *buf, size_t len)
+{
+    int n = snprintk(buf, len, CACHE_SUBTREE "/");
+
+    cache_key_suffix(idx, buf + n, len - n);
+}
+
+static void cache_save_handler(struct k_work *work)
+{
+    char key[CACHE_KEY_LEN];
+
+    if (!IS_ENABLED(CONFIG_BHI_GATT_CACHE)) {
+        return;
+    }
+
+    for (int i = 0; i < PEER_COUNT; i++) {
+        if (!atomic_test_and_clear_bit(cache_dirty, i)) {
+            continue;
+        }
+        cache_key(i, key, sizeof(key));
+
+        int err = cache_valid[i] ?
+                  settings_save_one(key, &cache[i], sizeof(cache[i])) :
+                  settings_delete(key);
+        if (err) {
+            printk("GATT cache: saving %s failed (err %d)\n", key, err);
+        }
+    }
+}
+
+#if defined(CONFIG_BHI_GATT_CACHE)
+static int cache_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+    char suffix[CACHE_KEY_LEN];
+
+    for (int i = 0; i < PEER_COUNT; i++) {
+        cache_key_suffix(i, suffix, sizeof(suffix));
+        if (strcmp(name, suffix) != 0) {
+            continue;
+        }
+        if (len != sizeof(cache[i])) {
+            return -EINVAL;
+        }
+        if (read_cb(cb_arg, &cache[i], sizeof(cache[i])) == sizeof(cache[i])) {
+            cache_valid[i] = true;
+        }
+        return 0;
+    }
+
+    // Entry for a peer no longer in the table
+    return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(bhi_gatt, CACHE_SUBTREE, NULL, cache_set, NULL, NULL);
+#endif
+
+int disc_init(void)
+{
+    int err;
+
+    if (!IS_ENABLED(CONFIG_BHI_GATT_CACHE)) {
+        return 0;
+    }
+
+    err = settings_subsys_init();
+    if (!err) {
+        err = settings_load_subtree(CACHE_SUBTREE);
+    }
+    if (err) {
+        printk("GATT cache: load failed (err %d)\n", err);
+        return err;
+    }
+
+    for (int i = 0; i < PEER_COUNT; i++) {
+        if (cache_valid[i]) {
+            printk("GATT cache: device %d value 0x%04x ccc 0x%04x\n", i,
+                   cache[i].value_handle, cache[i].ccc_handle);
+        }
+    }
+    return 0;
+}
+
+void disc_invalidate(int idx)
+{
+    if (!cache_valid[idx]) {
+        return;
+    }
+    cache_valid[idx] = false;
+    atomic_set_bit(cache_dirty, idx);
+    k_work_submit(&cache_save_work);
+}
+
+static void disc_finish(struct disc_ctx *ctx, int err)
+{
+    if (!err) {
+        uint32_t ms = k_uptime_get() - ctx->start_time;
+
+        printk("Device %d - Discovery complete in %u ms\n", ctx->idx, ms);
+        metrics_discovery(ctx->idx, ms);
+
+        if (IS_ENABLED(CONFIG_BHI_GATT_CACHE)) {
+            cache[ctx->idx] = ctx->handles;
+            cache_valid[ctx->idx] = true;
+            atomic_set_bit(cache_dirty, ctx->idx);
+            k_work_submit(&cache_save_work);
+        }
+    } else {
+        printk("Device %d - Discovery failed at stage %u (err %d)\n", ctx->idx,
+               ctx->stage, err);
+    }
+
+    ctx->done(ctx, err);
+}
+
+static int disc_stage(struct disc_ctx *ctx, uint8_t stage, const struct bt_uuid *uuid,
+                      uint16_t start, uint16_t end)
+{
+    static const uint8_t types[] = {
+        [DISC_SVC] = BT_GATT_DISCOVER_PRIMARY,
+        [DISC_CHRC] = BT_GATT_DISCOVER_CHARACTERISTIC,
+        [DISC_CCC] = BT_GATT_DISCOVER_DESCRIPTOR,
+        [DISC_CMD_CCC] = BT_GATT_DISCOVER_DESCRIPTOR,
+        [DISC_GATT_SVC] = BT_GATT_DISCOVER_PRIMARY,
+        [DISC_SC_CHRC] = BT_GATT_DISCOVER_CHARACTERISTIC,
+        [DISC_SC_CCC] = BT_GATT_DISCOVER_DESCRIPTOR,
+    };
+
+    ctx->stage = stage;
+    ctx->range_end = end;
+    ctx->params.type = types[stage];
+    ctx->params.uuid = uuid;
+    ctx->params.start_handle = start;
+    ctx->params.end_handle = end;
+
+    if (start > end) {
+        return -ENOENT;
+    }
+    return bt_gatt_discover(ctx->conn, &ctx->params);
+}
+
+/* A characteristic declaration at handle ends the characteristics found
+ * before it
+ */
+static void disc_chrc_end(struct disc_ctx *ctx, uint16_t handle)
+{
+    if (ctx->handles.value_handle && !ctx->value_end) {
+        ctx->value_end = handle - 1;
+    }
+    if (ctx->handles.cmd_value_handle && !ctx->cmd_end) {
+        ctx->cmd_end = handle - 1;
+    }
+}
+
+static int disc_gatt_svc(struct disc_ctx *ctx)
+{
+    return disc_stage(ctx, DISC_GATT_SVC, BT_UUID_GATT, BT_ATT_FIRST_ATTRIBUTE_HANDLE,
+                      BT_ATT_LAST_ATTRIBUTE_HANDLE);
+}
+
+/* Service Changed is optional: without it the cache is only dropped on a
+ * failed subscribe.
+ */
+static void disc_sc_done(struct disc_ctx *ctx)
+{
+    if (!ctx->handles.sc_ccc_handle) {
+        ctx->handles.sc_value_handle = 0;
+    }
+    disc_finish(ctx, 0);
+}
+
+static uint8_t disc_func(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+                         struct bt_gatt_discover_params *params)
+{
+    struct disc_ctx *ctx = CONTAINER_OF(params, struct disc_ctx, params);
+    const struct peer *peer = peer_get(ctx->idx);
+    int err = 0;
+
+    if (attr) {
+        TRACE(TRACE_LEVEL_DEBUG, TRACE_DISC_ATTR, ctx->idx, &attr->handle, sizeof(attr->handle));
+    }
+
+    switch (ctx->stage) {
+    case DISC_SVC: {
+        if (!attr) {
+            disc_finish(ctx, -ENOENT);
+            return BT_GATT_ITER_STOP;
+        }
+        struct bt_gatt_service_val *svc = attr->user_data;
+        err = disc_stage(ctx, DISC_CHRC, NULL, attr->handle + 1, svc->end_handle);
+        break;
+    }
+    case DISC_CHRC: {
+        /* Walk the service's characteristics: the one after each of ours
+         * bounds the range its CCCD can be in.
+         */
+        if (attr) {
+            struct bt_gatt_chrc *chrc = attr->user_data;
+            const uint8_t cmd_props = BT_GATT_CHRC_WRITE_WITHOUT_RESP | BT_GATT_CHRC_INDICATE;
+
+            disc_chrc_end(ctx, attr->handle);
+            if (!ctx->handles.value_handle && !bt_uuid_cmp(chrc->uuid, &peer->chrc_uuid.uuid) &&
+                (chrc->properties & BT_GATT_CHRC_NOTIFY)) {
+                ctx->handles.value_handle = chrc->value_handle;
+            } else if (IS_ENABLED(CONFIG_BHI_CMD) && !ctx->handles.cmd_value_handle &&
+                       !bt_uuid_cmp(chrc->uuid, &peer->cmd_uuid.uuid) &&
+                       (chrc->properties & cmd_props) == cmd_props) {
+                ctx->handles.cmd_value_handle = chrc->value_handle;
+            }
+            return BT_GATT_ITER_CONTINUE;
+        }
+        if (!ctx->handles.value_handle) {
+            disc_finish(ctx, -ENOENT);
+            return BT_GATT_ITER_STOP;
+        }
+        disc_chrc_end(ctx, ctx->range_end + 1);
+        err = disc_stage(ctx, DISC_CCC, BT_UUID_GATT_CCC, ctx->handles.value_handle + 1,
+                         ctx->value_end);
+        break;
+    }
+    case DISC_CCC:
+        if (!attr) {
+            disc_finish(ctx, -ENOENT);
+            return BT_GATT_ITER_STOP;
+        }
+        ctx->handles.ccc_handle = attr->handle;
+        if (ctx->handles.cmd_value_handle) {
+            err = disc_stage(ctx, DISC_CMD_CCC, BT_UUID_GATT_CCC,
+                             ctx->handles.cmd_value_handle + 1, ctx->cmd_end);
+        } else {
+            err = disc_gatt_svc(ctx);
+        }
+        break;
+    case DISC_CMD_CCC:
+        if (attr) {
+            ctx->handles.cmd_ccc_handle = attr->handle;
+        } else {
+            // Responses come as indications, without them there is no command path
+            ctx->handles.cmd_value_handle = 0;
+        }
+        err = disc_gatt_svc(ctx);
+        break;
+    case DISC_GATT_SVC: {
+        if (!attr) {
+            disc_sc_done(ctx);
+            return BT_GATT_ITER_STOP;
+        }
+        struct bt_gatt_service_val *svc = attr->user_data;
+        err = disc_stage(ctx, DISC_SC_CHRC, BT_UUID_GATT_SC, attr->handle + 1, svc->end_handle);
+        break;
+    }
+    case DISC_SC_CHRC: {
+        if (!attr) {
+            disc_sc_done(ctx);
+            return BT_GATT_ITER_STOP;
+        }
+        struct bt_gatt_chrc *chrc = attr->user_data;
+        ctx->handles.sc_value_handle = chrc->value_handle;
+        err = disc_stage(ctx, DISC_SC_CCC, BT_UUID_GATT_CCC, chrc->value_handle + 1,
+                         ctx->range_end);
+        break;
+    }
+    case DISC_SC_CCC:
+        if (attr) {
+            ctx->handles.sc_ccc_handle = attr->handle;
+        }
+        disc_sc_done(ctx);
+        return BT_GATT_ITER_STOP;
+    }
+
+    if (err) {
+        disc_finish(ctx, err);
+    }
+    return BT_GATT_ITER_STOP;
+}
+
+int disc_start(struct disc_ctx *ctx, struct bt_conn *conn, int idx, bool use_cache,
+               disc_done_cb done)
+{
+    int err;
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->conn = conn;
+    ctx->idx = idx;
+    ctx->done = done;
+    ctx->start_time = k_uptime_get();
+    ctx->params.func = disc_func;
+
+    if (use_cache && cache_valid[idx]) {
+        printk("Device %d - Using cached GATT handles\n", idx);
+        ctx->handles = cache[idx];
+        ctx->from_cache = true;
+        done(ctx, 0);
+        return 0;
+    }
+
+    printk("Starting discovery for device %d\n", idx);
+    err = disc_stage(ctx, DISC_SVC, &peer_get(idx)->svc_uuid.uuid,
+                     BT_ATT_FIRST_ATTRIBUTE_HANDLE, BT_ATT_LAST_ATTRIBUTE_HANDLE);
+    if (err) {
+        printk("Discover failed for device %d (err %d)\n", idx, err);
+    }
+    return err;
+}
@@ -0,0 +1,56 @@
+#ifndef DISCOVERY_H_
+#define DISCOVERY_H_
+
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/gatt.h>
+
+/* Handles needed to stream from one peer. Persisted per configured peer
+ * address when CONFIG_BHI_GATT_CACHE is enabled, so a reconnect can
+ * subscribe without any discovery round trips. The central does not
+ * pair: the peer table stands in for the bond list.
+ */
+struct disc_handles {
+    uint16_t value_handle;
+    uint16_t ccc_handle;
+    uint16_t sc_value_handle;  // 0 if the peer has no Service Changed characteristic
+    uint16_t sc_ccc_handle;
+    uint16_t cmd_value_handle; // 0 if the peer takes no commands, see src/sensor_cmd.h
+    uint16_t cmd_ccc_handle;
+};
+
+struct disc_ctx;
+typedef void (*disc_done_cb)(struct disc_ctx *ctx, int err);
+
+/* One per link, so discoveries on different links can run concurrently */
+struct disc_ctx {
+    struct bt_gatt_discover_params params;
+    struct disc_handles handles;
+    struct bt_conn *conn;
+    disc_done_cb done;
+    int idx;            // Peer index
+    uint8_t stage;
+    uint16_t range_end; // End of the range the current stage searches
+    uint16_t value_end; // Last handle of the stream characteristic, 0 until known
+    uint16_t cmd_end;   // ... and of the command characteristic
+    bool from_cache;
+    int64_t start_time;
+};
+
+/* Load cached handles. Call once after bt_enable() and peers_init(). */
+int disc_init(void);
+
+/* Resolve the handles for peer idx on conn. With use_cache, cached handles
+ * are reported right away; otherwise, or when nothing is cached, the
+ * peer's service, characteristic and CCCD are discovered by UUID. With
+ * CONFIG_BHI_CMD the command characteristic is found by the peer's
+ * command UUID too, and only if it takes writes without response and
+ * indicates.
+ * done is called exactly once, possibly before disc_start() returns.
+ */
+int disc_start(struct disc_ctx *ctx, struct bt_conn *conn, int idx, bool use_cache,
+               disc_done_cb done);
+
+/* Forget the cached handles of peer idx */
+void disc_invalidate(int idx);
+
+#endif /* DISCOVERY_H_ */
@@ -0,0 +1,95 @@
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+
+#include "latest.h"
+#include "link.h"
+#include "peers.h"
+
+/* Attempts before a reader gives up on a slot that keeps changing */
+#define LATEST_READ_TRIES 4
+
+struct latest_slot {
+    atomic_t lock;      // Odd while the writer is in the slot
+    uint32_t ts;
+    uint16_t seq;
+    uint8_t len;        // 0 until the first sample
+    uint8_t data[CONFIG_BHI_LATEST_MAX_LEN];
+};
+
+static struct latest_slot slots[PEER_COUNT];
+
+/* One writer per link: the BT RX thread (or the simulated peers) */
+void latest_update(uint8_t dev, uint16_t seq, uint32_t ts, const uint8_t *data, uint16_t len)
+{
+    struct latest_slot *s = &slots[dev];
+
+    len = MIN(len, sizeof(s->data));
+
+    // The atomics are full barriers, the copy cannot leak out
+    atomic_inc(&s->lock);
+    s->ts = ts;
+    s->seq = seq;
+    s->len = len;
+    memcpy(s->data, data, len);
+    atomic_inc(&s->lock);
+}
+
+/* Copy a consistent slot into out, false if none could be had */
+static bool slot_read(const struct latest_slot *s, struct latest_slot *out)
+{
+    for (int i = 0; i < LATEST_READ_TRIES; i++) {
+        atomic_val_t before = atomic_get(&s->lock);
+
+        if (before & 1) {
+            k_yield();
+            continue;
+        }
+        out->ts = s->ts;
+        out->seq = s->seq;
+        out->len = MIN(s->len, sizeof(out->data));
+        memcpy(out->data, s->data, out->len);
+        if (atomic_get(&s->lock) == before) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint16_t latest_encode(uint8_t *buf, uint16_t size)
+{
+    uint16_t len = LATEST_HDR_LEN;
+    uint8_t links = 0;
+
+    if (size < LATEST_HDR_LEN) {
+        return 0;
+    }
+
+    for (int i = 0; i < PEER_COUNT; i++) {
+        struct latest_slot copy;
+
+        if (!slot_read(&slots[i], &copy) || copy.len == 0) {
+            continue;
+        }
+        if (len + LATEST_REC_HDR_LEN + copy.len > size) {
+            break;
+        }
+        buf[len] = i;
+        buf[len + 1] = link_get(i)->state;
+        buf[len + 2] = copy.len;
+        sys_put_le16(copy.seq, &buf[len + 3]);
+        sys_put_le32(copy.ts, &buf[len + 5]);
+        memcpy(&buf[len + LATEST_REC_HDR_LEN], copy.data, copy.len);
+        len += LATEST_REC_HDR_LEN + copy.len;
+        links++;
+    }
+
+    buf[0] = LATEST_VERSION;
+    buf[1] = links;
+    sys_put_le16(0, &buf[2]);
+    sys_put_le32((uint32_t)k_ticks_to_us_floor64(k_uptime_ticks()), &buf[4]);
+    return len;
+}
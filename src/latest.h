@@ -0,0 +1,31 @@
+#ifndef LATEST_H_
+#define LATEST_H_
+
+#include <zephyr/types.h>
+
+/* Latest sample of every link, the value of the aggregate characteristic
+ * for phones that poll instead of subscribing. Each slot is a seqlock:
+ * the RX path never waits, readers retry if a sample lands while they
+ * copy.
+ *
+ * Encoding, little endian:
+ *   u8 version, u8 links, u16 reserved, u32 now_us
+ *   per link with a sample: u8 dev, u8 link state, u8 len, u16 seq,
+ *     u32 ts_us, data (len, at most CONFIG_BHI_LATEST_MAX_LEN)
+ *
+ * Times are the central's uptime clock; now_us - ts_us is the age of the
+ * sample. The data is the notification as the sensor sent it.
+ */
+#define LATEST_VERSION 1
+#define LATEST_HDR_LEN 8
+#define LATEST_REC_HDR_LEN 9
+#define LATEST_ENCODED_MAX(links) \
+    (LATEST_HDR_LEN + (links) * (LATEST_REC_HDR_LEN + CONFIG_BHI_LATEST_MAX_LEN))
+
+/* Called for every sample received on link dev; longer payloads are cut */
+void latest_update(uint8_t dev, uint16_t seq, uint32_t ts, const uint8_t *data, uint16_t len);
+
+/* Fill buf with a snapshot of all links, returns the length */
+uint16_t latest_encode(uint8_t *buf, uint16_t size);
+
+#endif /* LATEST_H_ */
@@ -0,0 +1,612 @@
+#include <errno.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/gatt.h>
+
+#include "link.h"
+#include "link_params.h"
+#include "peers.h"
+#include "sensor_cmd.h"
+#include "trace.h"
+
+static struct link links[PEER_COUNT];
+static bt_gatt_notify_func_t stream_notify;
+
+/* Set while a connection is being created; the host allows only one */
+static atomic_t initiating;
+
+// Connection setup timing, reported as peers come up
+static int64_t scan_start_time;
+static bool all_streaming_reported;
+
+K_THREAD_STACK_DEFINE(link_wq_stack, CONFIG_BHI_LINK_WQ_STACK_SIZE);
+static struct k_work_q link_wq;
+
+static void scan_update(struct k_work *work);
+static K_WORK_DEFINE(scan_work, scan_update);
+static K_WORK_DELAYABLE_DEFINE(scan_escalate_work, scan_update);
+
+/* Scanning escalates: a fast scan while some peer has only just gone
+ * missing, then a duty-cycled background scan until it shows up.
+ */
+enum scan_mode {
+    SCAN_OFF,
+    SCAN_FAST,
+    SCAN_SLOW,
+};
+
+/* Scan timing in 0.625 ms units */
+#define SCAN_UNITS(ms) ((ms) * 8 / 5)
+
+static const struct {
+    uint16_t interval;
+    uint16_t window;
+} scan_timing[] = {
+    [SCAN_FAST] = { BT_GAP_SCAN_FAST_INTERVAL, BT_GAP_SCAN_FAST_WINDOW },
+    [SCAN_SLOW] = { SCAN_UNITS(CONFIG_BHI_SCAN_SLOW_INTERVAL_MS),
+                    SCAN_UNITS(CONFIG_BHI_SCAN_SLOW_WINDOW_MS) },
+};
+
+BUILD_ASSERT(CONFIG_BHI_SCAN_SLOW_WINDOW_MS <= CONFIG_BHI_SCAN_SLOW_INTERVAL_MS,
+             "Scan window must not exceed the scan interval");
+
+static struct k_spinlock scan_lock;
+static enum scan_mode scan_mode;
+static int64_t scan_mode_since;
+static int64_t scan_fast_until;
+static bool use_accept_list;
+static struct link_scan_stats scan_stats;
+
+static const char *const state_names[] = {
+    [LINK_SCANNING] = "scanning",
+    [LINK_CONNECTING] = "connecting",
+    [LINK_DISCOVERING] = "discovering",
+    [LINK_SUBSCRIBED] = "subscribed",
+    [LINK_STREAMING] = "streaming",
+    [LINK_BACKOFF] = "backoff",
+};
+
+const char *link_state_str(enum link_state state)
+{
+    return state_names[state];
+}
+
+struct link *link_get(int idx)
+{
+    return &links[idx];
+}
+
+struct link *link_from_conn(const struct bt_conn *conn)
+{
+    for (int i = 0; i < PEER_COUNT; i++) {
+        if (links[i].conn == conn) {
+            return &links[i];
+        }
+    }
+    return NULL;
+}
+
+void link_post(struct link *link, enum link_event evt)
+{
+    atomic_set_bit(&link->events, evt);
+    k_work_reschedule_for_queue(&link_wq, &link->work, K_NO_WAIT);
+}
+
+static void link_set_state(struct link *link, enum link_state state)
+{
+    if (link->state != state) {
+        printk("Device %d - %s -> %s\n", link->idx, state_names[link->state],
+               state_names[state]);
+        link->state = state;
+
+        if (state == LINK_SCANNING) {
+            // A peer just went missing: look for it with the fast scan again
+            link->scan_time = k_uptime_get();
+            scan_fast_until = link->scan_time + CONFIG_BHI_SCAN_FAST_MS;
+        }
+    }
+}
+
+/* Record a scanner change for the duty cycle statistics */
+static void scan_mode_set(enum scan_mode mode)
+{
+    k_spinlock_key_t key = k_spin_lock(&scan_lock);
+    int64_t now = k_uptime_get();
+    uint32_t elapsed = now - scan_mode_since;
+
+    if (scan_mode != SCAN_OFF) {
+        if (scan_mode == SCAN_FAST) {
+            scan_stats.fast_ms += elapsed;
+        } else {
+            scan_stats.slow_ms += elapsed;
+        }
+        scan_stats.radio_ms += (uint64_t)elapsed * scan_timing[scan_mode].window /
+                               scan_timing[scan_mode].interval;
+    }
+    scan_mode = mode;
+    scan_mode_since = now;
+
+    k_spin_unlock(&scan_lock, key);
+}
+
+void link_scan_stats_get(struct link_scan_stats *stats)
+{
+    // Fold in the time spent in the current mode
+    scan_mode_set(scan_mode);
+    *stats = scan_stats;
+    stats->accept_list = use_accept_list;
+}
+
+static bool all_streaming(void)
+{
+    for (int i = 0; i < PEER_COUNT; i++) {
+        if (links[i].state != LINK_STREAMING) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Service Changed on a peer: the cached layout is stale. Dropping the
+ * link makes the reconnect run a full discovery.
+ */
+static uint8_t sc_indicate_func(struct bt_conn *conn, struct bt_gatt_subscribe_params *params,
+                                const void *data, uint16_t length)
+{
+    struct link *link = CONTAINER_OF(params, struct link, sc_sub);
+
+    if (!data) {
+        return BT_GATT_ITER_CONTINUE;
+    }
+
+    printk("Device %d - Service Changed, invalidating GATT cache\n", link->idx);
+    disc_invalidate(link->idx);
+    bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+    return BT_GATT_ITER_STOP;
+}
+
+#if defined(CONFIG_BHI_CMD)
+/* Answer to a command from the phone, see src/sensor_cmd.h */
+static uint8_t cmd_indicate_func(struct bt_conn *conn, struct bt_gatt_subscribe_params *params,
+                                 const void *data, uint16_t length)
+{
+    struct link *link = CONTAINER_OF(params, struct link, cmd_sub);
+
+    if (data) {
+        TRACE(TRACE_LEVEL_INFO, TRACE_INDICATE, link->idx, data, length);
+        sensor_cmd_response(link->idx, data, length);
+    }
+    return BT_GATT_ITER_CONTINUE;
+}
+#endif
+
+static void subscribed(struct bt_conn *conn, uint8_t err, struct bt_gatt_subscribe_params *params)
+{
+    struct link *link = link_from_sub(params);
+
+    if (!err) {
+        link_post(link, LINK_EVT_SUBSCRIBED);
+        return;
+    }
+
+    printk("Device %d - Subscribe failed (err %d)\n", link->idx, err);
+
+    // Stale cached handles: forget them and discover the peer again
+    if (link->disc.from_cache) {
+        disc_invalidate(link->idx);
+        link_post(link, LINK_EVT_REDISCOVER);
+    } else {
+        link_post(link, LINK_EVT_SETUP_FAILED);
+    }
+}
+
+static void link_discovered(struct disc_ctx *ctx, int err)
+{
+    struct link *link = CONTAINER_OF(ctx, struct link, disc);
+
+    link_post(link, err ? LINK_EVT_SETUP_FAILED : LINK_EVT_DISCOVERED);
+}
+
+static int link_subscribe(struct link *link)
+{
+    const struct disc_handles *handles = &link->disc.handles;
+    int err;
+
+    link->sub.notify = stream_notify;
+    link->sub.subscribe = subscribed;
+    link->sub.value_handle = handles->value_handle;
+    link->sub.ccc_handle = handles->ccc_handle;
+    link->sub.value = BT_GATT_CCC_NOTIFY;
+    err = bt_gatt_subscribe(link->conn, &link->sub);
+    if (err == -EALREADY) {
+        // Subscription survived from the previous connection, no CCC write needed
+        link_post(link, LINK_EVT_SUBSCRIBED);
+    } else if (err) {
+        printk("Device %d - Subscribe failed (err %d)\n", link->idx, err);
+        return err;
+    }
+
+    if (handles->sc_ccc_handle) {
+        link->sc_sub.notify = sc_indicate_func;
+        link->sc_sub.value_handle = handles->sc_value_handle;
+        link->sc_sub.ccc_handle = handles->sc_ccc_handle;
+        link->sc_sub.value = BT_GATT_CCC_INDICATE;
+        err = bt_gatt_subscribe(link->conn, &link->sc_sub);
+        if (err && err != -EALREADY) {
+            printk("Device %d - Service Changed subscribe failed (err %d)\n", link->idx, err);
+        }
+    }
+
+#if defined(CONFIG_BHI_CMD)
+    if (handles->cmd_ccc_handle) {
+        link->cmd_sub.notify = cmd_indicate_func;
+        link->cmd_sub.value_handle = handles->cmd_value_handle;
+        link->cmd_sub.ccc_handle = handles->cmd_ccc_handle;
+        link->cmd_sub.value = BT_GATT_CCC_INDICATE;
+        err = bt_gatt_subscribe(link->conn, &link->cmd_sub);
+        if (err && err != -EALREADY) {
+            printk("Device %d - Command subscribe failed (err %d)\n", link->idx, err);
+        }
+    }
+#endif
+    return 0;
+}
+
+static void link_enter_backoff(struct link *link)
+{
+    if (link->conn) {
+        bt_conn_unref(link->conn);
+        link->conn = NULL;
+    }
+
+    link->backoff_ms = link->backoff_ms ?
+                       MIN(link->backoff_ms * 2, CONFIG_BHI_LINK_BACKOFF_MAX_MS) :
+                       CONFIG_BHI_LINK_BACKOFF_MIN_MS;
+    link->backoff_until = k_uptime_get() + link->backoff_ms;
+    link_set_state(link, LINK_BACKOFF);
+    printk("Device %d - Reconnecting in %u ms\n", link->idx, link->backoff_ms);
+}
+
+static void link_streaming(struct link *link, int64_t now)
+{
+    link_set_state(link, LINK_STREAMING);
+    link->backoff_ms = 0;
+
+    if (peer_get(link->idx)->role == PEER_ROLE_STREAM) {
+        printk("Device %d - First sample %u ms after connect (%s)\n", link->idx,
+               (uint32_t)(now - link->up_time),
+               link->disc.from_cache ? "cached handles" : "full discovery");
+    }
+    if (link->down_time) {
+        printk("Device %d - Streaming again %u ms after link loss\n", link->idx,
+               (uint32_t)(now - link->down_time));
+    }
+
+    if (!all_streaming_reported && all_streaming()) {
+        all_streaming_reported = true;
+        printk("All %d peers streaming %u ms after scan start\n", PEER_COUNT,
+               (uint32_t)(now - scan_start_time));
+    }
+}
+
+/* Connect to the peer of link, seen in the scan */
+static void link_connect(struct link *link)
+{
+    int err;
+
+    // Without parallel scan and initiate, the controller needs the scanner off
+    if (!IS_ENABLED(CONFIG_BT_SCAN_AND_INITIATE_IN_PARALLEL)) {
+        err = bt_le_scan_stop();
+        if (err && err != -EALREADY) {
+            printk("Stop LE scan failed (err %d)\n", err);
+        }
+        scan_mode_set(SCAN_OFF);
+    }
+
+    // The reference is kept until the link goes down
+    err = bt_conn_le_create(&peer_get(link->idx)->addr, BT_CONN_LE_CREATE_CONN,
+                            link_params_conn_param(), &link->conn);
+    if (err) {
+        printk("Device %d - Create conn failed (%d)\n", link->idx, err);
+        link->conn = NULL;
+        atomic_clear(&initiating);
+        return;
+    }
+
+    link_set_state(link, LINK_CONNECTING);
+}
+
+static void link_work_handler(struct k_work *work)
+{
+    struct link *link = CONTAINER_OF(k_work_delayable_from_work(work), struct link, work);
+    atomic_val_t events = atomic_clear(&link->events);
+    int64_t now = k_uptime_get();
+
+    if (events & BIT(LINK_EVT_FOUND)) {
+        if (link->state == LINK_SCANNING) {
+            link_connect(link);
+        } else {
+            atomic_clear(&initiating);
+        }
+    }
+
+    if (events & BIT(LINK_EVT_CONNECTED)) {
+        link->up_time = now;
+        if (peer_get(link->idx)->role == PEER_ROLE_PASSIVE) {
+            link_streaming(link, now);
+        } else {
+            link_set_state(link, LINK_DISCOVERING);
+            if (disc_start(&link->disc, link->conn, link->idx, true, link_discovered)) {
+                events |= BIT(LINK_EVT_SETUP_FAILED);
+            }
+        }
+    }
+
+    if (events & BIT(LINK_EVT_REDISCOVER) && link->state == LINK_DISCOVERING) {
+        if (disc_start(&link->disc, link->conn, link->idx, false, link_discovered)) {
+            events |= BIT(LINK_EVT_SETUP_FAILED);
+        }
+    }
+
+    if (events & BIT(LINK_EVT_DISCOVERED) && link->state == LINK_DISCOVERING) {
+        if (link_subscribe(link)) {
+            events |= BIT(LINK_EVT_SETUP_FAILED);
+        }
+    }
+
+    if (events & BIT(LINK_EVT_SUBSCRIBED) && link->state == LINK_DISCOVERING) {
+        link_set_state(link, LINK_SUBSCRIBED);
+    }
+
+    if (events & BIT(LINK_EVT_FIRST_SAMPLE) && link->state == LINK_SUBSCRIBED) {
+        link_streaming(link, now);
+    }
+
+    if (events & BIT(LINK_EVT_SETUP_FAILED) && link->conn) {
+        printk("Device %d - Link setup failed, disconnecting\n", link->idx);
+        bt_conn_disconnect(link->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+    }
+
+    if (events & (BIT(LINK_EVT_DISCONNECTED) | BIT(LINK_EVT_CONN_FAILED))) {
+        if (events & BIT(LINK_EVT_DISCONNECTED)) {
+            link->down_time = now;
+            link->reconnects++;
+        }
+        link_enter_backoff(link);
+    }
+
+    switch (link->state) {
+    case LINK_BACKOFF:
+        if (now >= link->backoff_until) {
+            link_set_state(link, LINK_SCANNING);
+        } else {
+            k_work_schedule_for_queue(&link_wq, &link->work,
+                                      K_MSEC(link->backoff_until - now));
+        }
+        break;
+    case LINK_DISCOVERING:
+        // Give up on peers that never finish discovery/subscription
+        if (now - link->up_time >= CONFIG_BHI_LINK_SETUP_TIMEOUT_MS) {
+            printk("Device %d - Link setup timed out\n", link->idx);
+            bt_conn_disconnect(link->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+        } else {
+            k_work_schedule_for_queue(&link_wq, &link->work,
+                K_MSEC(link->up_time + CONFIG_BHI_LINK_SETUP_TIMEOUT_MS - now));
+        }
+        break;
+#if defined(CONFIG_BHI_GATT_CACHE)
+    case LINK_SUBSCRIBED:
+        /* Cached handles can point at a CCCD that takes the write but
+         * no longer belongs to the stream
+         */
+        if (!link->disc.from_cache) {
+            break;
+        }
+        if (now - link->up_time >= CONFIG_BHI_LINK_FIRST_SAMPLE_MS) {
+            printk("Device %d - No sample on cached handles, rediscovering\n", link->idx);
+            disc_invalidate(link->idx);
+            bt_conn_disconnect(link->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+        } else {
+            k_work_schedule_for_queue(&link_wq, &link->work,
+                K_MSEC(link->up_time + CONFIG_BHI_LINK_FIRST_SAMPLE_MS - now));
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+
+    k_work_submit_to_queue(&link_wq, &scan_work);
+}
+
+static void connected(struct bt_conn *conn, uint8_t conn_err)
+{
+    struct link *link = link_from_conn(conn);
+
+    if (!link) {
+        return;
+    }
+
+    atomic_clear(&initiating);
+
+    if (conn_err) {
+        printk("Device %d - Failed to connect (err %d)\n", link->idx, conn_err);
+        link_post(link, LINK_EVT_CONN_FAILED);
+        return;
+    }
+
+    printk("Device %d - Connected %u ms after scan start\n", link->idx,
+           (uint32_t)(k_uptime_get() - link->scan_time));
+    link_post(link, LINK_EVT_CONNECTED);
+}
+
+static void disconnected(struct bt_conn *conn, uint8_t reason)
+{
+    struct link *link = link_from_conn(conn);
+
+    if (!link) {
+        return;
+    }
+
+    printk("Device %d - Disconnected (reason %d)\n", link->idx, reason);
+    link_post(link, LINK_EVT_DISCONNECTED);
+}
+
+BT_CONN_CB_DEFINE(link_conn_callbacks) = {
+    .connected = connected,
+    .disconnected = disconnected,
+};
+
+static void device_found(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
+                         struct net_buf_simple *ad)
+{
+    // With the accept list only our peers get here
+    int idx = peers_find(addr);
+    if (idx < 0) {
+        return;
+    }
+
+    /* The link's own work item connects: only it changes the link. The
+     * address matched the configured one exactly, so that is the one it
+     * connects to. One connection is created at a time.
+     */
+    struct link *link = &links[idx];
+    if (link->state != LINK_SCANNING || !atomic_cas(&initiating, 0, 1)) {
+        return;
+    }
+
+    TRACE(TRACE_LEVEL_INFO, TRACE_ADV_FOUND, idx, &rssi, sizeof(rssi));
+    link_post(link, LINK_EVT_FOUND);
+}
+
+/* Scan while any link is looking for its peer */
+static void scan_update(struct k_work *work)
+{
+    enum scan_mode mode = SCAN_OFF;
+    int64_t now = k_uptime_get();
+    int err;
+
+    for (int i = 0; i < PEER_COUNT; i++) {
+        if (links[i].state == LINK_SCANNING) {
+            mode = now < scan_fast_until ? SCAN_FAST : SCAN_SLOW;
+        }
+    }
+    if (atomic_get(&initiating) && !IS_ENABLED(CONFIG_BT_SCAN_AND_INITIATE_IN_PARALLEL)) {
+        mode = SCAN_OFF;
+    }
+
+    if (mode == SCAN_FAST) {
+        // Drop to the background scan once the fast period is over
+        k_work_reschedule_for_queue(&link_wq, &scan_escalate_work,
+                                    K_MSEC(scan_fast_until - now));
+    }
+    if (mode == scan_mode) {
+        return;
+    }
+
+    if (scan_mode != SCAN_OFF) {
+        err = bt_le_scan_stop();
+        if (err && err != -EALREADY) {
+            printk("Stop LE scan failed (err %d)\n", err);
+        }
+        scan_mode_set(SCAN_OFF);
+    }
+    if (mode == SCAN_OFF) {
+        return;
+    }
+
+    // Passive: advertising data is all we need to connect
+    struct bt_le_scan_param scan_param = {
+        .type = BT_LE_SCAN_TYPE_PASSIVE,
+        .options = use_accept_list ? BT_LE_SCAN_OPT_FILTER_ACCEPT_LIST : BT_LE_SCAN_OPT_NONE,
+        .interval = scan_timing[mode].interval,
+        .window = scan_timing[mode].window,
+    };
+
+    err = bt_le_scan_start(&scan_param, device_found);
+    if (err && err != -EALREADY) {
+        printk("Scanning failed to start (err %d)\n", err);
+        return;
+    }
+    scan_mode_set(mode);
+
+    if (mode == SCAN_FAST) {
+        printk("Scanning for peers (fast)\n");
+    } else {
+        printk("Scanning for peers (background, %u/%u ms)\n",
+               CONFIG_BHI_SCAN_SLOW_WINDOW_MS, CONFIG_BHI_SCAN_SLOW_INTERVAL_MS);
+    }
+}
+
+/* Let the controller drop advertising reports from everyone else */
+static void scan_accept_list_init(void)
+{
+#if defined(CONFIG_BHI_SCAN_ACCEPT_LIST)
+    int err = bt_le_filter_accept_list_clear();
+
+    for (int i = 0; !err && i < PEER_COUNT; i++) {
+        err = bt_le_filter_accept_list_add(&peer_get(i)->addr);
+    }
+    if (err) {
+        printk("Filter accept list setup failed (err %d), scanning unfiltered\n", err);
+        bt_le_filter_accept_list_clear();
+        return;
+    }
+    use_accept_list = true;
+#endif
+}
+
+int link_init(bt_gatt_notify_func_t notify)
+{
+    static const struct k_work_queue_config cfg = {
+        .name = "link_wq",
+    };
+
+    stream_notify = notify;
+    scan_accept_list_init();
+
+    for (int i = 0; i < PEER_COUNT; i++) {
+        links[i].idx = i;
+        links[i].state = LINK_SCANNING;
+        k_work_init_delayable(&links[i].work, link_work_handler);
+    }
+
+    k_work_queue_start(&link_wq, link_wq_stack, K_THREAD_STACK_SIZEOF(link_wq_stack),
+                       CONFIG_BHI_LINK_WQ_PRIORITY, &cfg);
+    return 0;
+}
+
+void link_start(void)
+{
+    scan_start_time = k_uptime_get();
+    scan_mode_since = scan_start_time;
+    scan_fast_until = scan_start_time + CONFIG_BHI_SCAN_FAST_MS;
+    for (int i = 0; i < PEER_COUNT; i++) {
+        links[i].scan_time = scan_start_time;
+    }
+    k_work_submit_to_queue(&link_wq, &scan_work);
+}
+
+#if defined(CONFIG_SHELL)
+static int cmd_scan(const struct shell *sh, size_t argc, char **argv)
+{
+    struct link_scan_stats s;
+    uint32_t elapsed = MAX(k_uptime_get() - scan_start_time, 1);
+    uint32_t permille;
+
+    link_scan_stats_get(&s);
+    permille = (uint64_t)s.radio_ms * 1000 / elapsed;
+    shell_print(sh, "accept list %s, fast %u ms, background %u ms, off %u ms",
+                s.accept_list ? "on" : "off", s.fast_ms, s.slow_ms,
+                elapsed - MIN(s.fast_ms + s.slow_ms, elapsed));
+    shell_print(sh, "scan duty cycle %u.%u%%", permille / 10, permille % 10);
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((bhi), scan, NULL, "Scanner time and duty cycle", cmd_scan, 1, 0);
+#endif
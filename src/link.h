@@ -0,0 +1,95 @@
+#ifndef LINK_H_
+#define LINK_H_
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/gatt.h>
+
+#include "discovery.h"
+
+/* Each sensor link runs its own state machine on the link work queue:
+ *
+ *   SCANNING -> CONNECTING -> DISCOVERING -> SUBSCRIBED -> STREAMING
+ *       ^                                                      |
+ *       +---------------- BACKOFF <---- (any failure) ---------+
+ *
+ * Links never wait for each other, so a healthy link keeps streaming
+ * while another one reconnects.
+ */
+enum link_state {
+    LINK_SCANNING,     // Waiting for the peer to show up in the scan
+    LINK_CONNECTING,   // Connection being created
+    LINK_DISCOVERING,  // Resolving GATT handles (cache or discovery)
+    LINK_SUBSCRIBED,   // CCCD written, waiting for the first sample
+    LINK_STREAMING,    // Samples flowing (passive peers: connected)
+    LINK_BACKOFF,      // Waiting before the next connection attempt
+};
+
+struct link {
+    int idx;                        // Peer index, also the device id sent to the phone
+    enum link_state state;
+    struct bt_conn *conn;
+    struct disc_ctx disc;
+    struct bt_gatt_subscribe_params sub;
+    struct bt_gatt_subscribe_params sc_sub;
+    struct bt_gatt_subscribe_params cmd_sub;   // Command answers, CONFIG_BHI_CMD
+    struct k_work_delayable work;
+    atomic_t events;                // Pending LINK_EVT_* bits for the work handler
+    uint32_t backoff_ms;
+    int64_t backoff_until;
+    int64_t scan_time;              // When the link started looking for its peer
+    int64_t up_time;                // When the current connection came up
+    int64_t down_time;              // When the last connection was lost, 0 if never
+    uint16_t rx_seq;                // Sample counter for the aggregate records
+    uint32_t reconnects;
+};
+
+enum link_event {
+    LINK_EVT_FOUND,             // Advertising seen while scanning, connect
+    LINK_EVT_CONNECTED,
+    LINK_EVT_CONN_FAILED,
+    LINK_EVT_DISCONNECTED,
+    LINK_EVT_DISCOVERED,
+    LINK_EVT_REDISCOVER,
+    LINK_EVT_SUBSCRIBED,
+    LINK_EVT_FIRST_SAMPLE,
+    LINK_EVT_SETUP_FAILED,
+};
+
+/* notify is installed on every stream subscription */
+int link_init(bt_gatt_notify_func_t notify);
+
+/* Begin scanning for all peers */
+void link_start(void);
+
+struct link_scan_stats {
+    uint32_t fast_ms;     // Time spent in the fast scan
+    uint32_t slow_ms;     // Time spent in the background scan
+    uint32_t radio_ms;    // Estimated scan window time, the radio cost
+    bool accept_list;     // Controller filters reports to our peers
+};
+
+void link_scan_stats_get(struct link_scan_stats *stats);
+
+struct link *link_get(int idx);
+struct link *link_from_conn(const struct bt_conn *conn);
+const char *link_state_str(enum link_state state);
+
+/* Queue an event for the link's state machine; callable from any context */
+void link_post(struct link *link, enum link_event evt);
+
+static inline struct link *link_from_sub(struct bt_gatt_subscribe_params *params)
+{
+    return CONTAINER_OF(params, struct link, sub);
+}
+
+/* Called by the notify handler for every sample */
+static inline void link_sample_received(struct link *link)
+{
+    if (unlikely(link->state == LINK_SUBSCRIBED)) {
+        link_post(link, LINK_EVT_FIRST_SAMPLE);
+    }
+}
+
+#endif /* LINK_H_ */
@@ -0,0 +1,354 @@
+#include <errno.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/gatt.h>
+
+#include "conn_sched.h"
+#include "link_params.h"
+
+/* Largest values the Core spec allows */
+#define CONN_INTERVAL_MAX 3200  // 4 s in 1.25 ms units
+#define CONN_TIMEOUT_MAX 3200   // 32 s in 10 ms units
+
+struct profile_cfg {
+    const char *name;
+    struct bt_le_conn_param conn_param;
+    uint8_t phy;       // Preferred PHY in both directions
+    bool dle;          // Request maximum data length
+};
+
+static const struct profile_cfg profiles[] = {
+    /* Long LL packets on 2M, intervals short enough that the phone's
+     * notification queue drains every event.
+     */
+    [LINK_PROFILE_MAX_THROUGHPUT] = {
+        .name = "max throughput",
+        .conn_param = BT_LE_CONN_PARAM_INIT(12, 24, 0, 400),
+        .phy = BT_GAP_LE_PHY_2M,
+        .dle = true,
+    },
+    [LINK_PROFILE_LOW_LATENCY] = {
+        .name = "low latency",
+        .conn_param = BT_LE_CONN_PARAM_INIT(6, 9, 0, 400),
+        .phy = BT_GAP_LE_PHY_2M,
+        .dle = true,
+    },
+    [LINK_PROFILE_LOW_POWER] = {
+        .name = "low power",
+        .conn_param = BT_LE_CONN_PARAM_INIT(80, 160, 4, 600),
+        .phy = BT_GAP_LE_PHY_1M,
+        .dle = false,
+    },
+};
+
+/* Indexed by bt_conn_index(), covers sensor links and the phone alike */
+struct lp_conn {
+    struct bt_conn *conn;
+    struct k_work work;
+    struct bt_gatt_exchange_params mtu_params;
+    bool mtu_exchanged;
+    struct link_params_info info;
+};
+
+static struct lp_conn lp_conns[CONFIG_BT_MAX_CONN];
+/* Guards the conn pointers against link_params_conns() */
+static struct k_spinlock lp_lock;
+static bool sensors_throttled;
+/* Profile parameters with the interval pinned to the schedule's base */
+static struct bt_le_conn_param create_param;
+
+static enum link_profile profile =
+    IS_ENABLED(CONFIG_BHI_LINK_PROFILE_LOW_LATENCY) ? LINK_PROFILE_LOW_LATENCY :
+    IS_ENABLED(CONFIG_BHI_LINK_PROFILE_LOW_POWER) ? LINK_PROFILE_LOW_POWER :
+    LINK_PROFILE_MAX_THROUGHPUT;
+
+static struct lp_conn *lp_conn_get(const struct bt_conn *conn)
+{
+    struct lp_conn *slot = &lp_conns[bt_conn_index(conn)];
+
+    return slot->conn == conn ? slot : NULL;
+}
+
+static const char *phy_str(uint8_t phy)
+{
+    switch (phy) {
+    case BT_GAP_LE_PHY_1M:
+        return "1M";
+    case BT_GAP_LE_PHY_2M:
+        return "2M";
+    case BT_GAP_LE_PHY_CODED:
+        return "coded";
+    default:
+        return "?";
+    }
+}
+
+static void lp_print(const struct lp_conn *slot)
+{
+    const struct link_params_info *info = &slot->info;
+
+    printk("Conn %u: MTU %u, DL %u/%u, PHY %s/%s, interval %u.%02u ms, latency %u\n",
+           bt_conn_index(slot->conn), info->mtu, info->tx_len, info->rx_len,
+           phy_str(info->tx_phy), phy_str(info->rx_phy),
+           info->interval * 125 / 100, info->interval * 125 % 100, info->latency);
+}
+
+static void mtu_exchanged(struct bt_conn *conn, uint8_t err, struct bt_gatt_exchange_params *params)
+{
+    if (err) {
+        printk("Conn %u: MTU exchange failed (err %u)\n", bt_conn_index(conn), err);
+    }
+}
+
+/* Runs on the system work queue: the PHY and data length requests wait
+ * for HCI command completion.
+ */
+static void lp_apply(struct k_work *work)
+{
+    struct lp_conn *slot = CONTAINER_OF(work, struct lp_conn, work);
+    const struct profile_cfg *cfg = &profiles[profile];
+    struct bt_conn *conn = slot->conn;
+    int err;
+
+    if (!conn) {
+        return;
+    }
+
+    if (!slot->mtu_exchanged) {
+        slot->mtu_exchanged = true;
+        slot->mtu_params.func = mtu_exchanged;
+        err = bt_gatt_exchange_mtu(conn, &slot->mtu_params);
+        if (err && err != -EALREADY) {
+            printk("Conn %u: MTU exchange failed (err %d)\n", bt_conn_index(conn), err);
+        }
+    }
+
+    if (IS_ENABLED(CONFIG_BT_USER_DATA_LEN_UPDATE)) {
+        err = bt_conn_le_data_len_update(conn, cfg->dle ? BT_LE_DATA_LEN_PARAM_MAX :
+                                               BT_LE_DATA_LEN_PARAM_DEFAULT);
+        if (err) {
+            printk("Conn %u: data length update failed (err %d)\n", bt_conn_index(conn), err);
+        }
+    }
+
+    if (IS_ENABLED(CONFIG_BT_USER_PHY_UPDATE)) {
+        err = bt_conn_le_phy_update(conn, BT_CONN_LE_PHY_PARAM(BT_CONN_LE_PHY_OPT_NONE,
+                                                               cfg->phy, cfg->phy));
+        if (err) {
+            printk("Conn %u: PHY update failed (err %d)\n", bt_conn_index(conn), err);
+        }
+    }
+
+    struct bt_le_conn_param param = cfg->conn_param;
+    struct bt_conn_info info;
+    if (IS_ENABLED(CONFIG_BHI_CONN_SCHED)) {
+        conn_sched_param(conn, &param);
+    }
+    if (sensors_throttled && bt_conn_get_info(conn, &info) == 0 &&
+        info.role == BT_CONN_ROLE_CENTRAL) {
+        param.interval_min *= CONFIG_BHI_LINK_THROTTLE_FACTOR;
+        param.interval_max *= CONFIG_BHI_LINK_THROTTLE_FACTOR;
+    }
+    param.interval_max = MIN(param.interval_max, CONN_INTERVAL_MAX);
+    param.interval_min = MIN(param.interval_min, param.interval_max);
+    /* Supervision timeout (10 ms units) must exceed 2 * (1 + latency) *
+     * interval, and the longest timeout only covers so much latency.
+     */
+    param.latency = MIN(param.latency, CONN_TIMEOUT_MAX * 2 / param.interval_max - 1);
+    param.timeout = CLAMP((1 + param.latency) * param.interval_max / 2, param.timeout,
+                          CONN_TIMEOUT_MAX);
+
+    err = bt_conn_le_param_update(conn, &param);
+    if (err && err != -EALREADY) {
+        printk("Conn %u: connection parameter update failed (err %d)\n",
+               bt_conn_index(conn), err);
+    }
+}
+
+static void connected(struct bt_conn *conn, uint8_t err)
+{
+    struct lp_conn *slot = &lp_conns[bt_conn_index(conn)];
+    struct bt_conn_info info;
+
+    if (err || bt_conn_get_info(conn, &info)) {
+        return;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&lp_lock);
+
+    slot->conn = bt_conn_ref(conn);
+    k_spin_unlock(&lp_lock, key);
+    slot->mtu_exchanged = false;
+    slot->info = (struct link_params_info) {
+        .mtu = bt_gatt_get_mtu(conn),
+        .tx_len = 27,
+        .rx_len = 27,
+        .tx_phy = BT_GAP_LE_PHY_1M,
+        .rx_phy = BT_GAP_LE_PHY_1M,
+        .interval = info.le.interval,
+        .latency = info.le.latency,
+        .timeout = info.le.timeout,
+    };
+    k_work_submit(&slot->work);
+}
+
+static void disconnected(struct bt_conn *conn, uint8_t reason)
+{
+    struct lp_conn *slot = lp_conn_get(conn);
+
+    if (slot) {
+        k_spinlock_key_t key = k_spin_lock(&lp_lock);
+
+        slot->conn = NULL;
+        k_spin_unlock(&lp_lock, key);
+        bt_conn_unref(conn);
+    }
+}
+
+static void le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency,
+                             uint16_t timeout)
+{
+    struct lp_conn *slot = lp_conn_get(conn);
+
+    if (slot) {
+        slot->info.interval = interval;
+        slot->info.latency = latency;
+        slot->info.timeout = timeout;
+        lp_print(slot);
+    }
+}
+
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+static void le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
+{
+    struct lp_conn *slot = lp_conn_get(conn);
+
+    if (slot) {
+        slot->info.tx_phy = param->tx_phy;
+        slot->info.rx_phy = param->rx_phy;
+        lp_print(slot);
+    }
+}
+#endif
+
+#if defined(CONFIG_BT_USER_DATA_LEN_UPDATE)
+static void le_data_len_updated(struct bt_conn *conn, struct bt_conn_le_data_len_info *info)
+{
+    struct lp_conn *slot = lp_conn_get(conn);
+
+    if (slot) {
+        slot->info.tx_len = info->tx_max_len;
+        slot->info.rx_len = info->rx_max_len;
+        lp_print(slot);
+    }
+}
+#endif
+
+BT_CONN_CB_DEFINE(link_params_conn_callbacks) = {
+    .connected = connected,
+    .disconnected = disconnected,
+    .le_param_updated = le_param_updated,
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+    .le_phy_updated = le_phy_updated,
+#endif
+#if defined(CONFIG_BT_USER_DATA_LEN_UPDATE)
+    .le_data_len_updated = le_data_len_updated,
+#endif
+};
+
+static void att_mtu_updated(struct bt_conn *conn, uint16_t tx, uint16_t rx)
+{
+    struct lp_conn *slot = lp_conn_get(conn);
+
+    if (slot) {
+        slot->info.mtu = MIN(tx, rx);
+        lp_print(slot);
+    }
+}
+
+static struct bt_gatt_cb gatt_callbacks = {
+    .att_mtu_updated = att_mtu_updated,
+};
+
+const struct bt_le_conn_param *link_params_conn_param(void)
+{
+    if (IS_ENABLED(CONFIG_BHI_CONN_SCHED)) {
+        // New sensor links start right on the base period
+        create_param = profiles[profile].conn_param;
+        create_param.interval_max = create_param.interval_min;
+        return &create_param;
+    }
+    return &profiles[profile].conn_param;
+}
+
+enum link_profile link_params_profile(void)
+{
+    return profile;
+}
+
+void link_params_set_profile(enum link_profile new_profile)
+{
+    profile = new_profile;
+    printk("Link profile: %s\n", profiles[profile].name);
+
+    for (int i = 0; i < ARRAY_SIZE(lp_conns); i++) {
+        if (lp_conns[i].conn) {
+            k_work_submit(&lp_conns[i].work);
+        }
+    }
+}
+
+void link_params_throttle_sensors(bool throttle)
+{
+    sensors_throttled = throttle;
+
+    for (int i = 0; i < ARRAY_SIZE(lp_conns); i++) {
+        struct bt_conn_info info;
+
+        if (lp_conns[i].conn && bt_conn_get_info(lp_conns[i].conn, &info) == 0 &&
+            info.role == BT_CONN_ROLE_CENTRAL) {
+            k_work_submit(&lp_conns[i].work);
+        }
+    }
+}
+
+void link_params_refresh(const struct bt_conn *conn)
+{
+    struct lp_conn *slot = lp_conn_get(conn);
+
+    if (slot) {
+        k_work_submit(&slot->work);
+    }
+}
+
+int link_params_conns(struct bt_conn **conns, int max)
+{
+    int n = 0;
+    k_spinlock_key_t key = k_spin_lock(&lp_lock);
+
+    for (int i = 0; i < ARRAY_SIZE(lp_conns) && n < max; i++) {
+        if (lp_conns[i].conn) {
+            conns[n++] = bt_conn_ref(lp_conns[i].conn);
+        }
+    }
+    k_spin_unlock(&lp_lock, key);
+    return n;
+}
+
+const struct link_params_info *link_params_get(const struct bt_conn *conn)
+{
+    struct lp_conn *slot = conn ? lp_conn_get(conn) : NULL;
+
+    return slot ? &slot->info : NULL;
+}
+
+void link_params_init(void)
+{
+    for (int i = 0; i < ARRAY_SIZE(lp_conns); i++) {
+        k_work_init(&lp_conns[i].work, lp_apply);
+    }
+    bt_gatt_cb_register(&gatt_callbacks);
+    printk("Link profile: %s\n", profiles[profile].name);
+}
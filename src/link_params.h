@@ -0,0 +1,55 @@
+#ifndef LINK_PARAMS_H_
+#define LINK_PARAMS_H_
+
+#include <zephyr/bluetooth/conn.h>
+
+/* After every connection, sensor or phone, the link-parameter manager
+ * exchanges the ATT MTU, requests the data length and PHY of the active
+ * profile and asks for its connection interval. The negotiated values
+ * are tracked per connection.
+ */
+enum link_profile {
+    LINK_PROFILE_MAX_THROUGHPUT,
+    LINK_PROFILE_LOW_LATENCY,
+    LINK_PROFILE_LOW_POWER,
+};
+
+struct link_params_info {
+    uint16_t mtu;          // ATT MTU
+    uint16_t tx_len;       // LL payload octets
+    uint16_t rx_len;
+    uint8_t tx_phy;        // BT_GAP_LE_PHY_*
+    uint8_t rx_phy;
+    uint16_t interval;     // Connection interval, 1.25 ms units
+    uint16_t latency;
+    uint16_t timeout;      // Supervision timeout, 10 ms units
+};
+
+/* Connection parameters of the active profile, for bt_conn_le_create().
+ * With CONFIG_BHI_CONN_SCHED the interval is pinned to the shortest.
+ */
+const struct bt_le_conn_param *link_params_conn_param(void);
+
+enum link_profile link_params_profile(void);
+
+/* Switch profile and renegotiate every open connection */
+void link_params_set_profile(enum link_profile profile);
+
+/* While throttled, sensor (central role) links use the profile's
+ * connection interval stretched by CONFIG_BHI_LINK_THROTTLE_FACTOR, which
+ * caps how fast the sensors can push samples at the hub.
+ */
+void link_params_throttle_sensors(bool throttle);
+
+/* Renegotiate conn, after its scheduled interval changed */
+void link_params_refresh(const struct bt_conn *conn);
+
+/* References to up to max tracked connections; the caller unrefs them */
+int link_params_conns(struct bt_conn **conns, int max);
+
+/* Negotiated values for conn, NULL if conn is not tracked */
+const struct link_params_info *link_params_get(const struct bt_conn *conn);
+
+void link_params_init(void);
+
+#endif /* LINK_PARAMS_H_ */
@@ -0,0 +1,339 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/shell/shell.h>
+
+#include "agg_frame.h"
+#include "merge.h"
+#include "metrics.h"
+#include "peers.h"
+
+BUILD_ASSERT(PEER_COUNT <= 8, "Epoch records carry a one byte link bitmap");
+
+#define EPOCH_US CONFIG_BHI_MERGE_EPOCH_US
+#define WINDOW_US (CONFIG_BHI_MERGE_WINDOW_MS * USEC_PER_MSEC)
+/* Silence this long means the link dropped: restart its clock model */
+#define RESYNC_GAP_US (250 * USEC_PER_MSEC)
+/* Largest epoch record payload that fits an MTU sized frame */
+#define EPOCH_MAX_LEN (AGG_FRAME_MAX_LEN - sizeof(struct agg_frame_hdr) - \
+                       sizeof(struct agg_rec_hdr))
+
+/* A copy, so held samples never tie up the sample pool */
+struct merge_sample {
+    uint32_t ts;              // Estimated acquisition time, central us
+    uint32_t rx_cyc;
+    uint8_t len;
+    uint8_t data[CONFIG_BHI_AGG_MAX_PAYLOAD];
+};
+
+/* One sensor of one link */
+struct merge_stream {
+    bool used;
+    uint8_t dev;
+    uint8_t sensor;           // BHI sensor id, 0 for raw notifications
+    struct merge_sample ring[CONFIG_BHI_MERGE_DEPTH];
+    uint8_t head;
+    uint8_t count;
+
+    // Clock model
+    bool synced;
+    uint32_t last_arrival;
+    uint32_t last_est;
+    uint32_t period_q8;       // Sample period, us * 256
+    int32_t latency_us;
+
+    uint32_t merged;
+    uint32_t decimated;
+    uint32_t late;
+};
+
+static struct merge_stream streams[CONFIG_BHI_MERGE_STREAMS];
+
+/* Next epoch to emit; idle while no samples are waiting */
+static uint32_t epoch_ts;
+static uint16_t epoch_seq;
+static bool epoch_started;
+static bool idle = true;
+
+static inline int32_t ts_diff(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b);
+}
+
+static uint32_t now_us(void)
+{
+    return (uint32_t)k_ticks_to_us_floor64(k_uptime_ticks());
+}
+
+static void period_track(struct merge_stream *m, uint32_t dt)
+{
+    int32_t period_q8 = dt << 8;
+
+    if (!m->period_q8) {
+        m->period_q8 = period_q8;
+    } else {
+        m->period_q8 += (period_q8 - (int32_t)m->period_q8) / 16;
+    }
+}
+
+/* When the sample was taken. A decoded hub event says so itself, see
+ * hub_clock_sync() in src/pipeline.c. For a raw notification it is
+ * estimated: arrivals can only lag acquisition, so an early arrival pulls
+ * the phase back at once and a late one only nudges it forward.
+ */
+static uint32_t clock_update(struct merge_stream *m, const struct agg_data_item *item)
+{
+    uint32_t arrival = item->sensor ? now_us() : item->timestamp;
+    bool resync = !m->synced || ts_diff(arrival, m->last_arrival) > RESYNC_GAP_US;
+    uint32_t est;
+
+    if (item->sensor) {
+        est = item->timestamp;
+        if (!resync && ts_diff(est, m->last_est) > 0) {
+            period_track(m, est - m->last_est);
+        }
+    } else if (resync) {
+        est = arrival;
+    } else {
+        period_track(m, arrival - m->last_arrival);
+        est = m->last_est + (m->period_q8 >> 8);
+        int32_t resid = ts_diff(arrival, est);
+        est += resid < 0 ? resid : resid / 32;
+    }
+
+    m->synced = true;
+    m->latency_us += (ts_diff(arrival, est) - m->latency_us) / 16;
+    m->last_arrival = arrival;
+    m->last_est = est;
+    return est;
+}
+
+static bool rings_empty(void)
+{
+    for (int i = 0; i < ARRAY_SIZE(streams); i++) {
+        if (streams[i].count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static struct merge_sample *ring_head(struct merge_stream *m)
+{
+    return m->count ? &m->ring[m->head] : NULL;
+}
+
+static void ring_pop(struct merge_stream *m)
+{
+    m->head = (m->head + 1) % CONFIG_BHI_MERGE_DEPTH;
+    m->count--;
+}
+
+/* Stream of (dev, sensor), taking a free slot or the one silent longest
+ * among those with nothing queued. NULL if every slot holds samples.
+ */
+static struct merge_stream *stream_get(uint8_t dev, uint8_t sensor)
+{
+    struct merge_stream *victim = NULL;
+
+    for (int i = 0; i < ARRAY_SIZE(streams); i++) {
+        struct merge_stream *m = &streams[i];
+
+        if (m->used && m->dev == dev && m->sensor == sensor) {
+            return m;
+        }
+        if (!m->used) {
+            if (!victim || victim->used) {
+                victim = m;
+            }
+        } else if (!m->count && (!victim || (victim->used &&
+                   ts_diff(m->last_arrival, victim->last_arrival) < 0))) {
+            victim = m;
+        }
+    }
+
+    if (victim) {
+        *victim = (struct merge_stream){
+            .used = true,
+            .dev = dev,
+            .sensor = sensor,
+        };
+    }
+    return victim;
+}
+
+void merge_add(const struct agg_data_item *item)
+{
+    struct merge_stream *m = stream_get(item->dev, item->sensor);
+
+    if (!m) {
+        // More live streams than slots
+        metrics_drop(item->dev);
+        return;
+    }
+
+    uint32_t ts = clock_update(m, item);
+
+    // Nearest epoch boundary
+    uint32_t epoch = (ts + EPOCH_US / 2) / EPOCH_US * EPOCH_US;
+
+    if (epoch_started && ts_diff(epoch, epoch_ts) < 0) {
+        // Its epoch has already gone out
+        m->late++;
+        return;
+    }
+
+    if (m->count == CONFIG_BHI_MERGE_DEPTH) {
+        metrics_drop(item->dev);
+        ring_pop(m);
+    }
+
+    struct merge_sample *s = &m->ring[(m->head + m->count) % CONFIG_BHI_MERGE_DEPTH];
+
+    s->ts = ts;
+    s->rx_cyc = item->rx_cyc;
+    s->len = item->len;
+    memcpy(s->data, item->data, item->len);
+    m->count++;
+
+    if (idle) {
+        // Skip the empty epochs since the last sample
+        if (!epoch_started || ts_diff(epoch, epoch_ts) > 0) {
+            epoch_seq += epoch_started ? ts_diff(epoch, epoch_ts) / EPOCH_US : 0;
+            epoch_ts = epoch;
+        }
+        epoch_started = true;
+        idle = false;
+    }
+}
+
+/* Pop the samples of m in the epoch and return the nearest one. It stays
+ * valid until the next merge_add().
+ */
+static const struct merge_sample *epoch_pick(struct merge_stream *m, uint32_t lo)
+{
+    const struct merge_sample *best = NULL;
+    const struct merge_sample *s;
+
+    // Sample times never go backwards within a stream, so the ring is in time order
+    while ((s = ring_head(m)) && ts_diff(s->ts, lo) < EPOCH_US) {
+        if (best) {
+            m->decimated++;
+        }
+        if (!best || abs(ts_diff(s->ts, epoch_ts)) < abs(ts_diff(best->ts, epoch_ts))) {
+            best = s;
+        }
+        ring_pop(m);
+    }
+    return best;
+}
+
+static void emit_epoch(merge_emit_fn emit)
+{
+    uint8_t buf[EPOCH_MAX_LEN];
+    uint32_t lo = epoch_ts - EPOCH_US / 2;
+    uint32_t rx_cyc = 0;
+    uint8_t links = 0;
+    uint16_t len = 0;
+
+    for (int i = 0; i < PEER_COUNT; i++) {
+        uint16_t count_at = len++;
+        uint8_t count = 0;
+
+        if (len > sizeof(buf)) {
+            break;
+        }
+        for (int j = 0; j < ARRAY_SIZE(streams); j++) {
+            struct merge_stream *m = &streams[j];
+            const struct merge_sample *item;
+
+            if (!m->used || m->dev != i || !(item = epoch_pick(m, lo))) {
+                continue;
+            }
+            if (len + 1 + item->len <= sizeof(buf)) {
+                buf[len] = item->len;
+                memcpy(&buf[len + 1], item->data, item->len);
+                len += 1 + item->len;
+                if (!links || ts_diff(item->rx_cyc, rx_cyc) < 0) {
+                    rx_cyc = item->rx_cyc;
+                }
+                count++;
+                m->merged++;
+            } else {
+                metrics_drop(i);
+            }
+        }
+
+        if (count) {
+            buf[count_at] = count;
+            links |= BIT(i);
+        } else {
+            len = count_at;
+        }
+    }
+
+    if (links) {
+        emit(links, epoch_seq, epoch_ts, buf, len, rx_cyc);
+    }
+}
+
+int32_t merge_poll(merge_emit_fn emit)
+{
+    uint32_t now = now_us();
+
+    while (!idle) {
+        // An epoch closes once the window has passed its last sample slot
+        int32_t until = ts_diff(epoch_ts + EPOCH_US / 2 + WINDOW_US, now);
+        if (until > 0) {
+            return DIV_ROUND_UP(until, USEC_PER_MSEC);
+        }
+
+        emit_epoch(emit);
+        epoch_ts += EPOCH_US;
+        epoch_seq++;
+        idle = rings_empty();
+    }
+    return -1;
+}
+
+int merge_stream_stats_get(int n, struct merge_stream_stats *stats)
+{
+    if (n < 0 || n >= ARRAY_SIZE(streams) || !streams[n].used) {
+        return -ENOENT;
+    }
+
+    const struct merge_stream *m = &streams[n];
+
+    stats->dev = m->dev;
+    stats->sensor = m->sensor;
+    stats->period_us = m->period_q8 >> 8;
+    stats->latency_us = m->latency_us;
+    stats->merged = m->merged;
+    stats->decimated = m->decimated;
+    stats->late = m->late;
+    return 0;
+}
+
+#if defined(CONFIG_SHELL)
+static int cmd_merge(const struct shell *sh, size_t argc, char **argv)
+{
+    shell_print(sh, "epoch %u us, window %u ms, next epoch %u", EPOCH_US,
+                CONFIG_BHI_MERGE_WINDOW_MS, epoch_seq);
+    for (int i = 0; i < CONFIG_BHI_MERGE_STREAMS; i++) {
+        struct merge_stream_stats s;
+
+        if (merge_stream_stats_get(i, &s)) {
+            continue;
+        }
+        shell_print(sh, "dev %u sensor %u: period %u us, latency %d us, merged %u, "
+                    "decimated %u, late %u", s.dev, s.sensor, s.period_us, s.latency_us,
+                    s.merged, s.decimated, s.late);
+    }
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((bhi), merge, NULL, "Merge engine clock estimates", cmd_merge, 1, 0);
+#endif
@@ -0,0 +1,58 @@
+#ifndef MERGE_H_
+#define MERGE_H_
+
+#include <zephyr/kernel.h>
+
+#include "agg_pool.h"
+
+/* Time-aligned merge of the sensor streams (CONFIG_BHI_AGG_FORMAT_MERGED).
+ *
+ * A stream is one sensor of one link: the link itself for raw
+ * notifications, each hub sensor id for decoded ones. Up to
+ * CONFIG_BHI_MERGE_STREAMS streams keep a small ring of samples each.
+ *
+ * Decoded hub events carry the hub's own sample time, already mapped to
+ * the central clock, so that is their acquisition time. Raw
+ * notifications carry no counter or time the hub understands; their
+ * acquisition time is estimated from arrivals, one arrival per sample:
+ * the period is tracked from arrival intervals and the phase follows the
+ * lower envelope of the arrival times, which strips connection event
+ * jitter. Samples batched into one connection event still look like one
+ * late sample each.
+ *
+ * Time is cut into fusion epochs of CONFIG_BHI_MERGE_EPOCH_US. Once an
+ * epoch is CONFIG_BHI_MERGE_WINDOW_MS in the past, one record is emitted
+ * carrying, for every stream, the sample nearest to the epoch time within
+ * half an epoch. Other samples in the same half-epoch are dropped, so
+ * fast sensors are decimated to the epoch rate.
+ */
+
+/* Epoch record payload: for each bit set in links, lowest first, u8
+ * count of that link's streams present, then u8 len and the sample for
+ * each. Decoded samples start with their sensor id.
+ */
+typedef void (*merge_emit_fn)(uint8_t links, uint16_t epoch_seq, uint32_t epoch_ts,
+                              const uint8_t *data, uint8_t len, uint32_t rx_cyc);
+
+struct merge_stream_stats {
+    uint8_t dev;
+    uint8_t sensor;         // BHI sensor id, 0 for raw notifications
+    uint32_t period_us;     // Estimated sample period
+    int32_t latency_us;     // Mean arrival time minus sample time
+    uint32_t merged;        // Samples placed in an epoch
+    uint32_t decimated;     // Samples beaten by a nearer one in their epoch
+    uint32_t late;          // Samples that arrived after their epoch closed
+};
+
+/* Hand a sample to the merge engine, which keeps a copy */
+void merge_add(const struct agg_data_item *item);
+
+/* Emit every epoch whose reorder window has closed. Returns the ms until
+ * the next epoch is due, or -1 when no samples are waiting.
+ */
+int32_t merge_poll(merge_emit_fn emit);
+
+/* Stream slot n, -ENOENT while it is unused */
+int merge_stream_stats_get(int n, struct merge_stream_stats *stats);
+
+#endif /* MERGE_H_ */
@@ -0,0 +1,283 @@
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/shell/shell.h>
+
+#include "bhi_decode.h"
+#include "link.h"
+#include "phone_l2cap.h"
+#include "metrics.h"
+#include "peers.h"
+#include "phone_tx.h"
+#include "pipeline.h"
+
+/* The rx counters have a single writer, the BT RX thread, so plain
+ * increments are enough there. The histograms take hist_lock since every
+ * subscriber's TX thread adds to the TX ones.
+ */
+struct link_counters {
+    uint32_t rx_pkts;
+    uint32_t rx_bytes;
+    atomic_t drops;
+    atomic_t queued;
+    uint32_t disc_ms;
+};
+
+static struct link_counters counters[PEER_COUNT];
+static uint32_t hists[METRICS_HIST_COUNT][METRICS_HIST_BUCKETS];
+static struct k_spinlock hist_lock;
+
+#if defined(CONFIG_BHI_METRICS)
+static void hist_add(enum metrics_hist hist, uint32_t start, uint32_t end)
+{
+    uint32_t us = k_cyc_to_us_floor32(end - start);
+    int bucket = 0;
+
+    if (us >= 64) {
+        bucket = MIN(31 - __builtin_clz(us) - 5, METRICS_HIST_BUCKETS - 1);
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&hist_lock);
+
+    hists[hist][bucket]++;
+    k_spin_unlock(&hist_lock, key);
+}
+
+void metrics_enqueue(const struct agg_data_item *item)
+{
+    struct link_counters *c = &counters[item->dev];
+
+    c->rx_pkts++;
+    c->rx_bytes += item->len;
+    atomic_inc(&c->queued);
+    hist_add(METRICS_HIST_RX, item->rx_cyc, item->enq_cyc);
+}
+
+void metrics_dequeue(const struct agg_data_item *item)
+{
+    atomic_dec(&counters[item->dev].queued);
+    hist_add(METRICS_HIST_QUEUE, item->enq_cyc, k_cycle_get_32());
+}
+
+void metrics_drop(uint8_t dev)
+{
+    if (dev < PEER_COUNT) {
+        atomic_inc(&counters[dev].drops);
+    }
+}
+
+void metrics_drop_queued(const struct agg_data_item *item)
+{
+    atomic_dec(&counters[item->dev].queued);
+    atomic_inc(&counters[item->dev].drops);
+}
+
+void metrics_tx_done(uint32_t rx_cyc)
+{
+    if (rx_cyc == 0) {
+        return;
+    }
+    hist_add(METRICS_HIST_E2E, rx_cyc, k_cycle_get_32());
+}
+
+void metrics_discovery(int idx, uint32_t ms)
+{
+    counters[idx].disc_ms = ms;
+}
+
+void metrics_service(enum metrics_hist hist, uint32_t start_cyc)
+{
+    hist_add(hist, start_cyc, k_cycle_get_32());
+}
+#endif
+
+void metrics_link_get(int idx, struct metrics_link *out)
+{
+    const struct link_counters *c = &counters[idx];
+
+    out->rx_pkts = c->rx_pkts;
+    out->rx_bytes = c->rx_bytes;
+    out->drops = atomic_get(&c->drops);
+    out->queued = atomic_get(&c->queued);
+    out->reconnects = link_get(idx)->reconnects;
+    out->disc_ms = c->disc_ms;
+}
+
+static uint32_t bucket_limit_us(int bucket)
+{
+    return 64U << bucket;
+}
+
+uint32_t metrics_percentile(enum metrics_hist hist, uint8_t pct)
+{
+    uint64_t total = 0;
+    uint64_t sum = 0;
+
+    for (int i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        total += hists[hist][i];
+    }
+    if (!total) {
+        return 0;
+    }
+
+    for (int i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        sum += hists[hist][i];
+        if (sum * 100 >= total * pct) {
+            return bucket_limit_us(i);
+        }
+    }
+    return bucket_limit_us(METRICS_HIST_BUCKETS - 1);
+}
+
+uint16_t metrics_encode(uint8_t *buf, uint16_t size)
+{
+    uint8_t *p = buf;
+
+    if (size < METRICS_ENCODED_LEN(PEER_COUNT)) {
+        return 0;
+    }
+
+    *p++ = METRICS_VERSION;
+    *p++ = PEER_COUNT;
+    sys_put_le16(0, p);
+    p += 2;
+    sys_put_le32(k_uptime_get_32(), p);
+    p += 4;
+
+    for (int i = 0; i < PEER_COUNT; i++) {
+        struct metrics_link m;
+
+        metrics_link_get(i, &m);
+        sys_put_le32(m.rx_pkts, p);
+        sys_put_le32(m.rx_bytes, p + 4);
+        sys_put_le32(m.drops, p + 8);
+        sys_put_le32(m.reconnects, p + 12);
+        sys_put_le16(MIN(m.queued, UINT16_MAX), p + 16);
+        sys_put_le16(MIN(m.disc_ms, UINT16_MAX), p + 18);
+        p += 20;
+    }
+
+    for (int h = 0; h < METRICS_HIST_COUNT; h++) {
+        sys_put_le32(metrics_percentile(h, 50), p);
+        sys_put_le32(metrics_percentile(h, 99), p + 4);
+        p += 8;
+    }
+
+    return p - buf;
+}
+
+void metrics_reset(void)
+{
+    for (int i = 0; i < PEER_COUNT; i++) {
+        counters[i].rx_pkts = 0;
+        counters[i].rx_bytes = 0;
+        atomic_set(&counters[i].drops, 0);
+    }
+    memset(hists, 0, sizeof(hists));
+}
+
+#if defined(CONFIG_SHELL)
+static const char *const hist_names[] = {
+    [METRICS_HIST_RX] = "rx->queue",
+    [METRICS_HIST_QUEUE] = "queue->worker",
+    [METRICS_HIST_E2E] = "rx->phone",
+    [METRICS_HIST_AGG_SVC] = "aggregate stage",
+    [METRICS_HIST_TX_SVC] = "tx stage",
+};
+
+static int cmd_stats(const struct shell *sh, size_t argc, char **argv)
+{
+    struct agg_pool_stats pool;
+    struct phone_tx_stats tx;
+    struct pipeline_stats pipe;
+
+    shell_print(sh, "dev %-10s %10s %10s %8s %6s %6s %8s", "state", "rx_pkts", "rx_bytes",
+                "drops", "queued", "reconn", "disc_ms");
+    for (int i = 0; i < PEER_COUNT; i++) {
+        struct metrics_link m;
+
+        metrics_link_get(i, &m);
+        shell_print(sh, "%3d %-10s %10u %10u %8u %6u %6u %8u", i,
+                    link_state_str(link_get(i)->state), m.rx_pkts, m.rx_bytes, m.drops,
+                    m.queued, m.reconnects, m.disc_ms);
+    }
+
+    for (int h = 0; h < METRICS_HIST_COUNT; h++) {
+        shell_print(sh, "%s: p50 < %u us, p99 < %u us", hist_names[h],
+                    metrics_percentile(h, 50), metrics_percentile(h, 99));
+        for (int i = 0; i < METRICS_HIST_BUCKETS; i++) {
+            if (hists[h][i]) {
+                shell_print(sh, "  < %7u us: %u", bucket_limit_us(i), hists[h][i]);
+            }
+        }
+    }
+
+    agg_pool_stats_get(&pool);
+    shell_print(sh, "pool: %u/%u in use, %u queued, high water %u, dropped %u",
+                pool.in_use, CONFIG_BHI_AGG_POOL_COUNT, pool.queued, pool.high_water,
+                pool.dropped);
+
+    pipeline_stats_get(&pipe);
+    shell_print(sh, "pipeline: rx queue %u, tx queues %u (max %u/%u), frames %u",
+                pipe.rx_queued, pipe.tx_queued, pipe.tx_queued_max,
+                CONFIG_BHI_SUBS_QUEUE, pipe.frames);
+    if (IS_ENABLED(CONFIG_BHI_AGG_DELTA) && pipe.coded_bytes) {
+        uint32_t ratio = (uint64_t)pipe.raw_bytes * 100 / pipe.coded_bytes;
+
+        shell_print(sh, "delta: %u -> %u sample bytes, ratio %u.%02u, %u keyframes",
+                    pipe.raw_bytes, pipe.coded_bytes, ratio / 100, ratio % 100, pipe.keyframes);
+    }
+
+    phone_tx_stats_get(&tx);
+    shell_print(sh, "phone: sent %u, retries %u, failed %u, in flight max %u, "
+                "policy drops %u, behind %u", tx.sent, tx.retries, tx.failed,
+                tx.inflight_max, tx.policy_drops, tx.behind_events);
+
+    if (IS_ENABLED(CONFIG_BHI_L2CAP)) {
+        struct phone_l2cap_stats l2;
+
+        phone_l2cap_stats_get(&l2);
+        shell_print(sh, "l2cap: PSM 0x%04x, %s, %u SDUs (%u B), failed %u",
+                    phone_l2cap_psm(), l2.mtu ? "open" : "closed", l2.sdus, l2.bytes,
+                    l2.failed);
+    }
+
+    if (IS_ENABLED(CONFIG_BHI_DECODE)) {
+        struct bhi_decode_stats dec;
+
+        bhi_decode_stats_get(&dec);
+        shell_print(sh, "decode: %u frames, %u events, %u rejected, %u truncated, "
+                    "%u ns/frame avg, %u max", dec.frames, dec.events, dec.errors, dec.truncated,
+                    dec.frames ? (uint32_t)k_cyc_to_ns_floor64(dec.cycles / dec.frames) : 0,
+                    (uint32_t)k_cyc_to_ns_floor64(dec.cycles_max));
+    }
+    return 0;
+}
+
+static int cmd_stats_reset(const struct shell *sh, size_t argc, char **argv)
+{
+    metrics_reset();
+    if (IS_ENABLED(CONFIG_BHI_DECODE)) {
+        bhi_decode_stats_reset();
+    }
+    shell_print(sh, "Counters and histograms cleared");
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(bhi_stats_cmds,
+    SHELL_CMD(reset, NULL, "Clear counters and histograms", cmd_stats_reset),
+    SHELL_SUBCMD_SET_END
+);
+
+/* Root of the "bhi" commands; other modules add theirs with
+ * SHELL_SUBCMD_ADD((bhi), ...).
+ */
+SHELL_SUBCMD_SET_CREATE(bhi_cmds, (bhi));
+SHELL_CMD_REGISTER(bhi, &bhi_cmds, "BHI central commands", NULL);
+
+SHELL_SUBCMD_ADD((bhi), stats, &bhi_stats_cmds, "Per-link counters and latency histograms",
+                 cmd_stats, 1, 1);
+#endif
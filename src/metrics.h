@@ -0,0 +1,97 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <zephyr/kernel.h>
+
+#include "agg_pool.h"
+
+/* Sample path instrumentation. Every sample is stamped with
+ * k_cycle_get_32() when notify_func is entered and when it is queued;
+ * the phone worker and the notification completion close the intervals.
+ * Recording is a few adds and a bucket lookup per sample, so it stays
+ * enabled in release builds.
+ *
+ * Latency histograms have METRICS_HIST_BUCKETS log2 buckets: bucket 0 is
+ * below 64 us, bucket n covers [32 << n, 64 << n) us and the last one
+ * is open-ended.
+ */
+#define METRICS_HIST_BUCKETS 16
+
+enum metrics_hist {
+    METRICS_HIST_RX,     // notify_func entry -> queued for the phone
+    METRICS_HIST_QUEUE,  // queued -> taken by the phone worker
+    METRICS_HIST_E2E,    // notify_func entry -> phone notification sent
+    METRICS_HIST_AGG_SVC,  // Aggregate stage time per sample
+    METRICS_HIST_TX_SVC,   // TX stage time per frame, credit wait included
+    METRICS_HIST_COUNT,
+};
+
+struct metrics_link {
+    uint32_t rx_pkts;
+    uint32_t rx_bytes;
+    uint32_t drops;       // Samples from this link that never reached the phone
+    uint32_t queued;      // Samples waiting for the phone worker
+    uint32_t reconnects;
+    uint32_t disc_ms;     // Duration of the last full GATT discovery
+};
+
+/* Stats characteristic value, little endian:
+ *   u8 version, u8 links, u16 reserved, u32 uptime_ms
+ *   per link: u32 rx_pkts, rx_bytes, drops, reconnects, u16 queued, disc_ms
+ *   per histogram: u32 p50_us, p99_us
+ */
+#define METRICS_VERSION 2
+#define METRICS_ENCODED_LEN(links) (8 + 20 * (links) + 8 * METRICS_HIST_COUNT)
+
+#if defined(CONFIG_BHI_METRICS)
+
+static inline uint32_t metrics_stamp(void)
+{
+    return k_cycle_get_32();
+}
+
+/* item->rx_cyc and item->enq_cyc must be set */
+void metrics_enqueue(const struct agg_data_item *item);
+
+void metrics_dequeue(const struct agg_data_item *item);
+
+/* A sample from dev was lost before being queued */
+void metrics_drop(uint8_t dev);
+
+/* A queued sample was discarded instead of being sent */
+void metrics_drop_queued(const struct agg_data_item *item);
+
+/* A notification holding a sample stamped rx_cyc left the stack; 0 for
+ * frames without a live sample (log replay)
+ */
+void metrics_tx_done(uint32_t rx_cyc);
+
+void metrics_discovery(int idx, uint32_t ms);
+
+/* A pipeline stage finished one unit of work started at start_cyc */
+void metrics_service(enum metrics_hist hist, uint32_t start_cyc);
+
+#else
+
+static inline uint32_t metrics_stamp(void) { return 0; }
+static inline void metrics_enqueue(const struct agg_data_item *item) {}
+static inline void metrics_dequeue(const struct agg_data_item *item) {}
+static inline void metrics_drop(uint8_t dev) {}
+static inline void metrics_drop_queued(const struct agg_data_item *item) {}
+static inline void metrics_tx_done(uint32_t rx_cyc) {}
+static inline void metrics_discovery(int idx, uint32_t ms) {}
+static inline void metrics_service(enum metrics_hist hist, uint32_t start_cyc) {}
+
+#endif
+
+void metrics_link_get(int idx, struct metrics_link *out);
+
+/* Upper bound in us of the bucket holding the given percentile, 0 if empty */
+uint32_t metrics_percentile(enum metrics_hist hist, uint8_t pct);
+
+/* Fill buf with the stats characteristic value, returns the length */
+uint16_t metrics_encode(uint8_t *buf, uint16_t size);
+
+void metrics_reset(void);
+
+#endif /* METRICS_H_ */
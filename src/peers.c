@@ -0,0 +1,117 @@
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+
+#include "peers.h"
+
+BUILD_ASSERT(DT_NODE_EXISTS(PEERS_NODE), "No bhi,sensor-peers node in devicetree");
+BUILD_ASSERT(PEER_COUNT > 0, "bhi,sensor-peers has no enabled peers");
+BUILD_ASSERT(PEER_COUNT < CONFIG_BT_MAX_CONN,
+             "CONFIG_BT_MAX_CONN must leave one connection for the phone");
+
+struct peer_cfg {
+    const char *name;
+    const char *addr;
+    const char *addr_type;
+    const char *svc_uuid;
+    const char *chrc_uuid;
+    const char *cmd_uuid;
+    enum peer_role role;
+};
+
+#define PEER_CFG(node)                                          \
+    {                                                           \
+        .name = DT_NODE_FULL_NAME(node),                        \
+        .addr = DT_PROP(node, address),                         \
+        .addr_type = DT_PROP(node, address_type),               \
+        .svc_uuid = DT_PROP(node, service_uuid),                \
+        .chrc_uuid = DT_PROP(node, characteristic_uuid),        \
+        .cmd_uuid = DT_PROP(node, command_uuid),                \
+        .role = DT_ENUM_IDX(node, role),                        \
+    },
+
+static const struct peer_cfg peer_cfgs[] = {
+    DT_FOREACH_CHILD_STATUS_OKAY(PEERS_NODE, PEER_CFG)
+};
+
+static struct peer peers[PEER_COUNT];
+
+/* "12345678-1234-5678-1234-56789abcdef0" to a little-endian 128-bit UUID */
+static int uuid128_from_str(const char *str, struct bt_uuid_128 *uuid)
+{
+    char hex[2 * BT_UUID_SIZE_128];
+    size_t n = 0;
+
+    for (; *str; str++) {
+        if (*str == '-') {
+            continue;
+        }
+        if (n == sizeof(hex)) {
+            return -EINVAL;
+        }
+        hex[n++] = *str;
+    }
+
+    uint8_t be[BT_UUID_SIZE_128];
+    if (n != sizeof(hex) || hex2bin(hex, n, be, sizeof(be)) != sizeof(be)) {
+        return -EINVAL;
+    }
+
+    uuid->uuid.type = BT_UUID_TYPE_128;
+    for (int i = 0; i < BT_UUID_SIZE_128; i++) {
+        uuid->val[i] = be[BT_UUID_SIZE_128 - 1 - i];
+    }
+    return 0;
+}
+
+int peers_init(void)
+{
+    for (int i = 0; i < PEER_COUNT; i++) {
+        const struct peer_cfg *cfg = &peer_cfgs[i];
+        struct peer *p = &peers[i];
+        int err;
+
+        p->name = cfg->name;
+        p->role = cfg->role;
+
+        err = bt_addr_le_from_str(cfg->addr, cfg->addr_type, &p->addr);
+        if (err) {
+            printk("Peer %s: bad address %s (err %d)\n", cfg->name, cfg->addr, err);
+            return err;
+        }
+
+        err = uuid128_from_str(cfg->svc_uuid, &p->svc_uuid);
+        if (!err) {
+            err = uuid128_from_str(cfg->chrc_uuid, &p->chrc_uuid);
+        }
+        if (!err) {
+            err = uuid128_from_str(cfg->cmd_uuid, &p->cmd_uuid);
+        }
+        if (err) {
+            printk("Peer %s: bad service/characteristic/command UUID\n", cfg->name);
+            return err;
+        }
+
+        printk("Peer %d: %s %s\n", i, cfg->name, cfg->addr);
+    }
+
+    return 0;
+}
+
+const struct peer *peer_get(int idx)
+{
+    return &peers[idx];
+}
+
+int peers_find(const bt_addr_le_t *addr)
+{
+    for (int i = 0; i < PEER_COUNT; i++) {
+        if (bt_addr_le_cmp(&peers[i].addr, addr) == 0) {
+            return i;
+        }
+    }
+    return -ENOENT;
+}
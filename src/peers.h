@@ -0,0 +1,36 @@
+#ifndef PEERS_H_
+#define PEERS_H_
+
+#include <zephyr/devicetree.h>
+#include <zephyr/bluetooth/addr.h>
+#include <zephyr/bluetooth/uuid.h>
+
+/* Sensor peripherals come from the "bhi,sensor-peers" devicetree node,
+ * see app.overlay and dts/bindings/bhi,sensor-peers.yaml.
+ */
+#define PEERS_NODE DT_INST(0, bhi_sensor_peers)
+#define PEER_COUNT DT_CHILD_NUM_STATUS_OKAY(PEERS_NODE)
+
+enum peer_role {
+    PEER_ROLE_STREAM,   // Subscribe and forward notifications to the phone
+    PEER_ROLE_PASSIVE,  // Keep the link up only
+};
+
+struct peer {
+    const char *name;
+    bt_addr_le_t addr;
+    struct bt_uuid_128 svc_uuid;
+    struct bt_uuid_128 chrc_uuid;
+    struct bt_uuid_128 cmd_uuid;
+    enum peer_role role;
+};
+
+/* Parse the devicetree table. Must run before scanning starts. */
+int peers_init(void);
+
+const struct peer *peer_get(int idx);
+
+/* Index of the peer with this address, or -ENOENT */
+int peers_find(const bt_addr_le_t *addr);
+
+#endif /* PEERS_H_ */
@@ -0,0 +1,175 @@
+#include <errno.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/l2cap.h>
+
+#include "metrics.h"
+#include "phone_l2cap.h"
+
+#define SDUS CONFIG_BHI_L2CAP_TX_SDUS
+
+NET_BUF_POOL_FIXED_DEFINE(sdu_pool, SDUS, BT_L2CAP_SDU_BUF_SIZE(CONFIG_BHI_L2CAP_SDU_LEN),
+                          CONFIG_BT_CONN_TX_USER_DATA_SIZE, NULL);
+
+static struct bt_l2cap_le_chan phone_chan;
+static atomic_t chan_in_use;
+static atomic_t chan_up;
+
+/* One count per SDU the stack may hold; the sent callback returns it */
+static K_SEM_DEFINE(sdu_sem, SDUS, SDUS);
+
+/* Metrics stamps of SDUs in flight; they complete in order */
+static uint32_t sdu_rx_cyc[SDUS];
+static uint8_t sdu_head;
+static uint8_t sdu_tail;
+
+static struct phone_l2cap_stats stats;
+
+static void chan_connected(struct bt_l2cap_chan *chan)
+{
+    sdu_head = 0;
+    sdu_tail = 0;
+    atomic_set(&chan_up, 1);
+    printk("Phone L2CAP channel up: SDU %u, MPS %u, %u credits\n", phone_chan.tx.mtu,
+           phone_chan.tx.mps, (unsigned int)atomic_get(&phone_chan.tx.credits));
+}
+
+static void chan_disconnected(struct bt_l2cap_chan *chan)
+{
+    printk("Phone L2CAP channel down\n");
+    atomic_set(&chan_up, 0);
+
+    // SDUs still queued were freed by the stack without a sent callback
+    k_sem_reset(&sdu_sem);
+    for (int i = 0; i < SDUS; i++) {
+        k_sem_give(&sdu_sem);
+    }
+    atomic_set(&chan_in_use, 0);
+}
+
+/* Control stays on GATT; anything the phone sends here is ignored */
+static int chan_recv(struct bt_l2cap_chan *chan, struct net_buf *buf)
+{
+    return 0;
+}
+
+static void chan_sent(struct bt_l2cap_chan *chan)
+{
+    metrics_tx_done(sdu_rx_cyc[sdu_tail]);
+    sdu_tail = (sdu_tail + 1) % SDUS;
+    k_sem_give(&sdu_sem);
+}
+
+static const struct bt_l2cap_chan_ops chan_ops = {
+    .connected = chan_connected,
+    .disconnected = chan_disconnected,
+    .recv = chan_recv,
+    .sent = chan_sent,
+};
+
+static int server_accept(struct bt_conn *conn, struct bt_l2cap_server *server,
+                         struct bt_l2cap_chan **chan)
+{
+    struct bt_conn_info info;
+
+    // Only the phone, and only one channel
+    if (bt_conn_get_info(conn, &info) || info.role != BT_CONN_ROLE_PERIPHERAL) {
+        return -EACCES;
+    }
+    if (!atomic_cas(&chan_in_use, 0, 1)) {
+        return -ENOMEM;
+    }
+
+    phone_chan.chan.ops = &chan_ops;
+    *chan = &phone_chan.chan;
+    return 0;
+}
+
+static struct bt_l2cap_server server = {
+    .psm = 0,   // Dynamic, published through the aggregate service
+    .sec_level = BT_SECURITY_L1,
+    .accept = server_accept,
+};
+
+int phone_l2cap_init(void)
+{
+    int err = bt_l2cap_server_register(&server);
+
+    if (err) {
+        printk("L2CAP server registration failed (err %d)\n", err);
+        return err;
+    }
+    printk("Phone L2CAP server on PSM 0x%04x\n", server.psm);
+    return 0;
+}
+
+uint16_t phone_l2cap_psm(void)
+{
+    return server.psm;
+}
+
+bool phone_l2cap_ready(void)
+{
+    return atomic_get(&chan_up);
+}
+
+struct bt_conn *phone_l2cap_conn(void)
+{
+    return phone_l2cap_ready() ? phone_chan.chan.conn : NULL;
+}
+
+uint16_t phone_l2cap_mtu(void)
+{
+    return MIN(phone_chan.tx.mtu, CONFIG_BHI_L2CAP_SDU_LEN);
+}
+
+int phone_l2cap_send(const void *data, uint16_t len, uint32_t rx_cyc)
+{
+    struct net_buf *buf;
+    int err;
+
+    if (!phone_l2cap_ready()) {
+        return -ENOTCONN;
+    }
+    if (len > phone_l2cap_mtu()) {
+        return -EMSGSIZE;
+    }
+
+    // Fails with -EAGAIN when the channel goes down while waiting
+    err = k_sem_take(&sdu_sem, K_FOREVER);
+    if (err) {
+        return err;
+    }
+
+    buf = net_buf_alloc(&sdu_pool, K_FOREVER);
+    net_buf_reserve(buf, BT_L2CAP_SDU_CHAN_SEND_RESERVE);
+    net_buf_add_mem(buf, data, len);
+
+    // Before the send, the sent callback may run first
+    sdu_rx_cyc[sdu_head] = rx_cyc;
+    sdu_head = (sdu_head + 1) % SDUS;
+
+    err = bt_l2cap_chan_send(&phone_chan.chan, buf);
+    if (err < 0) {
+        sdu_head = (sdu_head + SDUS - 1) % SDUS;
+        net_buf_unref(buf);
+        k_sem_give(&sdu_sem);
+        stats.failed++;
+        return err;
+    }
+
+    stats.sdus++;
+    stats.bytes += len;
+    return 0;
+}
+
+void phone_l2cap_stats_get(struct phone_l2cap_stats *out)
+{
+    *out = stats;
+    out->mtu = phone_l2cap_ready() ? phone_chan.tx.mtu : 0;
+    out->mps = phone_l2cap_ready() ? phone_chan.tx.mps : 0;
+}
@@ -0,0 +1,49 @@
+#ifndef PHONE_L2CAP_H_
+#define PHONE_L2CAP_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+#include <zephyr/bluetooth/conn.h>
+
+/* L2CAP connection-oriented channel for the phone stream. The phone reads
+ * the PSM from the aggregate service and opens an LE credit based
+ * channel on it. While the channel is up that phone's TX thread sends
+ * the aggregate frames over it instead of as notifications, packed into
+ * SDUs of up to CONFIG_BHI_L2CAP_SDU_LEN bytes:
+ *
+ *   sdu: | frame_len (2) | frame | frame_len (2) | frame | ...
+ *
+ * The stack segments SDUs to the phone's MPS and sends as the phone
+ * hands out credits. The GATT characteristics stay in place for phones
+ * without CoC support and for control. One phone at a time gets the
+ * channel; further subscribers stay on notifications.
+ */
+struct phone_l2cap_stats {
+    uint32_t sdus;
+    uint32_t bytes;
+    uint32_t failed;
+    uint16_t mtu;          // Phone's SDU limit on the open channel, 0 if closed
+    uint16_t mps;
+};
+
+int phone_l2cap_init(void);
+
+/* Dynamic PSM the server got, 0 if not registered */
+uint16_t phone_l2cap_psm(void);
+
+bool phone_l2cap_ready(void);
+
+/* Connection the channel is open on, NULL while closed */
+struct bt_conn *phone_l2cap_conn(void);
+
+/* Largest SDU the phone accepts right now */
+uint16_t phone_l2cap_mtu(void);
+
+/* Blocking send of one SDU, waiting for a free SDU slot. rx_cyc is the
+ * metrics stamp of the oldest sample in it.
+ */
+int phone_l2cap_send(const void *data, uint16_t len, uint32_t rx_cyc);
+
+void phone_l2cap_stats_get(struct phone_l2cap_stats *stats);
+
+#endif /* PHONE_L2CAP_H_ */
@@ -0,0 +1,162 @@
+#include <errno.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/bluetooth/gatt.h>
+
+#include "link_params.h"
+#include "metrics.h"
+#include "phone_tx.h"
+
+BUILD_ASSERT(CONFIG_BHI_PHONE_QUEUE_LOW_WM < CONFIG_BHI_PHONE_QUEUE_HIGH_WM,
+             "Phone queue low watermark must be below the high watermark");
+
+static const struct bt_gatt_attr *agg_attr;
+
+/* One credit per notification the stack may hold for us, per phone
+ * connection so a stalled phone does not starve the others. Indexed by
+ * bt_conn_index().
+ */
+static struct k_sem tx_credits[CONFIG_BT_MAX_CONN];
+
+static enum phone_tx_policy policy =
+    IS_ENABLED(CONFIG_BHI_PHONE_TX_POLICY_DECIMATE) ? PHONE_TX_DECIMATE :
+    IS_ENABLED(CONFIG_BHI_PHONE_TX_POLICY_THROTTLE) ? PHONE_TX_THROTTLE :
+    PHONE_TX_DROP_OLDEST;
+static bool behind;
+
+static struct phone_tx_stats stats;
+
+static void tx_complete(struct bt_conn *conn, void *user_data)
+{
+    metrics_tx_done((uint32_t)(uintptr_t)user_data);
+    k_sem_give(&tx_credits[bt_conn_index(conn)]);
+}
+
+int phone_tx_send(struct bt_conn *conn, const void *data, uint16_t len, uint32_t rx_cyc)
+{
+    struct bt_gatt_notify_params params = {
+        .attr = agg_attr,
+        .data = data,
+        .len = len,
+        .func = tx_complete,
+        .user_data = (void *)(uintptr_t)rx_cyc,
+    };
+    struct k_sem *credits = &tx_credits[bt_conn_index(conn)];
+    int64_t deadline = k_uptime_get() + CONFIG_BHI_PHONE_TX_RETRY_MS;
+    int err;
+
+    while (1) {
+        err = k_sem_take(credits, K_MSEC(CONFIG_BHI_PHONE_TX_RETRY_MS));
+        if (err) {
+            // No completion for a long time or the phone left
+            err = err == -EAGAIN && k_uptime_get() < deadline ? -ENOTCONN : -ETIMEDOUT;
+            break;
+        }
+
+        uint32_t inflight = CONFIG_BHI_PHONE_TX_INFLIGHT - k_sem_count_get(credits);
+        stats.inflight_max = MAX(stats.inflight_max, inflight);
+
+        err = bt_gatt_notify_cb(conn, &params);
+        if (!err) {
+            stats.sent++;
+            return 0;
+        }
+        k_sem_give(credits);
+
+        // Out of ATT/ACL buffers: wait for the controller to drain and retry
+        if (err != -ENOMEM || k_uptime_get() >= deadline) {
+            break;
+        }
+        stats.retries++;
+        k_sleep(K_MSEC(1));
+    }
+
+    stats.failed++;
+    printk("Failed to notify phone (err %d)\n", err);
+    return err;
+}
+
+void phone_tx_reset(struct bt_conn *conn)
+{
+    struct k_sem *credits = &tx_credits[bt_conn_index(conn)];
+
+    k_sem_reset(credits);
+    for (int i = 0; i < CONFIG_BHI_PHONE_TX_INFLIGHT; i++) {
+        k_sem_give(credits);
+    }
+}
+
+bool phone_tx_subscribed(struct bt_conn *conn)
+{
+    return agg_attr && bt_gatt_is_subscribed(conn, agg_attr, BT_GATT_CCC_NOTIFY);
+}
+
+static void set_behind(bool is_behind)
+{
+    behind = is_behind;
+    if (behind) {
+        stats.behind_events++;
+    }
+    printk("Phone %s (queue depth %u)\n", behind ? "falling behind" : "caught up",
+           agg_pool_depth());
+
+    if (policy == PHONE_TX_THROTTLE) {
+        link_params_throttle_sensors(behind);
+    }
+}
+
+bool phone_tx_admit(const struct agg_data_item *item)
+{
+    uint32_t depth = agg_pool_depth();
+
+    if (!behind && depth >= CONFIG_BHI_PHONE_QUEUE_HIGH_WM) {
+        set_behind(true);
+    } else if (behind && depth <= CONFIG_BHI_PHONE_QUEUE_LOW_WM) {
+        set_behind(false);
+    }
+
+    if (!behind) {
+        return true;
+    }
+
+    bool admit;
+    switch (policy) {
+    case PHONE_TX_DROP_OLDEST:
+        // The worker dequeues from the head, so this is the oldest sample
+        admit = false;
+        break;
+    case PHONE_TX_DECIMATE:
+        admit = (item->seq % CONFIG_BHI_PHONE_TX_DECIMATE_FACTOR) == 0;
+        break;
+    default:
+        admit = true;
+        break;
+    }
+
+    if (!admit) {
+        stats.policy_drops++;
+    }
+    return admit;
+}
+
+void phone_tx_set_policy(enum phone_tx_policy new_policy)
+{
+    if (behind && (policy == PHONE_TX_THROTTLE) != (new_policy == PHONE_TX_THROTTLE)) {
+        link_params_throttle_sensors(new_policy == PHONE_TX_THROTTLE);
+    }
+    policy = new_policy;
+}
+
+void phone_tx_stats_get(struct phone_tx_stats *out)
+{
+    *out = stats;
+}
+
+void phone_tx_init(const struct bt_gatt_attr *attr)
+{
+    for (int i = 0; i < ARRAY_SIZE(tx_credits); i++) {
+        k_sem_init(&tx_credits[i], CONFIG_BHI_PHONE_TX_INFLIGHT, CONFIG_BHI_PHONE_TX_INFLIGHT);
+    }
+    agg_attr = attr;
+}
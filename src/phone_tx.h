@@ -0,0 +1,57 @@
+#ifndef PHONE_TX_H_
+#define PHONE_TX_H_
+
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/gatt.h>
+
+#include "agg_pool.h"
+
+/* Notification sender for the phone links. Keeps up to
+ * CONFIG_BHI_PHONE_TX_INFLIGHT notifications per phone queued in the stack, using
+ * bt_gatt_notify_cb() completions as credits, and retries while the stack
+ * is out of buffers instead of dropping.
+ *
+ * It also watches the sample queue depth. Above the high watermark the
+ * phone is "behind" and the backpressure policy applies until the depth
+ * falls to the low watermark.
+ */
+enum phone_tx_policy {
+    PHONE_TX_DROP_OLDEST,  // Discard queued samples from the head
+    PHONE_TX_DECIMATE,     // Forward every Nth sample per device
+    PHONE_TX_THROTTLE,     // Stretch the sensor links' connection interval
+};
+
+struct phone_tx_stats {
+    uint32_t sent;
+    uint32_t retries;        // -ENOMEM from the stack, retried
+    uint32_t failed;         // Notifications given up on
+    uint32_t inflight_max;
+    uint32_t policy_drops;   // Samples skipped by the backpressure policy
+    uint32_t behind_events;  // Times the high watermark was crossed
+};
+
+void phone_tx_init(const struct bt_gatt_attr *attr);
+
+/* Blocking send of one notification on the aggregate characteristic.
+ * rx_cyc is the metrics stamp of the oldest sample in it.
+ */
+int phone_tx_send(struct bt_conn *conn, const void *data, uint16_t len, uint32_t rx_cyc);
+
+/* Forget notifications in flight on conn, call when a phone connects or
+ * disconnects. A send waiting for credits on it returns -ENOTCONN.
+ */
+void phone_tx_reset(struct bt_conn *conn);
+
+/* conn has notifications of the aggregate characteristic enabled */
+bool phone_tx_subscribed(struct bt_conn *conn);
+
+/* Apply backpressure for one dequeued sample. Returns false if the
+ * sample should not be forwarded.
+ */
+bool phone_tx_admit(const struct agg_data_item *item);
+
+void phone_tx_set_policy(enum phone_tx_policy policy);
+
+void phone_tx_stats_get(struct phone_tx_stats *stats);
+
+#endif /* PHONE_TX_H_ */
@@ -0,0 +1,512 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/printk.h>
+
+#include "agg_delta.h"
+#include "agg_frame.h"
+#include "agg_pool.h"
+#include "bhi_decode.h"
+#include "broadcast.h"
+#include "latest.h"
+#include "link.h"
+#include "merge.h"
+#include "metrics.h"
+#include "peers.h"
+#include "phone_tx.h"
+#include "pipeline.h"
+#include "rate_ctl.h"
+#include "reduce.h"
+#include "store.h"
+#include "subs.h"
+#include "trace.h"
+
+BUILD_ASSERT(IS_ENABLED(CONFIG_BHI_DECODE) || CONFIG_BHI_AGG_MAX_PAYLOAD <= AGG_REC_MAX_LEN,
+             "Raw samples must fit a frame record");
+
+K_THREAD_STACK_DEFINE(agg_stage_stack, CONFIG_BHI_PIPE_AGG_STACK_SIZE);
+static struct k_thread agg_stage_thread;
+
+/* Frame currently being filled by the aggregate stage */
+static struct agg_framer phone_framer;
+/* Metrics stamp of the first sample in phone_framer */
+static uint32_t phone_frame_rx_cyc;
+/* When phone_framer must go out even if not full */
+static int64_t phone_frame_deadline;
+
+static atomic_t frames;
+
+#if defined(CONFIG_BHI_AGG_DELTA)
+/* Delta coder state of the phone stream, aggregate stage only */
+static struct agg_delta phone_delta;
+#endif
+
+#if defined(CONFIG_BHI_DECODE)
+/* Sensor hub clock of one link and its offset to the central clock */
+struct hub_clock {
+    struct bhi_decoder dec;
+    uint32_t offset_us;   // Central minus hub time, lower envelope
+    bool synced;
+    uint16_t seq;         // Record counter for the aggregate stream
+};
+
+static struct hub_clock hub_clocks[PEER_COUNT];
+/* Only used by the aggregate stage */
+static struct bhi_record hub_records[CONFIG_BHI_DECODE_MAX_EVENTS];
+#endif
+
+static uint32_t agg_timestamp_us(void)
+{
+    return (uint32_t)k_ticks_to_us_floor64(k_uptime_ticks());
+}
+
+/* Some phone listens; in simulation the synthetic one always does */
+static bool phone_connected(void)
+{
+    return subs_active();
+}
+
+static bool broadcasting(void)
+{
+    return IS_ENABLED(CONFIG_BHI_BROADCAST) && broadcast_active();
+}
+
+/* Largest frame the phones and the broadcast all take */
+static uint16_t phone_frame_cap(void)
+{
+    uint16_t cap = subs_frame_cap();
+
+    return broadcasting() ? MIN(cap, BROADCAST_FRAME_MAX) : cap;
+}
+
+/* The phone cannot take this sample now: keep it in the flash log */
+static bool phone_store(const struct agg_data_item *item)
+{
+    return IS_ENABLED(CONFIG_BHI_STORE) && store_item(item) == 0;
+}
+
+/* Hand a frame to the subscribers' TX threads. Blocks while all frames
+ * are in flight, which is what pushes back on the sample queue.
+ */
+static void tx_queue(const void *data, uint16_t len, uint32_t rx_cyc)
+{
+    struct subs_frame *frame = subs_frame_alloc();
+
+    if (!frame) {
+        return;
+    }
+    memcpy(frame->buf, data, len);
+    frame->len = len;
+    frame->rx_cyc = rx_cyc;
+    atomic_inc(&frames);
+
+    subs_publish(frame);
+}
+
+/* Count every sample of a merged epoch payload as lost, see the layout
+ * in src/merge.h
+ */
+static void epoch_drop(uint8_t links, const uint8_t *data, uint16_t len)
+{
+    for (int i = 0, off = 0; i < PEER_COUNT && off < len; i++) {
+        if (!(links & BIT(i))) {
+            continue;
+        }
+        for (uint8_t n = data[off++]; n && off < len; n--) {
+            metrics_drop(i);
+            off += 1 + data[off];
+        }
+    }
+}
+
+/* Throw away the frame being built, counting its samples as lost */
+static void phone_frame_discard(void)
+{
+    for (uint16_t off = sizeof(struct agg_frame_hdr); off < phone_framer.len;) {
+        const struct agg_rec_hdr *rec = (const struct agg_rec_hdr *)&phone_framer.buf[off];
+
+        off += sizeof(*rec);
+        if (phone_framer.flags & AGG_FRAME_FLAG_MERGED) {
+            epoch_drop(rec->dev, &phone_framer.buf[off], rec->len);
+        } else {
+            metrics_drop(rec->dev & ~AGG_REC_DELTA);
+        }
+        off += rec->len;
+    }
+    agg_framer_reset(&phone_framer, AGG_FRAME_MAX_LEN);
+}
+
+static void phone_flush(void)
+{
+    uint16_t len = agg_framer_finish(&phone_framer);
+
+    if (len && broadcasting()) {
+        broadcast_frame(phone_framer.buf, len);
+    }
+    if (len && phone_connected()) {
+        tx_queue(phone_framer.buf, len, phone_frame_rx_cyc);
+    } else if (len && !broadcasting()) {
+        // Nobody takes it: the phone left since the frame was started
+        phone_frame_discard();
+        return;
+    }
+    agg_framer_reset(&phone_framer, AGG_FRAME_MAX_LEN);
+}
+
+/* Print samples lost while no phone listens, at most once per second */
+static void phone_absent_report(uint8_t dev)
+{
+    static uint32_t dropped;
+    static int64_t last_report;
+
+    metrics_drop(dev);
+    dropped++;
+    if (k_uptime_get() - last_report < 1000) {
+        return;
+    }
+    last_report = k_uptime_get();
+    printk("Phone not connected, dropped %u samples\n", dropped);
+    dropped = 0;
+}
+
+/* Debug encoding: one "Device N: xx xx ..." string per sample */
+static void phone_send_hex(const struct agg_data_item *item)
+{
+    char text[AGG_FRAME_MAX_LEN];
+    int offset = snprintf(text, sizeof(text), "Device %d: ", (int8_t)item->dev);
+    for (int i = 0; i < item->len && offset < sizeof(text) - 3; i++) {
+        offset += snprintf(text + offset, sizeof(text) - offset, "%02x ", item->data[i]);
+    }
+    tx_queue(text, MIN(offset, subs_frame_cap()), item->rx_cyc);
+}
+
+static int phone_frame_add(uint8_t dev, uint16_t seq, uint32_t ts, const uint8_t *data,
+                           uint8_t len, uint32_t rx_cyc)
+{
+    int err;
+
+    if (agg_framer_empty(&phone_framer)) {
+        agg_framer_reset(&phone_framer, phone_frame_cap());
+        phone_frame_deadline = k_uptime_get() + CONFIG_BHI_AGG_FLUSH_DEADLINE_MS;
+    }
+
+    err = agg_framer_add(&phone_framer, dev, seq, ts, data, len);
+    if (err == -ENOSPC) {
+        phone_flush();
+        agg_framer_reset(&phone_framer, phone_frame_cap());
+        phone_frame_deadline = k_uptime_get() + CONFIG_BHI_AGG_FLUSH_DEADLINE_MS;
+        err = agg_framer_add(&phone_framer, dev, seq, ts, data, len);
+    }
+    if (err) {
+        return err;
+    }
+    if (phone_framer.count == 1) {
+        phone_frame_rx_cyc = rx_cyc;
+    }
+
+    /* Send right away if not even an empty record fits anymore */
+    if (phone_framer.len + sizeof(struct agg_rec_hdr) >= phone_framer.cap) {
+        phone_flush();
+    }
+    return 0;
+}
+
+static void phone_frame_item(const struct agg_data_item *item)
+{
+    int err;
+
+#if defined(CONFIG_BHI_AGG_DELTA)
+    uint8_t coded[AGG_DELTA_OUT_LEN(CONFIG_BHI_AGG_MAX_PAYLOAD)];
+    uint8_t dev = item->dev;
+
+    if (subs_joined()) {
+        // Someone new listens: every stream starts over with a keyframe
+        agg_delta_resync_all(&phone_delta);
+    }
+    uint8_t len = agg_delta_encode(&phone_delta, &dev, item->sensor, item->data, item->len,
+                                   coded);
+
+    err = phone_frame_add(dev, item->seq, item->timestamp, coded, len, item->rx_cyc);
+    if (err) {
+        // The phone never sees this value, so the next one cannot be a delta
+        agg_delta_resync(&phone_delta, dev, item->sensor);
+    }
+#else
+    err = phone_frame_add(item->dev, item->seq, item->timestamp, item->data, item->len,
+                          item->rx_cyc);
+#endif
+
+    if (err) {
+        printk("Dropping %u byte sample from device %d (err %d)\n",
+               item->len, (int8_t)item->dev, err);
+        metrics_drop(item->dev);
+    }
+}
+
+/* Hand one sample to the configured encoding. Nothing keeps the item,
+ * the reduction may rewrite it.
+ */
+static void phone_forward(struct agg_data_item *item)
+{
+    if (IS_ENABLED(CONFIG_BHI_REDUCE) && !reduce_process(item)) {
+        // Absorbed into a decimation block or statistics window
+    } else if (IS_ENABLED(CONFIG_BHI_AGG_FORMAT_HEX)) {
+        phone_send_hex(item);
+    } else if (IS_ENABLED(CONFIG_BHI_AGG_FORMAT_MERGED)) {
+        merge_add(item);
+    } else {
+        phone_frame_item(item);
+    }
+}
+
+#if defined(CONFIG_BHI_DECODE)
+/* The newest event of a notification was sampled shortly before it
+ * arrived, so the smallest central - hub difference seen is the offset
+ * with the least radio latency in it. It creeps up 1 us per notification
+ * to follow a hub clock running slow, and restarts when the hub clock
+ * jumps (hub reset, full timestamp after a gap).
+ */
+static void hub_clock_sync(struct hub_clock *clk, uint32_t rx_us, uint64_t ticks)
+{
+    uint32_t hub_us = (uint32_t)(ticks * USEC_PER_SEC / BHI_TICK_HZ);
+    uint32_t offset = rx_us - hub_us;
+    int32_t diff = (int32_t)(offset - clk->offset_us);
+
+    if (!clk->synced || diff < 0 || diff > USEC_PER_SEC) {
+        clk->offset_us = offset;
+        clk->synced = true;
+    } else {
+        clk->offset_us++;
+    }
+}
+
+static uint32_t hub_clock_us(const struct hub_clock *clk, uint64_t ticks)
+{
+    return (uint32_t)(ticks * USEC_PER_SEC / BHI_TICK_HZ) + clk->offset_us;
+}
+
+/* Split a notification into one sample per sensor hub event. Events go
+ * out one at a time through a scratch sample, so a full notification
+ * never takes pool buffers from the samples of other links.
+ */
+static void phone_decode(struct agg_data_item *item)
+{
+    static struct agg_data_item rec;
+    struct hub_clock *clk = &hub_clocks[item->dev];
+    int n = bhi_decode(&clk->dec, item->data, item->len, hub_records,
+                       ARRAY_SIZE(hub_records));
+
+    if (n <= 0) {
+        if (n < 0) {
+            metrics_drop(item->dev);
+            TRACE(TRACE_LEVEL_ERR, TRACE_BAD_FRAME, item->dev, item->data, item->len);
+        }
+        agg_pool_free(item);
+        return;
+    }
+    // The frame's last time, which stays right when events were truncated
+    hub_clock_sync(clk, item->timestamp, clk->dec.ts);
+
+    for (int i = 0; i < n; i++) {
+        const struct bhi_record *r = &hub_records[i];
+
+        rec.rx_cyc = item->rx_cyc;
+        rec.enq_cyc = item->enq_cyc;
+        rec.dev = item->dev;
+        rec.timestamp = hub_clock_us(clk, r->ts);
+        rec.seq = clk->seq++;
+        rec.sensor = r->sensor;
+        rec.data[0] = r->sensor;
+        memcpy(&rec.data[1], r->data, r->len);
+        rec.len = r->len + 1;
+
+        phone_forward(&rec);
+    }
+    agg_pool_free(item);
+}
+#endif
+
+static void phone_frame_epoch(uint8_t links, uint16_t epoch_seq, uint32_t epoch_ts,
+                              const uint8_t *data, uint8_t len, uint32_t rx_cyc)
+{
+    int err = phone_frame_add(links, epoch_seq, epoch_ts, data, len, rx_cyc);
+
+    if (err) {
+        printk("Dropping %u byte epoch %u (err %d)\n", len, epoch_seq, err);
+        epoch_drop(links, data, len);
+    }
+}
+
+/* Print pool usage whenever samples were lost, at most once per second */
+static void agg_pool_report(void)
+{
+    static uint32_t reported_drops;
+    static int64_t last_report;
+    struct agg_pool_stats stats;
+
+    agg_pool_stats_get(&stats);
+    if (stats.dropped == reported_drops || k_uptime_get() - last_report < 1000) {
+        return;
+    }
+    reported_drops = stats.dropped;
+    last_report = k_uptime_get();
+
+    printk("Sample pool: %u/%u in use, high water %u, alloc failures %u, dropped %u\n",
+           stats.in_use, CONFIG_BHI_AGG_POOL_COUNT, stats.high_water,
+           stats.alloc_fail, stats.dropped);
+}
+
+/* Aggregate stage: drain the sample queue into frames */
+static void agg_stage(void *arg1, void *arg2, void *arg3)
+{
+    agg_framer_init(&phone_framer);
+    if (IS_ENABLED(CONFIG_BHI_AGG_FORMAT_MERGED)) {
+        phone_framer.flags = AGG_FRAME_FLAG_MERGED;
+    }
+    if (IS_ENABLED(CONFIG_BHI_DECODE)) {
+        phone_framer.flags |= AGG_FRAME_FLAG_DECODED;
+    }
+#if defined(CONFIG_BHI_AGG_DELTA)
+    agg_delta_init(&phone_delta);
+    phone_framer.flags |= AGG_FRAME_FLAG_DELTA;
+#endif
+
+    while (1) {
+        int64_t wait = -1;
+
+        /* Closed merge epochs go into the frame first */
+        if (IS_ENABLED(CONFIG_BHI_AGG_FORMAT_MERGED)) {
+            wait = merge_poll(phone_frame_epoch);
+        }
+
+        /* A partially filled frame goes out once its latency deadline passes */
+        if (!agg_framer_empty(&phone_framer)) {
+            int64_t remaining = phone_frame_deadline - k_uptime_get();
+            if (remaining <= 0) {
+                phone_flush();
+                continue;
+            }
+            wait = wait < 0 ? remaining : MIN(wait, remaining);
+        }
+
+        struct agg_data_item *item = agg_pool_get(wait < 0 ? K_FOREVER : K_MSEC(wait));
+        if (!item) {
+            continue;
+        }
+        uint32_t start = metrics_stamp();
+        metrics_dequeue(item);
+
+        if (!phone_connected() && !broadcasting()) {
+            if (!agg_framer_empty(&phone_framer)) {
+                phone_frame_discard();
+            }
+            if (!phone_store(item)) {
+                phone_absent_report(item->dev);
+            }
+        } else if (!rate_ctl_admit(item)) {
+            // Thinned out on purpose by rate control, not a loss
+        } else if (!phone_tx_admit(item)) {
+            // Phone is behind, the backpressure policy skips this sample
+            if (!phone_store(item)) {
+                metrics_drop(item->dev);
+            }
+        } else if (IS_ENABLED(CONFIG_BHI_DECODE)) {
+#if defined(CONFIG_BHI_DECODE)
+            phone_decode(item);
+#endif
+            item = NULL;
+        } else {
+            phone_forward(item);
+        }
+        if (item) {
+            agg_pool_free(item);
+        }
+        metrics_service(METRICS_HIST_AGG_SVC, start);
+
+        agg_pool_report();
+    }
+}
+
+void pipeline_ingest(int idx, const void *data, uint16_t len, uint32_t rx_cyc)
+{
+    uint32_t timestamp = agg_timestamp_us();
+    struct link *link = link_get(idx);
+
+    TRACE(TRACE_LEVEL_DEBUG, TRACE_NOTIFY, idx, data, len);
+
+    // Raw samples must fit a frame record, see CONFIG_BHI_AGG_MAX_PAYLOAD
+    if (len > CONFIG_BHI_AGG_MAX_PAYLOAD) {
+        printk("Notification from device %d too long (%u bytes)\n", idx, len);
+        metrics_drop(idx);
+        TRACE(TRACE_LEVEL_ERR, TRACE_DROP, idx, NULL, len);
+        return;
+    }
+
+    // Polling phones read this even when the sample cannot be queued
+    latest_update(idx, link->rx_seq, timestamp, data, len);
+
+    /* Take a pool buffer and copy the raw payload; everything else
+     * happens in the aggregate stage.
+     */
+    struct agg_data_item *item = agg_pool_alloc();
+    if (!item) {
+        metrics_drop(idx);
+        TRACE(TRACE_LEVEL_ERR, TRACE_DROP, idx, NULL, len);
+        return;
+    }
+    item->rx_cyc = rx_cyc;
+    item->timestamp = timestamp;
+    item->dev = (uint8_t)idx;
+    item->sensor = 0;
+    item->seq = link->rx_seq++;
+    item->len = len;
+    memcpy(item->data, data, len);
+    item->enq_cyc = metrics_stamp();
+    metrics_enqueue(item);
+    agg_pool_put(item);
+}
+
+int pipeline_send_frame(const void *data, uint16_t len)
+{
+    if (!phone_connected()) {
+        return -ENOTCONN;
+    }
+    tx_queue(data, len, 0);
+    return 0;
+}
+
+void pipeline_stats_get(struct pipeline_stats *stats)
+{
+    stats->rx_queued = agg_pool_depth();
+    stats->tx_queued = 0;
+    stats->tx_queued_max = 0;
+    for (int i = 0; i < CONFIG_BHI_SUBS_MAX; i++) {
+        struct subs_info info;
+
+        subs_info_get(i, &info);
+        stats->tx_queued += info.queued;
+        stats->tx_queued_max = MAX(stats->tx_queued_max, info.queued_max);
+    }
+    stats->frames = atomic_get(&frames);
+#if defined(CONFIG_BHI_AGG_DELTA)
+    stats->raw_bytes = phone_delta.raw_bytes;
+    stats->coded_bytes = phone_delta.coded_bytes;
+    stats->keyframes = phone_delta.keyframes;
+#else
+    stats->raw_bytes = 0;
+    stats->coded_bytes = 0;
+    stats->keyframes = 0;
+#endif
+}
+
+void pipeline_start(void)
+{
+    k_thread_create(&agg_stage_thread, agg_stage_stack, K_THREAD_STACK_SIZEOF(agg_stage_stack),
+                    agg_stage, NULL, NULL, NULL, CONFIG_BHI_PIPE_AGG_PRIORITY, 0, K_NO_WAIT);
+    k_thread_name_set(&agg_stage_thread, "agg_stage");
+
+    subs_start();
+}
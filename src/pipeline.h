@@ -0,0 +1,44 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <zephyr/kernel.h>
+
+/* Sample path from the sensor links to the phones, in three stages:
+ *
+ *   RX         BT RX thread     copy payload, stamp, queue
+ *     | agg_pool FIFO, bounded by CONFIG_BHI_AGG_POOL_COUNT
+ *   aggregate  pipeline thread  backpressure, frame (or hex encode)
+ *     | one queue per subscriber, CONFIG_BHI_PIPE_TX_FRAMES frames shared
+ *   TX         thread per phone notify the phone, wait for credits
+ *
+ * The RX stage never blocks. When every phone falls behind the aggregate
+ * stage waits for a free frame and the sample queue absorbs the burst,
+ * where the pool and phone_tx policies apply. A single slow phone only
+ * loses frames from its own queue, see src/subs.h.
+ */
+
+struct pipeline_stats {
+    uint32_t rx_queued;      // Samples waiting for the aggregate stage
+    uint32_t tx_queued;      // Frames waiting in all subscriber queues
+    uint32_t tx_queued_max;  // ... the fullest a single queue got
+    uint32_t frames;         // Frames handed to the TX stage
+    uint32_t raw_bytes;      // Sample bytes given to the delta coder
+    uint32_t coded_bytes;    // ... and what it made of them
+    uint32_t keyframes;
+};
+
+/* RX stage: queue one sample from peer idx. Callable from the BT RX
+ * thread or any other thread, never blocks.
+ */
+void pipeline_ingest(int idx, const void *data, uint16_t len, uint32_t rx_cyc);
+
+void pipeline_start(void);
+
+/* Queue a finished frame for every subscribed phone, blocking while all
+ * frames are in flight. -ENOTCONN without a subscribed phone.
+ */
+int pipeline_send_frame(const void *data, uint16_t len);
+
+void pipeline_stats_get(struct pipeline_stats *stats);
+
+#endif /* PIPELINE_H_ */
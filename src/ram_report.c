@@ -0,0 +1,98 @@
+#include <zephyr/kernel.h>
+#include <zephyr/net/buf.h>
+#include <zephyr/sys/iterable_sections.h>
+#include <zephyr/sys/sys_heap.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/shell/shell.h>
+
+#include "ram_report.h"
+
+/* Pools beyond this many are reported without a low-water mark */
+#define POOLS_MAX 16
+
+/* Fewest free buffers seen, by net_buf_pool_id() */
+static uint16_t pool_low[POOLS_MAX] = {[0 ... POOLS_MAX - 1] = UINT16_MAX};
+
+static void ram_sample(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(sample_work, ram_sample);
+
+static void ram_sample(struct k_work *work)
+{
+    STRUCT_SECTION_FOREACH(net_buf_pool, pool) {
+        int id = net_buf_pool_id(pool);
+
+        if (id < POOLS_MAX) {
+            pool_low[id] = MIN(pool_low[id], atomic_get(&pool->avail_count));
+        }
+    }
+    k_work_reschedule(&sample_work, K_MSEC(CONFIG_BHI_RAM_REPORT_SAMPLE_MS));
+}
+
+void ram_report_init(void)
+{
+    k_work_reschedule(&sample_work, K_NO_WAIT);
+}
+
+struct stack_totals {
+    const struct shell *sh;
+    uint32_t size;
+    uint32_t used;
+};
+
+static void print_thread(const struct k_thread *thread, void *user_data)
+{
+    struct stack_totals *t = user_data;
+    const char *name = k_thread_name_get((k_tid_t)thread);
+    uint32_t size = thread->stack_info.size;
+    size_t unused;
+
+    if (!name || !name[0]) {
+        name = "?";
+    }
+    if (k_thread_stack_space_get(thread, &unused)) {
+        shell_print(t->sh, "%-20s %6u %6s", name, size, "?");
+        return;
+    }
+    shell_print(t->sh, "%-20s %6u %6u %3u%%", name, size, size - (uint32_t)unused,
+                size ? (size - (uint32_t)unused) * 100 / size : 0);
+    t->size += size;
+    t->used += size - unused;
+}
+
+static int cmd_ram(const struct shell *sh, size_t argc, char **argv)
+{
+    struct stack_totals totals = {.sh = sh};
+
+    shell_print(sh, "%-20s %6s %6s %4s", "thread", "stack", "peak", "");
+    k_thread_foreach_unlocked(print_thread, &totals);
+    shell_print(sh, "stacks: %u of %u bytes used at peak", totals.used, totals.size);
+
+    STRUCT_SECTION_FOREACH(k_heap, heap) {
+        struct sys_memory_stats s;
+
+        if (!sys_heap_runtime_stats_get(&heap->heap, &s)) {
+            shell_print(sh, "heap %p: %u bytes, %u in use, %u peak", heap,
+                        (uint32_t)(s.free_bytes + s.allocated_bytes),
+                        (uint32_t)s.allocated_bytes, (uint32_t)s.max_allocated_bytes);
+        }
+    }
+
+    STRUCT_SECTION_FOREACH(k_mem_slab, slab) {
+        shell_print(sh, "slab %p: %u x %u bytes, %u in use, %u peak", slab,
+                    k_mem_slab_num_used_get(slab) + k_mem_slab_num_free_get(slab),
+                    (uint32_t)slab->info.block_size, k_mem_slab_num_used_get(slab),
+                    k_mem_slab_max_used_get(slab));
+    }
+
+    STRUCT_SECTION_FOREACH(net_buf_pool, pool) {
+        int id = net_buf_pool_id(pool);
+        uint32_t avail = atomic_get(&pool->avail_count);
+
+        shell_print(sh, "pool %-16s %3u x %4u bytes, %3u free, %3u fewest", pool->name,
+                    pool->buf_count, pool->pool_size / pool->buf_count, avail,
+                    id < POOLS_MAX ? MIN(pool_low[id], avail) : avail);
+    }
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((bhi), ram, NULL, "Stack, heap and buffer pool usage", cmd_ram, 1, 0);
@@ -0,0 +1,24 @@
+#ifndef RAM_REPORT_H_
+#define RAM_REPORT_H_
+
+/* RAM budget report (CONFIG_BHI_RAM_REPORT), printed by "bhi ram":
+ *
+ *   - every thread's stack: size and the most it ever used, found from
+ *     the fill pattern CONFIG_INIT_STACKS writes at thread creation,
+ *   - every kernel heap: size, in use and peak,
+ *   - every memory slab, the sample pool and the subscriber frames among
+ *     them: blocks, block size, in use and peak,
+ *   - every net_buf pool, the Bluetooth host's ACL, event and L2CAP pools
+ *     included: buffers, free now and the fewest ever free.
+ *
+ * Net_buf pools only count their free buffers, so a sampler on the system
+ * work queue keeps the low-water mark every
+ * CONFIG_BHI_RAM_REPORT_SAMPLE_MS; shorter dips go unseen. The overlays
+ * overlay-low-ram.conf and overlay-max-throughput.conf are to be checked
+ * against this report on the target.
+ */
+
+/* Start the buffer pool sampler */
+void ram_report_init(void);
+
+#endif /* RAM_REPORT_H_ */
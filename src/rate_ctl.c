@@ -0,0 +1,434 @@
+#include <errno.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/net/buf.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/hci.h>
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+#include "agg_pool.h"
+#include "link.h"
+#include "link_params.h"
+#include "metrics.h"
+#include "peers.h"
+#include "rate_ctl.h"
+#include "sensor_cmd.h"
+#include "subs.h"
+#include "trace.h"
+
+#define MAX_LEVEL CONFIG_BHI_RATE_CTL_MAX_LEVEL
+#define UP_PERIODS CONFIG_BHI_RATE_CTL_UP_PERIODS
+#define DOWN_PERIODS CONFIG_BHI_RATE_CTL_DOWN_PERIODS
+#define LOG_LEN 16
+
+/* HCI Read RSSI value for "not available" */
+#define RSSI_NONE 127
+#define RSSI_CLEAR (CONFIG_BHI_RATE_CTL_RSSI_LOW + CONFIG_BHI_RATE_CTL_RSSI_HYST)
+
+/* One sensor stream. Only hub_level and skipped are shared with the
+ * aggregate stage, the rest is system work queue only.
+ */
+struct rate_link {
+    atomic_t hub_level;             // Level the hub thins the stream to
+    atomic_t skipped;
+    uint8_t level;
+    int8_t rssi;                    // RSSI_NONE if unknown
+    uint8_t poor;                   // Periods in a row below RSSI_LOW
+    uint8_t clear;                  // Periods in a row at RSSI_CLEAR or better
+    uint32_t rx_pkts;               // Counter at the last period
+    uint32_t rate;                  // Samples/s the hub receives
+#if defined(CONFIG_BHI_RATE_CTL_SENSOR_ODR)
+    const struct bt_conn *odr_conn; // Connection the sensor was last asked on
+    uint8_t odr_level;              // ... and the level it was asked for
+    bool odr_pending;               // Waiting for the sensor's answer
+    bool odr_ok;                    // The sensor answered, it thins
+#endif
+};
+
+static struct rate_link links[PEER_COUNT];
+
+/* Phone side, system work queue only */
+static int8_t phone_rssi = RSSI_NONE;   // Worst of the phones
+static uint8_t queue_pct;               // Fullest subscriber queue or the pool
+static uint8_t loss_pct;
+static uint32_t phone_sent;             // Counters at the last period
+static uint32_t phone_lost;
+static uint8_t hot;                     // Periods in a row under pressure
+static uint8_t calm;                    // Periods in a row without any
+static int64_t last_run;
+
+static struct k_spinlock log_lock;
+static struct rate_ctl_change changes[LOG_LEN];
+static uint32_t change_count;
+
+static const char *const cause_names[] = {
+    [RATE_CTL_PHONE_QUEUE] = "phone queue",
+    [RATE_CTL_PHONE_LOSS] = "phone losses",
+    [RATE_CTL_PHONE_RSSI] = "phone RSSI",
+    [RATE_CTL_LINK_RSSI] = "link RSSI",
+    [RATE_CTL_CLEAR] = "clear",
+};
+
+static void rate_run(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(rate_work, rate_run);
+
+/* HCI Read RSSI, RSSI_NONE if the controller has no reading */
+static int8_t conn_rssi(const struct bt_conn *conn)
+{
+    struct bt_hci_cp_read_rssi *cp;
+    struct net_buf *buf;
+    struct net_buf *rsp = NULL;
+    uint16_t handle;
+    int8_t rssi = RSSI_NONE;
+
+    if (bt_hci_get_conn_handle(conn, &handle)) {
+        return RSSI_NONE;
+    }
+    buf = bt_hci_cmd_create(BT_HCI_OP_READ_RSSI, sizeof(*cp));
+    if (!buf) {
+        return RSSI_NONE;
+    }
+    cp = net_buf_add(buf, sizeof(*cp));
+    cp->handle = sys_cpu_to_le16(handle);
+
+    if (!bt_hci_cmd_send_sync(BT_HCI_OP_READ_RSSI, buf, &rsp)) {
+        rssi = ((struct bt_hci_rp_read_rssi *)rsp->data)->rssi;
+        net_buf_unref(rsp);
+    }
+    return rssi;
+}
+
+/* The sensor divides its own rate, so a higher level also frees its link */
+static bool sensor_thins(const struct rate_link *rl)
+{
+#if defined(CONFIG_BHI_RATE_CTL_SENSOR_ODR)
+    return rl->odr_ok;
+#else
+    return false;
+#endif
+}
+
+static void set_level(int idx, uint8_t level, enum rate_ctl_cause cause)
+{
+    struct rate_link *rl = &links[idx];
+    struct rate_ctl_change c = {
+        .time_ms = k_uptime_get_32(),
+        .dev = idx,
+        .from = rl->level,
+        .to = level,
+        .cause = cause,
+    };
+
+    k_spinlock_key_t key = k_spin_lock(&log_lock);
+
+    changes[change_count++ % LOG_LEN] = c;
+    k_spin_unlock(&log_lock, key);
+
+    printk("Rate: device %d 1/%u -> 1/%u (%s)\n", idx, 1U << c.from, 1U << c.to,
+           cause_names[cause]);
+    TRACE(TRACE_LEVEL_INFO, TRACE_RATE, idx, &c.from, 2);
+
+    rl->level = level;
+    if (sensor_thins(rl)) {
+        // odr_update() passes the level on
+        return;
+    }
+    atomic_set(&rl->hub_level, level);
+}
+
+/* RSSI and receive rates of one period */
+static void sample_links(uint32_t elapsed)
+{
+    struct bt_conn *conns[CONFIG_BT_MAX_CONN];
+    int n = link_params_conns(conns, ARRAY_SIZE(conns));
+
+    phone_rssi = RSSI_NONE;
+    for (int i = 0; i < PEER_COUNT; i++) {
+        struct metrics_link m;
+
+        metrics_link_get(i, &m);
+        links[i].rate = (uint64_t)(m.rx_pkts - links[i].rx_pkts) * MSEC_PER_SEC / elapsed;
+        links[i].rx_pkts = m.rx_pkts;
+        links[i].rssi = RSSI_NONE;
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct link *link = link_from_conn(conns[i]);
+        int8_t rssi = conn_rssi(conns[i]);
+
+        if (link) {
+            links[link->idx].rssi = rssi;
+        } else if (rssi != RSSI_NONE && (phone_rssi == RSSI_NONE || rssi < phone_rssi)) {
+            phone_rssi = rssi;
+        }
+        bt_conn_unref(conns[i]);
+    }
+}
+
+/* Queue fill and losses of one period */
+static void sample_phones(void)
+{
+    uint32_t sent = 0;
+    uint32_t lost = 0;
+
+    queue_pct = agg_pool_depth() * 100 / CONFIG_BHI_AGG_POOL_COUNT;
+    for (int i = 0; i < CONFIG_BHI_SUBS_MAX; i++) {
+        struct subs_info info;
+
+        if (subs_info_get(i, &info)) {
+            continue;
+        }
+        sent += info.sent;
+        lost += info.dropped;
+        if (info.connected) {
+            queue_pct = MAX(queue_pct, info.queued * 100 / CONFIG_BHI_SUBS_QUEUE);
+        }
+    }
+
+    // A slot taken by a new phone starts its counters over
+    if (sent >= phone_sent && lost >= phone_lost) {
+        uint32_t d_sent = sent - phone_sent;
+        uint32_t d_lost = lost - phone_lost;
+
+        loss_pct = d_sent + d_lost ? (uint64_t)d_lost * 100 / (d_sent + d_lost) : 0;
+    } else {
+        loss_pct = 0;
+    }
+    phone_sent = sent;
+    phone_lost = lost;
+}
+
+/* What puts the phone under pressure, -1 if nothing */
+static int phone_pressure(void)
+{
+    if (queue_pct >= CONFIG_BHI_RATE_CTL_QUEUE_HIGH_PCT) {
+        return RATE_CTL_PHONE_QUEUE;
+    }
+    if (loss_pct >= CONFIG_BHI_RATE_CTL_LOSS_PCT) {
+        return RATE_CTL_PHONE_LOSS;
+    }
+    if (phone_rssi != RSSI_NONE && phone_rssi < CONFIG_BHI_RATE_CTL_RSSI_LOW) {
+        return RATE_CTL_PHONE_RSSI;
+    }
+    return -1;
+}
+
+static bool phone_calm(void)
+{
+    return queue_pct <= CONFIG_BHI_RATE_CTL_QUEUE_LOW_PCT && !loss_pct &&
+           (phone_rssi == RSSI_NONE || phone_rssi >= RSSI_CLEAR);
+}
+
+/* Halve the stream that forwards the most samples */
+static void raise_busiest(enum rate_ctl_cause cause)
+{
+    uint32_t best = 0;
+    int idx = -1;
+
+    for (int i = 0; i < PEER_COUNT; i++) {
+        uint32_t fwd = links[i].rate >> atomic_get(&links[i].hub_level);
+
+        if (links[i].level < MAX_LEVEL && fwd > best) {
+            best = fwd;
+            idx = i;
+        }
+    }
+    if (idx >= 0) {
+        set_level(idx, links[idx].level + 1, cause);
+    }
+}
+
+/* Double the most reduced stream whose own link is clear */
+static void lower_most_reduced(void)
+{
+    int idx = -1;
+
+    for (int i = 0; i < PEER_COUNT; i++) {
+        if (links[i].level && links[i].clear >= DOWN_PERIODS &&
+            (idx < 0 || links[i].level > links[idx].level)) {
+            idx = i;
+        }
+    }
+    if (idx >= 0) {
+        set_level(idx, links[idx].level - 1, RATE_CTL_CLEAR);
+    }
+}
+
+static void link_step(int idx)
+{
+    struct rate_link *rl = &links[idx];
+
+    if (rl->rssi != RSSI_NONE && rl->rssi < CONFIG_BHI_RATE_CTL_RSSI_LOW) {
+        rl->clear = 0;
+        if (++rl->poor >= UP_PERIODS) {
+            rl->poor = 0;
+            // Thinning at the hub would not free any of the link's airtime
+            if (rl->level < MAX_LEVEL && sensor_thins(rl)) {
+                set_level(idx, rl->level + 1, RATE_CTL_LINK_RSSI);
+            }
+        }
+    } else if (rl->rssi == RSSI_NONE || rl->rssi >= RSSI_CLEAR) {
+        rl->poor = 0;
+        rl->clear = MIN(rl->clear + 1, UINT8_MAX);
+    } else {
+        // Between the thresholds nothing moves
+        rl->poor = 0;
+        rl->clear = 0;
+    }
+}
+
+#if defined(CONFIG_BHI_RATE_CTL_SENSOR_ODR)
+/* The sensor's answer decides who thins the stream. Runs on the system
+ * work queue like the control loop.
+ */
+static void odr_done(uint8_t answered, uint8_t failed, void *user_data)
+{
+    int idx = POINTER_TO_INT(user_data);
+    struct rate_link *rl = &links[idx];
+
+    rl->odr_pending = false;
+    rl->odr_ok = answered & BIT(idx);
+    atomic_set(&rl->hub_level, rl->odr_ok ? 0 : rl->level);
+}
+
+/* Ask each streaming sensor for its level once per level and connection,
+ * on a new connection also for level 0: only an answer shows the sensor
+ * takes the command.
+ */
+static void odr_update(int idx)
+{
+    struct rate_link *rl = &links[idx];
+    struct link *link = link_get(idx);
+    const struct bt_conn *conn = link->conn;
+
+    if (link->state != LINK_STREAMING || rl->odr_pending) {
+        return;
+    }
+    if (rl->odr_conn == conn && rl->odr_level == rl->level) {
+        return;
+    }
+    if (rl->odr_conn != conn) {
+        rl->odr_ok = false;
+        atomic_set(&rl->hub_level, rl->level);
+    }
+
+    uint8_t cmd[] = {CONFIG_BHI_RATE_CTL_ODR_OPCODE, rl->level};
+    int queued = sensor_cmd_send(BIT(idx), cmd, sizeof(cmd), odr_done, INT_TO_POINTER(idx));
+
+    if (queued == -EBUSY) {
+        // Next period
+        return;
+    }
+    rl->odr_conn = conn;
+    rl->odr_level = rl->level;
+    rl->odr_pending = queued >= 0;
+}
+#endif
+
+/* Runs on the system work queue: HCI Read RSSI blocks for a round trip */
+static void rate_run(struct k_work *work)
+{
+    int64_t now = k_uptime_get();
+    uint32_t elapsed = MAX(now - last_run, 1);
+    int cause;
+
+    last_run = now;
+    sample_links(elapsed);
+    sample_phones();
+
+    cause = phone_pressure();
+    if (cause >= 0) {
+        calm = 0;
+        if (++hot >= UP_PERIODS) {
+            hot = 0;
+            raise_busiest(cause);
+        }
+    } else if (phone_calm()) {
+        hot = 0;
+        if (++calm >= DOWN_PERIODS) {
+            calm = 0;
+            lower_most_reduced();
+        }
+    } else {
+        hot = 0;
+        calm = 0;
+    }
+
+    for (int i = 0; i < PEER_COUNT; i++) {
+        link_step(i);
+#if defined(CONFIG_BHI_RATE_CTL_SENSOR_ODR)
+        odr_update(i);
+#endif
+    }
+
+    k_work_reschedule(&rate_work, K_MSEC(CONFIG_BHI_RATE_CTL_PERIOD_MS));
+}
+
+bool rate_ctl_admit(const struct agg_data_item *item)
+{
+    struct rate_link *rl = &links[item->dev];
+    uint32_t level = atomic_get(&rl->hub_level);
+
+    if (item->seq & BIT_MASK(level)) {
+        atomic_inc(&rl->skipped);
+        return false;
+    }
+    return true;
+}
+
+int rate_ctl_change_get(int n, struct rate_ctl_change *change)
+{
+    int err = -ENOENT;
+    k_spinlock_key_t key = k_spin_lock(&log_lock);
+
+    if (n >= 0 && n < MIN(change_count, LOG_LEN)) {
+        *change = changes[(change_count - 1 - n) % LOG_LEN];
+        err = 0;
+    }
+    k_spin_unlock(&log_lock, key);
+    return err;
+}
+
+void rate_ctl_init(void)
+{
+    for (int i = 0; i < PEER_COUNT; i++) {
+        struct metrics_link m;
+
+        metrics_link_get(i, &m);
+        links[i].rx_pkts = m.rx_pkts;
+        links[i].rssi = RSSI_NONE;
+    }
+    last_run = k_uptime_get();
+    k_work_reschedule(&rate_work, K_MSEC(CONFIG_BHI_RATE_CTL_PERIOD_MS));
+}
+
+#if defined(CONFIG_SHELL)
+static int cmd_rate(const struct shell *sh, size_t argc, char **argv)
+{
+    struct rate_ctl_change c;
+
+    shell_print(sh, "phone: queue %u%%, losses %u%%, RSSI %d, %u periods hot, %u calm",
+                queue_pct, loss_pct, phone_rssi, hot, calm);
+    shell_print(sh, "dev %5s %6s %5s %8s %s", "rate", "rx/s", "rssi", "skipped", "thinned by");
+    for (int i = 0; i < PEER_COUNT; i++) {
+        const struct rate_link *rl = &links[i];
+
+        shell_print(sh, "%3d %3s%-2u %6u %5d %8u %s", i, "1/", 1U << rl->level, rl->rate,
+                    rl->rssi, (uint32_t)atomic_get(&rl->skipped),
+                    !rl->level ? "-" : sensor_thins(rl) ? "sensor" : "hub");
+    }
+    for (int n = 0; !rate_ctl_change_get(n, &c); n++) {
+        shell_print(sh, "[%8u ms] device %u 1/%u -> 1/%u (%s)", c.time_ms, c.dev, 1U << c.from,
+                    1U << c.to, cause_names[c.cause]);
+    }
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((bhi), rate, NULL, "Stream rate control", cmd_rate, 1, 0);
+#endif
@@ -0,0 +1,76 @@
+#ifndef RATE_CTL_H_
+#define RATE_CTL_H_
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+
+#include "agg_pool.h"
+
+/* Rate control of the sensor streams (CONFIG_BHI_RATE_CTL). Every
+ * CONFIG_BHI_RATE_CTL_PERIOD_MS the control loop samples the RSSI of the
+ * sensor links and phones (HCI Read RSSI), the fullest subscriber queue,
+ * the aggregate pool, and the share of phone frames lost to full queues
+ * or send errors. Each stream has a level: at level n the hub forwards
+ * one in 2^n of its samples, picked by sample counter so the survivors
+ * stay evenly spaced. Thinned samples are not drops.
+ *
+ * The phone is under pressure while a queue is above
+ * CONFIG_BHI_RATE_CTL_QUEUE_HIGH_PCT, losses are above
+ * CONFIG_BHI_RATE_CTL_LOSS_PCT or its RSSI is below
+ * CONFIG_BHI_RATE_CTL_RSSI_LOW. After CONFIG_BHI_RATE_CTL_UP_PERIODS such
+ * periods in a row the stream forwarding the most samples goes one level
+ * up. A sensor link that long below the RSSI threshold raises its own
+ * stream if the sensor divides its rate, see below. Levels come back down one stream at a time, the most reduced
+ * first, after CONFIG_BHI_RATE_CTL_DOWN_PERIODS periods with queues under
+ * CONFIG_BHI_RATE_CTL_QUEUE_LOW_PCT, no losses and RSSI at least
+ * CONFIG_BHI_RATE_CTL_RSSI_HYST dB above the threshold. Under a bad radio
+ * the rates so fall in halving steps, largest stream first, instead of
+ * the pipeline losing whichever samples meet a full queue.
+ *
+ * With CONFIG_BHI_RATE_CTL_SENSOR_ODR the sensor itself is asked to
+ * divide its output data rate, through the command channel of
+ * src/sensor_cmd.h, which also frees its link's airtime:
+ *
+ *   command: | CONFIG_BHI_RATE_CTL_ODR_OPCODE | level |
+ *
+ * Once the sensor answered the hub forwards all its samples. Links
+ * without a command path, or whose sensor did not answer, are thinned
+ * at the hub. Each connection starts with a level 0 command to find
+ * out. Every change is printed, traced and kept for
+ * "bhi rate".
+ */
+enum rate_ctl_cause {
+    RATE_CTL_PHONE_QUEUE,
+    RATE_CTL_PHONE_LOSS,
+    RATE_CTL_PHONE_RSSI,
+    RATE_CTL_LINK_RSSI,
+    RATE_CTL_CLEAR,        // Pressure is gone, level comes down
+};
+
+struct rate_ctl_change {
+    uint32_t time_ms;
+    uint8_t dev;
+    uint8_t from;
+    uint8_t to;
+    uint8_t cause;         // enum rate_ctl_cause
+};
+
+#if defined(CONFIG_BHI_RATE_CTL)
+
+/* Start the control loop */
+void rate_ctl_init(void);
+
+/* False if the sample is thinned out at the hub. Aggregate stage only. */
+bool rate_ctl_admit(const struct agg_data_item *item);
+
+/* The n-th most recent change, -ENOENT past the oldest kept */
+int rate_ctl_change_get(int n, struct rate_ctl_change *change);
+
+#else
+
+static inline void rate_ctl_init(void) {}
+static inline bool rate_ctl_admit(const struct agg_data_item *item) { return true; }
+
+#endif
+
+#endif /* RATE_CTL_H_ */
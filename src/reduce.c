@@ -0,0 +1,365 @@
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+
+#include "bhi_decode.h"
+#include "peers.h"
+#include "reduce.h"
+#include "reduce_dsp.h"
+
+#define MAX_CH CONFIG_BHI_REDUCE_MAX_CHANNELS
+#define MAX_WIN CONFIG_BHI_REDUCE_MAX_WINDOW
+#define TAPS CONFIG_BHI_REDUCE_FIR_TAPS
+
+/* Decoded records keep their sensor id byte in front */
+BUILD_ASSERT(1 + MAX_CH * 4 * sizeof(int16_t) <= CONFIG_BHI_AGG_MAX_PAYLOAD,
+             "Window statistics must fit a sample buffer");
+
+struct reduce_stream {
+    bool used;
+    uint8_t dev;
+    uint8_t sensor;           // BHI sensor id, 0 for raw samples
+    uint32_t last_use;        // Sample count when last seen, for eviction
+    atomic_val_t gen;         // Settings generation cfg was taken from
+    struct reduce_cfg cfg;
+    uint8_t channels;         // int16 channels per sample, 0 until the first one
+    uint8_t pos;              // Samples collected in the current block
+    int16_t taps[TAPS];
+    /* Per channel: FIR history followed by the current block, or the
+     * statistics window, or the last forwarded sample at [0].
+     */
+    int16_t buf[MAX_CH][TAPS - 1 + MAX_WIN];
+};
+
+static struct reduce_stream streams[CONFIG_BHI_REDUCE_STREAMS];
+static uint32_t use_count;
+
+struct sensor_cfg {
+    bool used;
+    uint8_t dev;
+    uint8_t sensor;
+    struct reduce_cfg cfg;
+};
+
+/* Written by the BT RX thread, picked up by the aggregate stage whenever
+ * cfg_gen moves.
+ */
+static struct k_spinlock cfg_lock;
+static struct reduce_cfg link_cfg[PEER_COUNT];
+static struct sensor_cfg sensor_cfg[CONFIG_BHI_REDUCE_STREAMS];
+static atomic_t cfg_gen;
+
+int reduce_configure(uint8_t dev, uint8_t sensor, const struct reduce_cfg *cfg)
+{
+    struct sensor_cfg *slot = NULL;
+    int err = 0;
+
+    if (dev >= PEER_COUNT || cfg->mode > REDUCE_THRESHOLD) {
+        return -EINVAL;
+    }
+    if ((cfg->mode == REDUCE_DECIMATE || cfg->mode == REDUCE_WINDOW) &&
+        (cfg->param < 2 || cfg->param > MAX_WIN)) {
+        return -EINVAL;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&cfg_lock);
+    if (!sensor) {
+        link_cfg[dev] = *cfg;
+    } else {
+        for (int i = 0; i < ARRAY_SIZE(sensor_cfg); i++) {
+            struct sensor_cfg *c = &sensor_cfg[i];
+
+            if (c->used && c->dev == dev && c->sensor == sensor) {
+                slot = c;
+                break;
+            }
+            if (!c->used && !slot) {
+                slot = c;
+            }
+        }
+        if (slot) {
+            *slot = (struct sensor_cfg){
+                .used = true,
+                .dev = dev,
+                .sensor = sensor,
+                .cfg = *cfg,
+            };
+        } else {
+            err = -ENOMEM;
+        }
+    }
+    atomic_inc(&cfg_gen);
+    k_spin_unlock(&cfg_lock, key);
+
+    if (!err) {
+        printk("Device %d sensor %u - reduction mode %u param %u threshold %u\n", dev, sensor,
+               cfg->mode, cfg->param, cfg->threshold);
+    }
+    return err;
+}
+
+/* Settings of (dev, sensor), falling back to the link's */
+static struct reduce_cfg cfg_lookup(uint8_t dev, uint8_t sensor)
+{
+    k_spinlock_key_t key = k_spin_lock(&cfg_lock);
+    struct reduce_cfg cfg = link_cfg[dev];
+
+    for (int i = 0; sensor && i < ARRAY_SIZE(sensor_cfg); i++) {
+        if (sensor_cfg[i].used && sensor_cfg[i].dev == dev &&
+            sensor_cfg[i].sensor == sensor) {
+            cfg = sensor_cfg[i].cfg;
+            break;
+        }
+    }
+    k_spin_unlock(&cfg_lock, key);
+    return cfg;
+}
+
+int reduce_ctrl_write(const uint8_t *data, uint16_t len)
+{
+    struct reduce_cfg cfg;
+    int err = 0;
+
+    if (len != REDUCE_CTRL_LEN) {
+        return -EMSGSIZE;
+    }
+    cfg.mode = data[1];
+    cfg.param = data[2];
+    cfg.threshold = sys_get_le16(&data[4]);
+
+    if (data[0] != REDUCE_CTRL_ALL) {
+        return reduce_configure(data[0], data[3], &cfg);
+    }
+    for (int i = 0; i < PEER_COUNT && !err; i++) {
+        err = reduce_configure(i, data[3], &cfg);
+    }
+    return err;
+}
+
+static uint16_t ctrl_put(uint8_t *buf, uint8_t dev, uint8_t sensor, const struct reduce_cfg *cfg)
+{
+    buf[0] = dev;
+    buf[1] = cfg->mode;
+    buf[2] = cfg->param;
+    buf[3] = sensor;
+    sys_put_le16(cfg->threshold, &buf[4]);
+    return REDUCE_CTRL_LEN;
+}
+
+uint16_t reduce_ctrl_read(uint8_t *buf, uint16_t size)
+{
+    uint16_t len = 0;
+
+    k_spinlock_key_t key = k_spin_lock(&cfg_lock);
+    for (int i = 0; i < PEER_COUNT && len + REDUCE_CTRL_LEN <= size; i++) {
+        len += ctrl_put(&buf[len], i, 0, &link_cfg[i]);
+    }
+    for (int i = 0; i < ARRAY_SIZE(sensor_cfg) && len + REDUCE_CTRL_LEN <= size; i++) {
+        const struct sensor_cfg *c = &sensor_cfg[i];
+
+        if (c->used) {
+            len += ctrl_put(&buf[len], c->dev, c->sensor, &c->cfg);
+        }
+    }
+    k_spin_unlock(&cfg_lock, key);
+    return len;
+}
+
+static void stream_reset(struct reduce_stream *s)
+{
+    s->channels = 0;
+    s->pos = 0;
+    if (s->cfg.mode == REDUCE_DECIMATE) {
+        rdsp_fir_design(s->taps, TAPS, s->cfg.param);
+    }
+}
+
+/* State of (dev, sensor) with its current settings. NULL when it passes
+ * through: no state is taken for such streams.
+ */
+static struct reduce_stream *stream_get(uint8_t dev, uint8_t sensor)
+{
+    struct reduce_stream *victim = &streams[0];
+    struct reduce_stream *s = NULL;
+    atomic_val_t gen = atomic_get(&cfg_gen);
+
+    use_count++;
+    for (int i = 0; i < ARRAY_SIZE(streams); i++) {
+        struct reduce_stream *c = &streams[i];
+
+        if (c->used && c->dev == dev && c->sensor == sensor) {
+            s = c;
+            break;
+        }
+        if (victim->used && (!c->used || (int32_t)(c->last_use - victim->last_use) < 0)) {
+            victim = c;
+        }
+    }
+
+    if (s && s->gen == gen) {
+        s->last_use = use_count;
+        return s->cfg.mode == REDUCE_PASS ? NULL : s;
+    }
+
+    struct reduce_cfg cfg = cfg_lookup(dev, sensor);
+
+    if (!s) {
+        if (cfg.mode == REDUCE_PASS) {
+            return NULL;
+        }
+        s = victim;
+        *s = (struct reduce_stream){
+            .used = true,
+            .dev = dev,
+            .sensor = sensor,
+        };
+    }
+    s->gen = gen;
+    s->last_use = use_count;
+    if (memcmp(&cfg, &s->cfg, sizeof(cfg))) {
+        s->cfg = cfg;
+        stream_reset(s);
+    }
+    if (cfg.mode == REDUCE_PASS) {
+        // Let the slot go to a stream that needs it
+        s->used = false;
+        return NULL;
+    }
+    return s;
+}
+
+/* Decoded records keep their sensor id in front of the values */
+static inline int values_offset(const struct agg_data_item *item)
+{
+    return item->sensor ? 1 : 0;
+}
+
+static void write_channels(struct agg_data_item *item, const int16_t *v, int n)
+{
+    uint8_t *p = &item->data[values_offset(item)];
+
+    for (int i = 0; i < n; i++) {
+        sys_put_le16(v[i], &p[2 * i]);
+    }
+    item->len = values_offset(item) + 2 * n;
+}
+
+/* Decimation: the block sits after TAPS - 1 samples of history */
+static bool process_decimate(struct reduce_stream *s, struct agg_data_item *item)
+{
+    int16_t out[MAX_CH];
+    int m = s->cfg.param;
+
+    if (++s->pos < m) {
+        return false;
+    }
+    s->pos = 0;
+
+    for (int ch = 0; ch < s->channels; ch++) {
+        int16_t *x = s->buf[ch];
+
+        // Newest TAPS samples end at the last sample of the block
+        out[ch] = rdsp_fir(s->taps, &x[m - 1], TAPS);
+        memmove(x, &x[m], (TAPS - 1) * sizeof(x[0]));
+    }
+    write_channels(item, out, s->channels);
+    return true;
+}
+
+static bool process_window(struct reduce_stream *s, struct agg_data_item *item)
+{
+    int16_t out[4 * MAX_CH];
+
+    if (++s->pos < s->cfg.param) {
+        return false;
+    }
+    s->pos = 0;
+
+    for (int ch = 0; ch < s->channels; ch++) {
+        struct rdsp_stats st;
+
+        rdsp_stats(s->buf[ch], s->cfg.param, &st);
+        out[4 * ch] = st.min;
+        out[4 * ch + 1] = st.max;
+        out[4 * ch + 2] = st.mean;
+        out[4 * ch + 3] = st.rms;
+    }
+    write_channels(item, out, 4 * s->channels);
+    return true;
+}
+
+static bool process_threshold(struct reduce_stream *s, const int16_t *x)
+{
+    int16_t last[MAX_CH];
+    int16_t scratch[MAX_CH];
+
+    if (s->pos == 0) {
+        // First sample since (re)configuration always goes out
+        s->pos = 1;
+    } else {
+        for (int ch = 0; ch < s->channels; ch++) {
+            last[ch] = s->buf[ch][0];
+        }
+        if (rdsp_max_abs_diff(x, last, s->channels, scratch) <= s->cfg.threshold) {
+            return false;
+        }
+    }
+
+    for (int ch = 0; ch < s->channels; ch++) {
+        s->buf[ch][0] = x[ch];
+    }
+    return true;
+}
+
+bool reduce_process(struct agg_data_item *item)
+{
+    int16_t x[MAX_CH];
+
+    if (IS_ENABLED(CONFIG_BHI_DECODE) && item->sensor && !bhi_sensor_s16(item->sensor)) {
+        return true;
+    }
+
+    struct reduce_stream *s = stream_get(item->dev, item->sensor);
+
+    if (!s) {
+        return true;
+    }
+
+    const uint8_t *v = &item->data[values_offset(item)];
+    int len = item->len - values_offset(item);
+    int channels = len / 2;
+    if ((len & 1) || channels == 0 || channels > MAX_CH) {
+        return true;
+    }
+    if (channels != s->channels) {
+        // New stream layout: start over
+        stream_reset(s);
+        s->channels = channels;
+        memset(s->buf, 0, sizeof(s->buf));
+    }
+
+    for (int ch = 0; ch < channels; ch++) {
+        x[ch] = sys_get_le16(&v[2 * ch]);
+    }
+
+    switch (s->cfg.mode) {
+    case REDUCE_DECIMATE:
+        for (int ch = 0; ch < channels; ch++) {
+            s->buf[ch][TAPS - 1 + s->pos] = x[ch];
+        }
+        return process_decimate(s, item);
+    case REDUCE_WINDOW:
+        for (int ch = 0; ch < channels; ch++) {
+            s->buf[ch][s->pos] = x[ch];
+        }
+        return process_window(s, item);
+    case REDUCE_THRESHOLD:
+        return process_threshold(s, x);
+    default:
+        return true;
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef REDUCE_H_
+#define REDUCE_H_
+
+#include <zephyr/kernel.h>
+
+#include "agg_pool.h"
+#include "peers.h"
+
+/* Optional per-stream reduction in the aggregate stage, configured from
+ * the phone through the control characteristic. A stream is one sensor
+ * of one link: the raw notifications of the link, or one hub sensor id
+ * with BHI_DECODE. Decoded hub records with int16 vector values
+ * (src/bhi_decode.h) and raw payloads of little-endian int16 channels
+ * are reduced; anything else passes.
+ *
+ *   REDUCE_PASS       forward every sample
+ *   REDUCE_DECIMATE   anti-alias FIR, forward one sample in param
+ *   REDUCE_WINDOW     every param samples forward min, max, mean, rms
+ *                     per channel (4 x int16 each)
+ *   REDUCE_THRESHOLD  forward a sample only when a channel moved more
+ *                     than threshold since the last forwarded one
+ */
+enum reduce_mode {
+    REDUCE_PASS,
+    REDUCE_DECIMATE,
+    REDUCE_WINDOW,
+    REDUCE_THRESHOLD,
+};
+
+/* Control characteristic record:
+ *   u8 dev (0xff: all links on write), u8 mode, u8 param, u8 sensor,
+ *   le16 threshold
+ * Sensor 0 sets the link's raw samples and every hub sensor of the link
+ * without a setting of its own. A read returns the sensor 0 record of
+ * every link, then every sensor specific one.
+ */
+#define REDUCE_CTRL_LEN 6
+#define REDUCE_CTRL_ALL 0xff
+#define REDUCE_CTRL_MAX_LEN (REDUCE_CTRL_LEN * (PEER_COUNT + CONFIG_BHI_REDUCE_STREAMS))
+
+struct reduce_cfg {
+    uint8_t mode;
+    uint8_t param;
+    uint16_t threshold;
+};
+
+/* Apply to the next sample of the stream; callable from any thread.
+ * -ENOMEM when CONFIG_BHI_REDUCE_STREAMS sensor settings already exist.
+ */
+int reduce_configure(uint8_t dev, uint8_t sensor, const struct reduce_cfg *cfg);
+
+/* Parse and apply a control characteristic write */
+int reduce_ctrl_write(const uint8_t *data, uint16_t len);
+
+/* Fill buf with the control records, returns the length */
+uint16_t reduce_ctrl_read(uint8_t *buf, uint16_t size);
+
+/* Run item through its stream's reduction. Returns false when the sample
+ * was absorbed and must not be forwarded; otherwise item may have been
+ * rewritten with the reduced output.
+ */
+bool reduce_process(struct agg_data_item *item);
+
+#endif /* REDUCE_H_ */
@@ -0,0 +1,107 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include <zephyr/sys/util.h>
+
+#if defined(CONFIG_BHI_REDUCE_CMSIS_DSP)
+#include <arm_math.h>
+#endif
+
+#include "reduce_dsp.h"
+
+void rdsp_fir_design(int16_t *taps, int ntaps, int m)
+{
+    const float cutoff = 0.5f / m;
+    float h[ntaps];
+    float sum = 0.0f;
+
+    for (int i = 0; i < ntaps; i++) {
+        float n = i - (ntaps - 1) / 2.0f;
+        float sinc = n == 0.0f ? 2.0f * cutoff :
+                     sinf(2.0f * (float)M_PI * cutoff * n) / ((float)M_PI * n);
+        float hamming = 0.54f - 0.46f * cosf(2.0f * (float)M_PI * i / (ntaps - 1));
+
+        h[i] = sinc * hamming;
+        sum += h[i];
+    }
+
+    // Unity gain at DC, stored reversed
+    for (int i = 0; i < ntaps; i++) {
+        taps[ntaps - 1 - i] = (int16_t)CLAMP(lrintf(h[i] / sum * 32768.0f), INT16_MIN, INT16_MAX);
+    }
+}
+
+#if defined(CONFIG_BHI_REDUCE_CMSIS_DSP)
+
+int16_t rdsp_fir(const int16_t *taps, const int16_t *x, int ntaps)
+{
+    q63_t acc;
+
+    // 34.30 result back to Q15
+    arm_dot_prod_q15(taps, x, ntaps, &acc);
+    return (int16_t)CLAMP(acc >> 15, INT16_MIN, INT16_MAX);
+}
+
+void rdsp_stats(const int16_t *x, int n, struct rdsp_stats *out)
+{
+    uint32_t idx;
+
+    arm_min_q15(x, n, &out->min, &idx);
+    arm_max_q15(x, n, &out->max, &idx);
+    arm_mean_q15(x, n, &out->mean);
+    arm_rms_q15(x, n, &out->rms);
+}
+
+int16_t rdsp_max_abs_diff(const int16_t *a, const int16_t *b, int n, int16_t *scratch)
+{
+    q15_t max;
+    uint32_t idx;
+
+    arm_sub_q15(a, b, scratch, n);
+    arm_abs_q15(scratch, scratch, n);
+    arm_max_q15(scratch, n, &max, &idx);
+    return max;
+}
+
+#else
+
+int16_t rdsp_fir(const int16_t *taps, const int16_t *x, int ntaps)
+{
+    int64_t acc = 0;
+
+    for (int i = 0; i < ntaps; i++) {
+        acc += (int32_t)taps[i] * x[i];
+    }
+    return (int16_t)CLAMP(acc >> 15, INT16_MIN, INT16_MAX);
+}
+
+void rdsp_stats(const int16_t *x, int n, struct rdsp_stats *out)
+{
+    int64_t sum = 0;
+    uint64_t sq = 0;
+
+    out->min = INT16_MAX;
+    out->max = INT16_MIN;
+    for (int i = 0; i < n; i++) {
+        out->min = MIN(out->min, x[i]);
+        out->max = MAX(out->max, x[i]);
+        sum += x[i];
+        sq += (int32_t)x[i] * x[i];
+    }
+    out->mean = sum / n;
+    out->rms = (int16_t)MIN(sqrtf((float)sq / n), INT16_MAX);
+}
+
+int16_t rdsp_max_abs_diff(const int16_t *a, const int16_t *b, int n, int16_t *scratch)
+{
+    int32_t max = 0;
+
+    ARG_UNUSED(scratch);
+    for (int i = 0; i < n; i++) {
+        max = MAX(max, abs((int32_t)a[i] - b[i]));
+    }
+    // Same saturation as arm_sub_q15/arm_abs_q15
+    return (int16_t)MIN(max, INT16_MAX);
+}
+
+#endif
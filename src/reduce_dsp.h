@@ -0,0 +1,33 @@
+#ifndef REDUCE_DSP_H_
+#define REDUCE_DSP_H_
+
+#include <zephyr/types.h>
+
+/* Q15 kernels of the reduction stage. Built on CMSIS-DSP when
+ * CONFIG_BHI_REDUCE_CMSIS_DSP is set, portable C otherwise (native_sim).
+ * Samples are raw int16 sensor counts treated as Q15.
+ */
+
+struct rdsp_stats {
+    int16_t min;
+    int16_t max;
+    int16_t mean;
+    int16_t rms;
+};
+
+/* Windowed-sinc low-pass for decimation by m, cutoff at the new Nyquist.
+ * Taps are stored time-reversed, ready for rdsp_fir().
+ */
+void rdsp_fir_design(int16_t *taps, int ntaps, int m);
+
+/* One FIR output: dot product of the reversed taps with the ntaps most
+ * recent samples ending at x[ntaps - 1], saturated to Q15.
+ */
+int16_t rdsp_fir(const int16_t *taps, const int16_t *x, int ntaps);
+
+void rdsp_stats(const int16_t *x, int n, struct rdsp_stats *out);
+
+/* Largest |a[i] - b[i]|; scratch holds n samples */
+int16_t rdsp_max_abs_diff(const int16_t *a, const int16_t *b, int n, int16_t *scratch);
+
+#endif /* REDUCE_DSP_H_ */
@@ -0,0 +1,482 @@
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/gatt.h>
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+#include "link.h"
+#include "peers.h"
+#include "sensor_cmd.h"
+
+#define REQS CONFIG_BHI_CMD_REQUESTS
+#define QUEUE CONFIG_BHI_CMD_QUEUE
+/* Retry after the stack ran out of buffers for a write */
+#define CMD_RETRY_MS 10
+/* Largest write to a sensor: ATT MTU 247 minus the opcode and handle */
+#define CMD_PDU_MAX 244
+
+BUILD_ASSERT(PEER_COUNT <= 8, "Links are a u8 bitmap");
+
+struct cmd_req {
+    bool used;
+    uint8_t gen;                    // Tells a reused slot from the old request
+    struct bt_conn *conn;           // Phone that asked, NULL for the hub's own
+    sensor_cmd_done_cb done;        // Hub's own only
+    void *user_data;
+    uint8_t token;
+    uint8_t links;
+    uint8_t answered;
+    uint8_t failed;
+    int64_t deadline;
+    uint8_t cmd_len;
+    uint8_t cmd[CONFIG_BHI_CMD_MAX_LEN];
+    uint8_t resp_len[PEER_COUNT];
+    uint8_t resp[PEER_COUNT][CONFIG_BHI_CMD_RESP_LEN];
+};
+
+struct cmd_entry {
+    uint8_t req;
+    uint8_t gen;
+    uint8_t id;                     // Sent with the command, echoed in its answer
+};
+
+/* Commands for one sensor link, oldest at head. The first sent of them
+ * are written and wait for their answer, the others for a write.
+ */
+struct cmd_link {
+    const struct bt_conn *conn;     // Connection the commands were queued on
+    struct cmd_entry queue[QUEUE];
+    uint8_t head;
+    uint8_t count;
+    uint8_t sent;
+    uint8_t inflight;               // Writes the stack has not sent yet
+    uint8_t next_id;
+};
+
+/* Guards the tables against the BT RX thread and the work queue */
+static struct k_spinlock cmd_lock;
+static struct cmd_req reqs[REQS];
+static struct cmd_link cmd_links[PEER_COUNT];
+static const struct bt_gatt_attr *ack_attr;
+static struct sensor_cmd_stats stats;
+
+static void cmd_run(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(cmd_work, cmd_run);
+
+/* Connection of link idx if its sensor takes commands, else NULL */
+static struct bt_conn *cmd_link_conn(int idx)
+{
+    struct link *link = link_get(idx);
+
+    if (link->state != LINK_SUBSCRIBED && link->state != LINK_STREAMING) {
+        return NULL;
+    }
+    return link->disc.handles.cmd_value_handle ? link->conn : NULL;
+}
+
+/* Lock held */
+static void cmd_fail(int slot, uint8_t gen, int idx)
+{
+    struct cmd_req *r = &reqs[slot];
+
+    if (r->used && r->gen == gen && !(r->failed & BIT(idx))) {
+        r->failed |= BIT(idx);
+        stats.failed++;
+    }
+}
+
+/* Lock held. The link got a new connection or lost it: whatever was
+ * queued on the old one is lost.
+ */
+static void cmd_link_reset(int idx, const struct bt_conn *conn)
+{
+    struct cmd_link *cl = &cmd_links[idx];
+
+    for (int i = 0; i < cl->count; i++) {
+        const struct cmd_entry *e = &cl->queue[(cl->head + i) % QUEUE];
+
+        cmd_fail(e->req, e->gen, idx);
+    }
+    cl->conn = conn;
+    cl->count = 0;
+    cl->sent = 0;
+    cl->inflight = 0;
+}
+
+/* Lock held. Drop the commands of a finished request, the ones waiting
+ * for an answer included: the ids keep a late answer from being taken
+ * for a later command's.
+ */
+static void cmd_purge(int slot, uint8_t gen)
+{
+    for (int i = 0; i < PEER_COUNT; i++) {
+        struct cmd_link *cl = &cmd_links[i];
+        uint8_t keep = 0;
+        uint8_t sent = 0;
+
+        for (int j = 0; j < cl->count; j++) {
+            struct cmd_entry e = cl->queue[(cl->head + j) % QUEUE];
+
+            if (e.req != slot || e.gen != gen) {
+                cl->queue[(cl->head + keep++) % QUEUE] = e;
+                sent += j < cl->sent;
+            }
+        }
+        cl->count = keep;
+        cl->sent = sent;
+    }
+}
+
+/* Open a request for cmd to links. Returns the links it was queued on. */
+static int cmd_open(struct bt_conn *conn, uint8_t token, uint8_t links, const uint8_t *cmd,
+                    uint16_t len, sensor_cmd_done_cb done, void *user_data)
+{
+    struct bt_conn *link_conns[PEER_COUNT];
+    uint8_t queued = 0;
+    int slot = -1;
+
+    if (!len || len > CONFIG_BHI_CMD_MAX_LEN) {
+        return -EINVAL;
+    }
+    links = links ? links : BIT_MASK(PEER_COUNT);
+    if (links & ~BIT_MASK(PEER_COUNT)) {
+        return -EINVAL;
+    }
+    for (int i = 0; i < PEER_COUNT; i++) {
+        link_conns[i] = cmd_link_conn(i);
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&cmd_lock);
+
+    for (int i = 0; i < REQS; i++) {
+        if (!reqs[i].used) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        k_spin_unlock(&cmd_lock, key);
+        return -EBUSY;
+    }
+
+    struct cmd_req *r = &reqs[slot];
+
+    *r = (struct cmd_req) {
+        .used = true,
+        .gen = r->gen + 1,
+        .conn = conn ? bt_conn_ref(conn) : NULL,
+        .done = done,
+        .user_data = user_data,
+        .token = token,
+        .links = links,
+        .deadline = k_uptime_get() + CONFIG_BHI_CMD_TIMEOUT_MS,
+        .cmd_len = len,
+    };
+    memcpy(r->cmd, cmd, len);
+    stats.requests++;
+
+    for (int i = 0; i < PEER_COUNT; i++) {
+        struct cmd_link *cl = &cmd_links[i];
+
+        if (!(links & BIT(i))) {
+            continue;
+        }
+        if (cl->conn != link_conns[i]) {
+            cmd_link_reset(i, link_conns[i]);
+        }
+        if (!cl->conn || cl->count == QUEUE) {
+            cmd_fail(slot, r->gen, i);
+            continue;
+        }
+        cl->queue[(cl->head + cl->count) % QUEUE] = (struct cmd_entry) {
+            slot, r->gen, cl->next_id++,
+        };
+        cl->count++;
+        queued |= BIT(i);
+    }
+    k_spin_unlock(&cmd_lock, key);
+
+    k_work_reschedule(&cmd_work, K_NO_WAIT);
+    return queued;
+}
+
+int sensor_cmd_submit(struct bt_conn *conn, const uint8_t *buf, uint16_t len)
+{
+    if (len <= SENSOR_CMD_HDR_LEN) {
+        return -EINVAL;
+    }
+
+    int err = cmd_open(conn, buf[0], buf[1], &buf[SENSOR_CMD_HDR_LEN],
+                       len - SENSOR_CMD_HDR_LEN, NULL, NULL);
+
+    return err < 0 ? err : 0;
+}
+
+int sensor_cmd_send(uint8_t links, const uint8_t *cmd, uint16_t len, sensor_cmd_done_cb done,
+                    void *user_data)
+{
+    return cmd_open(NULL, 0, links, cmd, len, done, user_data);
+}
+
+void sensor_cmd_response(int idx, const void *data, uint16_t len)
+{
+    struct cmd_link *cl = &cmd_links[idx];
+    const uint8_t *resp = data;
+    bool done = false;
+
+    if (!len) {
+        return;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&cmd_lock);
+
+    for (int i = 0; i < cl->sent; i++) {
+        struct cmd_entry e = cl->queue[(cl->head + i) % QUEUE];
+
+        if (e.id != resp[0]) {
+            continue;
+        }
+        // Answers come in order: the ones before got none and never will
+        for (int j = 0; j < i; j++) {
+            const struct cmd_entry *skipped = &cl->queue[(cl->head + j) % QUEUE];
+
+            cmd_fail(skipped->req, skipped->gen, idx);
+        }
+        cl->head = (cl->head + i + 1) % QUEUE;
+        cl->count -= i + 1;
+        cl->sent -= i + 1;
+
+        struct cmd_req *r = &reqs[e.req];
+
+        if (r->used && r->gen == e.gen) {
+            r->answered |= BIT(idx);
+            r->resp_len[idx] = MIN(len - 1, CONFIG_BHI_CMD_RESP_LEN);
+            memcpy(r->resp[idx], &resp[1], r->resp_len[idx]);
+            stats.answers++;
+            done = (r->answered | r->failed) == r->links;
+        }
+        break;
+    }
+    k_spin_unlock(&cmd_lock, key);
+
+    if (done) {
+        k_work_reschedule(&cmd_work, K_NO_WAIT);
+    }
+}
+
+/* The stack sent one of our writes, the link may take the next */
+static void cmd_sent(struct bt_conn *conn, void *user_data)
+{
+    struct cmd_link *cl = user_data;
+    k_spinlock_key_t key = k_spin_lock(&cmd_lock);
+
+    if (cl->inflight) {
+        cl->inflight--;
+    }
+    k_spin_unlock(&cmd_lock, key);
+    k_work_reschedule(&cmd_work, K_NO_WAIT);
+}
+
+/* Write the commands waiting on link idx, as many as fit, in one PDU.
+ * Returns the number written, or a negative error to retry later.
+ */
+static int cmd_link_write(int idx)
+{
+    struct cmd_link *cl = &cmd_links[idx];
+    struct bt_conn *conn = cmd_link_conn(idx);
+    uint16_t handle = link_get(idx)->disc.handles.cmd_value_handle;
+    uint16_t cap = conn ? MIN(bt_gatt_get_mtu(conn) - 3, CMD_PDU_MAX) : 0;
+    uint8_t pdu[CMD_PDU_MAX];
+    uint16_t len = 0;
+    int n = 0;
+    int err;
+    k_spinlock_key_t key = k_spin_lock(&cmd_lock);
+
+    if (cl->conn != conn) {
+        cmd_link_reset(idx, conn);
+    }
+    if (conn && cl->inflight < CONFIG_BHI_CMD_INFLIGHT) {
+        while (cl->sent + n < cl->count) {
+            const struct cmd_entry *e = &cl->queue[(cl->head + cl->sent + n) % QUEUE];
+            const struct cmd_req *r = &reqs[e->req];
+
+            if (len + 2 + r->cmd_len > cap) {
+                break;
+            }
+            pdu[len++] = e->id;
+            pdu[len++] = r->cmd_len;
+            memcpy(&pdu[len], r->cmd, r->cmd_len);
+            len += r->cmd_len;
+            n++;
+        }
+    }
+    if (!n) {
+        k_spin_unlock(&cmd_lock, key);
+        return 0;
+    }
+    cl->sent += n;
+    cl->inflight++;
+    k_spin_unlock(&cmd_lock, key);
+
+    err = bt_gatt_write_without_response_cb(conn, handle, pdu, len, false, cmd_sent, cl);
+
+    key = k_spin_lock(&cmd_lock);
+    if (!err) {
+        stats.writes++;
+        stats.cmds += n;
+    } else if (cl->conn == conn && cl->sent >= n) {
+        // Out of buffers: the same commands go out on the next try
+        cl->sent -= n;
+        cl->inflight--;
+    }
+    k_spin_unlock(&cmd_lock, key);
+    return err ? err : n;
+}
+
+/* Combined acknowledgement of request r, see src/sensor_cmd.h */
+static uint16_t cmd_ack_encode(const struct cmd_req *r, uint8_t *buf, uint16_t size)
+{
+    uint16_t len = SENSOR_CMD_ACK_HDR_LEN;
+
+    buf[0] = r->token;
+    buf[1] = r->links;
+    buf[2] = r->answered;
+    buf[3] = r->failed;
+    for (int i = 0; i < PEER_COUNT; i++) {
+        if (!(r->answered & BIT(i)) || len + 2 + r->resp_len[i] > size) {
+            continue;
+        }
+        buf[len++] = i;
+        buf[len++] = r->resp_len[i];
+        memcpy(&buf[len], r->resp[i], r->resp_len[i]);
+        len += r->resp_len[i];
+    }
+    return len;
+}
+
+/* Close request slot if every link answered or its time is up. Returns
+ * its deadline while it stays open, 0 once closed.
+ */
+static int64_t cmd_req_check(int slot, int64_t now)
+{
+    uint8_t ack[SENSOR_CMD_ACK_LEN(PEER_COUNT)];
+    struct cmd_req *r = &reqs[slot];
+    struct bt_conn *conn;
+    sensor_cmd_done_cb done;
+    void *user_data;
+    uint8_t answered;
+    uint8_t failed;
+    uint16_t len;
+    k_spinlock_key_t key = k_spin_lock(&cmd_lock);
+
+    if (!r->used) {
+        k_spin_unlock(&cmd_lock, key);
+        return 0;
+    }
+    if ((r->answered | r->failed) != r->links && now < r->deadline) {
+        k_spin_unlock(&cmd_lock, key);
+        return r->deadline;
+    }
+
+    for (int i = 0; i < PEER_COUNT; i++) {
+        if ((r->links & BIT(i)) && !(r->answered & BIT(i))) {
+            cmd_fail(slot, r->gen, i);
+        }
+    }
+    cmd_purge(slot, r->gen);
+    conn = r->conn;
+    len = conn ? cmd_ack_encode(r, ack, MIN(sizeof(ack), bt_gatt_get_mtu(conn) - 3)) : 0;
+    done = r->done;
+    user_data = r->user_data;
+    answered = r->answered;
+    failed = r->failed;
+    r->conn = NULL;
+    r->used = false;
+    k_spin_unlock(&cmd_lock, key);
+
+    if (!conn) {
+        // The hub's own command, no phone waits for an ack
+        if (done) {
+            done(answered, failed, user_data);
+        }
+        return 0;
+    }
+
+    int err = bt_gatt_notify(conn, ack_attr, ack, len);
+
+    if (err && err != -ENOTCONN) {
+        printk("Command ack for the phone failed (err %d)\n", err);
+    }
+    bt_conn_unref(conn);
+    return 0;
+}
+
+/* Runs on the system work queue: writes, acks and timeouts */
+static void cmd_run(struct k_work *work)
+{
+    int64_t now = k_uptime_get();
+    int64_t next = INT64_MAX;
+
+    for (int i = 0; i < PEER_COUNT; i++) {
+        int n;
+
+        do {
+            n = cmd_link_write(i);
+        } while (n > 0);
+        if (n < 0) {
+            next = now + CMD_RETRY_MS;
+        }
+    }
+
+    for (int i = 0; i < REQS; i++) {
+        int64_t deadline = cmd_req_check(i, now);
+
+        if (deadline) {
+            next = MIN(next, deadline);
+        }
+    }
+
+    if (next != INT64_MAX) {
+        k_work_reschedule(&cmd_work, K_MSEC(MAX(next - now, 0)));
+    }
+}
+
+void sensor_cmd_init(const struct bt_gatt_attr *attr)
+{
+    ack_attr = attr;
+}
+
+void sensor_cmd_stats_get(struct sensor_cmd_stats *out)
+{
+    k_spinlock_key_t key = k_spin_lock(&cmd_lock);
+
+    *out = stats;
+    k_spin_unlock(&cmd_lock, key);
+}
+
+#if defined(CONFIG_SHELL)
+static int cmd_cmd(const struct shell *sh, size_t argc, char **argv)
+{
+    struct sensor_cmd_stats s;
+
+    sensor_cmd_stats_get(&s);
+    shell_print(sh, "%u requests, %u commands in %u writes, %u answers, %u failed",
+                s.requests, s.cmds, s.writes, s.answers, s.failed);
+    for (int i = 0; i < PEER_COUNT; i++) {
+        const struct cmd_link *cl = &cmd_links[i];
+
+        shell_print(sh, "device %d: %s, %u queued, %u waiting for an answer, %u writes in flight",
+                    i, cmd_link_conn(i) ? "ready" : "no command path", cl->count - cl->sent,
+                    cl->sent, cl->inflight);
+    }
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((bhi), cmd, NULL, "Phone to sensor command channel", cmd_cmd, 1, 0);
+#endif
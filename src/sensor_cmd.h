@@ -0,0 +1,80 @@
+#ifndef SENSOR_CMD_H_
+#define SENSOR_CMD_H_
+
+#include <zephyr/types.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/gatt.h>
+
+/* Command channel from the phone to the sensors (CONFIG_BHI_CMD).
+ *
+ * The phone writes a request to the command characteristic of the
+ * aggregate service:
+ *
+ *   request: | token | links | cmd (1..CONFIG_BHI_CMD_MAX_LEN) |
+ *
+ * links has a bit per peer index, 0 meaning all. The command goes to the
+ * command characteristic of every selected sensor at once, with writes
+ * without response, so reconfiguring N sensors takes about one round
+ * trip. Each link has at most CONFIG_BHI_CMD_INFLIGHT writes in the
+ * controller; commands queued behind them go out together, packed into
+ * one write as far as the ATT MTU allows:
+ *
+ *   sensor write: | id | len | cmd | id | len | cmd | ...
+ *
+ * id counts the commands of the link. A sensor indicates one response
+ * per command, in order, led by the command's id:
+ *
+ *   sensor response: | id | response |
+ *
+ * Commands sent before the answered one that got no answer of their own
+ * have failed. An answer arriving after its request timed out matches
+ * nothing and is dropped. Once every selected link answered, or after
+ * CONFIG_BHI_CMD_TIMEOUT_MS, the phone gets one notification on the
+ * command characteristic:
+ *
+ *   ack: | token | links | answered | failed | answer... |
+ *   answer: | dev | len | response (at most CONFIG_BHI_CMD_RESP_LEN) |
+ *
+ * links is the set the request selected, expanded from 0. failed are the
+ * links that could not be written or did not answer in time.
+ */
+#define SENSOR_CMD_HDR_LEN 2
+#define SENSOR_CMD_ACK_HDR_LEN 4
+#define SENSOR_CMD_ACK_LEN(links) \
+    (SENSOR_CMD_ACK_HDR_LEN + (links) * (2 + CONFIG_BHI_CMD_RESP_LEN))
+
+struct sensor_cmd_stats {
+    uint32_t requests;
+    uint32_t writes;       // Write PDUs to the sensors
+    uint32_t cmds;         // Commands in them
+    uint32_t answers;
+    uint32_t failed;       // Links a request could not reach
+};
+
+/* attr is the command characteristic's value, for the acks */
+void sensor_cmd_init(const struct bt_gatt_attr *attr);
+
+/* Request from the phone on conn, see above. -EINVAL for a malformed
+ * request, -EBUSY while CONFIG_BHI_CMD_REQUESTS are open.
+ */
+int sensor_cmd_submit(struct bt_conn *conn, const uint8_t *buf, uint16_t len);
+
+/* Called on the system work queue when a command of the hub closes, with
+ * the links that answered and those that failed
+ */
+typedef void (*sensor_cmd_done_cb)(uint8_t answered, uint8_t failed, void *user_data);
+
+/* Command of the hub itself to links (0 for all), the same way but
+ * without an ack; done, if not NULL, gets the outcome instead. Returns
+ * the links it was queued on, which may be none, or -EINVAL / -EBUSY as
+ * above. done is only called when the command was opened.
+ */
+int sensor_cmd_send(uint8_t links, const uint8_t *cmd, uint16_t len, sensor_cmd_done_cb done,
+                    void *user_data);
+
+/* Indication from the command characteristic of sensor link idx */
+void sensor_cmd_response(int idx, const void *data, uint16_t len);
+
+void sensor_cmd_stats_get(struct sensor_cmd_stats *stats);
+
+#endif /* SENSOR_CMD_H_ */
@@ -0,0 +1,603 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+
+#include "agg_delta.h"
+#include "agg_frame.h"
+#include "bhi_decode.h"
+#include "conn_sched.h"
+#include "link_params.h"
+#include "metrics.h"
+#include "peers.h"
+#include "pipeline.h"
+#include "sim.h"
+
+BUILD_ASSERT(CONFIG_BHI_SIM_PAYLOAD_LEN <= CONFIG_BHI_AGG_MAX_PAYLOAD,
+             "Simulated samples must fit a pool buffer");
+
+#define SIM_PEERS_STACK_SIZE 1024
+/* Same cooperative priority as the BT RX thread that runs notify_func */
+#define SIM_PEERS_PRIORITY K_PRIO_COOP(8)
+
+#define SIM_SAMPLE_LEN (IS_ENABLED(CONFIG_BHI_DECODE) ? 20 : CONFIG_BHI_SIM_PAYLOAD_LEN)
+/* Samples a peer holds for its next connection event */
+#define SIM_PENDING 32
+/* Event length controllers grant when nobody asked for one */
+#define SIM_EVENT_DEFAULT_US 7500
+/* Radio users: the peers, then the phone */
+#define SIM_PHONE PEER_COUNT
+
+struct sim_radio {
+    int64_t anchor_us;       // Next connection event
+    uint32_t interval_us;
+    uint32_t event_us;       // Longest event it gets
+    uint32_t demand_us;      // Phone only: what one of its events takes
+};
+
+/* Radio totals, for the benchmark report */
+struct sim_radio_totals {
+    uint32_t events;
+    uint32_t skipped;        // Started while another link had the radio
+    uint32_t overflow;       // Samples lost to a full pending buffer
+    uint32_t lat_n;          // Sensor -> hub latency of delivered samples
+    uint64_t lat_sum;
+    uint64_t lat_sq;
+};
+
+struct sim_peer {
+    int64_t next_due_us;
+    int64_t silent_until;    // Simulated link loss ends, 0 while up
+    int64_t up_time;         // When the peer last started producing
+    bool waiting;            // Nothing delivered to the phone since up_time
+    bool streamed;           // At least one sample delivered ever
+    uint16_t counter;
+    uint32_t generated;
+    uint32_t losses;
+    uint32_t stream_ms;      // Start -> first sample at the phone
+    uint32_t reconnect_ms;   // Last link loss -> first sample at the phone
+    int64_t lost_time;
+    int64_t pending[SIM_PENDING];   // Generation times, oldest at head
+    uint8_t pending_head;
+    uint8_t pending_count;
+};
+
+static struct sim_peer sim_peers[PEER_COUNT];
+static struct sim_radio sim_radio[PEER_COUNT + 1];
+static int64_t radio_busy_until;
+static struct sim_radio_totals radio;
+static int sim_booked_pct = -1;  // Share of the base period, -1 unscheduled
+static sim_ingest_fn sim_ingest;
+static int64_t sim_start_time;
+
+/* Phone side totals, updated by the phone worker */
+static uint32_t phone_bytes;
+static uint32_t phone_samples;
+
+/* Totals at the previous benchmark report */
+static uint32_t report_bytes;
+static uint32_t report_samples;
+static struct sim_radio_totals report_radio;
+static int64_t report_time;
+
+K_THREAD_STACK_DEFINE(sim_peers_stack, SIM_PEERS_STACK_SIZE);
+static struct k_thread sim_peers_thread;
+
+static void sim_report_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(sim_report_work, sim_report_handler);
+
+static int64_t sim_now_us(void)
+{
+    return k_ticks_to_us_floor64(k_uptime_ticks());
+}
+
+/* One sensor hub FIFO frame: full timestamp, accelerometer, gyroscope */
+static uint16_t sim_hub_frame(int idx, const struct sim_peer *p, int64_t gen_us, uint8_t *buf)
+{
+    uint64_t ticks = gen_us * BHI_TICK_HZ / USEC_PER_SEC;
+    int16_t v = (int16_t)(p->counter * 64);
+
+    buf[0] = 0xf7;
+    sys_put_le32((uint32_t)ticks, &buf[1]);
+    buf[5] = (uint8_t)(ticks >> 32);
+    buf[6] = 4;
+    sys_put_le16(v, &buf[7]);
+    sys_put_le16(-v, &buf[9]);
+    sys_put_le16(idx * 1000, &buf[11]);
+    buf[13] = 13;
+    sys_put_le16(v / 2, &buf[14]);
+    sys_put_le16(0, &buf[16]);
+    sys_put_le16(-v / 2, &buf[18]);
+    return 20;
+}
+
+static void sim_peer_sample(int idx, struct sim_peer *p, int64_t gen_us)
+{
+    uint8_t data[MAX(CONFIG_BHI_SIM_PAYLOAD_LEN, 20)];
+    uint16_t len = CONFIG_BHI_SIM_PAYLOAD_LEN;
+
+    if (IS_ENABLED(CONFIG_BHI_DECODE)) {
+        len = sim_hub_frame(idx, p, gen_us, data);
+    } else {
+        memset(data, idx, len);
+        if (len >= 2) {
+            sys_put_le16(p->counter, data);
+        }
+    }
+    p->counter++;
+
+    sim_ingest(idx, data, len, metrics_stamp());
+}
+
+/* A sample is ready at the peer; it goes out at the next connection event */
+static void sim_peer_queue(struct sim_peer *p, int64_t gen_us)
+{
+    p->generated++;
+    if (p->pending_count == SIM_PENDING) {
+        radio.overflow++;
+        return;
+    }
+    p->pending[(p->pending_head + p->pending_count) % SIM_PENDING] = gen_us;
+    p->pending_count++;
+}
+
+/* Radio time of one link layer packet of len bytes and its acknowledgement */
+static uint32_t sim_pdu_us(uint32_t len)
+{
+    uint32_t us = CONFIG_BHI_SIM_PHONE_PDU_US;
+
+    if (CONFIG_BHI_SIM_PHONE_KBPS) {
+        us += len * 8 * 1000 / CONFIG_BHI_SIM_PHONE_KBPS;
+    }
+    return us;
+}
+
+/* Modeled traffic of a radio user: the peers send a notification per
+ * sample, the phone gets every sample in MTU sized notifications.
+ */
+static void sim_radio_load(int u, uint32_t *pkts_per_s, uint16_t *pkt_len)
+{
+    if (u == SIM_PHONE) {
+        uint32_t bytes = PEER_COUNT * CONFIG_BHI_SIM_RATE_HZ *
+                         (sizeof(struct agg_rec_hdr) + SIM_SAMPLE_LEN);
+
+        *pkts_per_s = DIV_ROUND_UP(bytes, CONFIG_BHI_SIM_PHONE_MTU - 3);
+        *pkt_len = MIN(CONFIG_BHI_SIM_PHONE_MTU + 4, 251);
+    } else {
+        *pkts_per_s = CONFIG_BHI_SIM_RATE_HZ;
+        *pkt_len = SIM_SAMPLE_LEN + 4 + 3;
+    }
+}
+
+/* Event sized for the traffic of one interval, with a spare packet for
+ * rate jitter
+ */
+static uint32_t sim_event_us(int u, uint32_t interval_us)
+{
+    uint32_t pkts_per_s;
+    uint16_t pkt_len;
+
+    sim_radio_load(u, &pkts_per_s, &pkt_len);
+    uint32_t pkts = DIV_ROUND_UP((uint64_t)pkts_per_s * interval_us, USEC_PER_SEC);
+
+    return sim_pdu_us(0) + (pkts + 1) * sim_pdu_us(pkt_len);
+}
+
+#if defined(CONFIG_BHI_SIM_CONN_SCHED)
+/* Plan the links like conn_sched does, then lay their events out once:
+ * each takes the phase whose base periods are least booked and starts
+ * after what is already there
+ */
+static void sim_radio_setup(int64_t start_us)
+{
+    struct conn_sched_link loads[PEER_COUNT + 1];
+    struct conn_sched_slot slots[PEER_COUNT + 1];
+    uint32_t used[CONFIG_BHI_CONN_SCHED_MAX_MULT] = {0};
+    uint32_t base_us = link_params_conn_param()->interval_min * 1250;
+    uint8_t phy = link_params_profile() == LINK_PROFILE_LOW_POWER ? BT_GAP_LE_PHY_1M :
+                                                                    BT_GAP_LE_PHY_2M;
+
+    for (int u = 0; u <= SIM_PHONE; u++) {
+        sim_radio_load(u, &loads[u].pkts_per_s, &loads[u].pkt_len);
+        loads[u].phy = phy;
+    }
+    sim_booked_pct = conn_sched_plan(loads, ARRAY_SIZE(loads), base_us, slots);
+
+    for (int u = 0; u <= SIM_PHONE; u++) {
+        struct sim_radio *r = &sim_radio[u];
+        uint8_t mult = slots[u].mult;
+        uint32_t best_off = UINT32_MAX;
+        int best = 0;
+
+        for (int phase = 0; phase < mult; phase++) {
+            uint32_t off = 0;
+
+            for (int k = phase; k < ARRAY_SIZE(used); k += mult) {
+                off = MAX(off, used[k]);
+            }
+            if (off < best_off) {
+                best = phase;
+                best_off = off;
+            }
+        }
+
+        r->interval_us = base_us * mult;
+        r->event_us = sim_event_us(u, r->interval_us);
+        r->demand_us = r->event_us;
+        r->anchor_us = start_us + best * base_us + best_off;
+        for (int k = best; k < ARRAY_SIZE(used); k += mult) {
+            used[k] = best_off + r->event_us;
+        }
+    }
+}
+#else
+/* What links get from BT_LE_CONN_PARAM_DEFAULT and an unconstrained phone:
+ * a 30-50 ms interval and an anchor wherever the controller put them
+ */
+static void sim_radio_setup(int64_t start_us)
+{
+    for (int u = 0; u <= SIM_PHONE; u++) {
+        struct sim_radio *r = &sim_radio[u];
+
+        r->interval_us = (24 + rand() % 17) * 1250;
+        r->anchor_us = start_us + rand() % r->interval_us;
+        r->event_us = SIM_EVENT_DEFAULT_US;
+        r->demand_us = MIN(sim_event_us(u, r->interval_us), r->event_us);
+    }
+}
+#endif
+
+/* Connection event of radio user u at t. The one radio serves one link
+ * at a time: an event due while another is still running is skipped.
+ */
+static void sim_radio_event(int u, int64_t t)
+{
+    struct sim_radio *r = &sim_radio[u];
+    uint32_t busy = sim_pdu_us(0);
+
+    r->anchor_us += r->interval_us;
+    if (u != SIM_PHONE && sim_peers[u].silent_until) {
+        return;
+    }
+
+    radio.events++;
+    if (t < radio_busy_until) {
+        radio.skipped++;
+        return;
+    }
+
+    if (u == SIM_PHONE) {
+        busy = r->demand_us;
+    } else {
+        struct sim_peer *p = &sim_peers[u];
+        uint32_t pdu = sim_pdu_us(SIM_SAMPLE_LEN + 4 + 3);
+
+        while (p->pending_count && p->pending[p->pending_head] <= t &&
+               busy + pdu <= r->event_us) {
+            int64_t gen_us = p->pending[p->pending_head];
+            uint32_t lat = t + busy - gen_us;
+
+            p->pending_head = (p->pending_head + 1) % SIM_PENDING;
+            p->pending_count--;
+            radio.lat_n++;
+            radio.lat_sum += lat;
+            radio.lat_sq += (uint64_t)lat * lat;
+            sim_peer_sample(u, p, gen_us);
+            busy += pdu;
+        }
+    }
+    radio_busy_until = t + busy;
+}
+
+/* Radio user with the earliest connection event */
+static int sim_radio_next(void)
+{
+    int next = 0;
+
+    for (int u = 1; u <= SIM_PHONE; u++) {
+        if (sim_radio[u].anchor_us < sim_radio[next].anchor_us) {
+            next = u;
+        }
+    }
+    return next;
+}
+
+/* Take peers down one at a time, round robin */
+static void sim_link_loss(int64_t now)
+{
+    static int next_peer;
+    struct sim_peer *p = &sim_peers[next_peer];
+
+    if (!p->silent_until) {
+        printk("SIM: device %d link lost\n", next_peer);
+        p->silent_until = now + MAX(CONFIG_BHI_SIM_RECONNECT_MS, 1);
+        p->lost_time = now;
+        p->losses++;
+        p->pending_count = 0;
+    }
+    next_peer = (next_peer + 1) % PEER_COUNT;
+}
+
+static void sim_peers_run(void *arg1, void *arg2, void *arg3)
+{
+    const int64_t period_us = USEC_PER_SEC / CONFIG_BHI_SIM_RATE_HZ;
+    int64_t next_loss = k_uptime_get() + CONFIG_BHI_SIM_LINK_LOSS_MS;
+    int64_t start_us = sim_now_us();
+
+    for (int i = 0; i < PEER_COUNT; i++) {
+        // Sensors run off their own clocks, out of phase with the events
+        sim_peers[i].next_due_us = start_us + rand() % period_us;
+        sim_peers[i].up_time = k_uptime_get();
+        sim_peers[i].waiting = true;
+    }
+    sim_radio_setup(start_us);
+
+    while (1) {
+        int64_t now = k_uptime_get();
+        int64_t now_us = sim_now_us();
+        int64_t wake_us = now_us + period_us;
+
+        if (CONFIG_BHI_SIM_LINK_LOSS_MS && now >= next_loss) {
+            sim_link_loss(now);
+            next_loss += CONFIG_BHI_SIM_LINK_LOSS_MS;
+        }
+
+        for (int i = 0; i < PEER_COUNT; i++) {
+            struct sim_peer *p = &sim_peers[i];
+
+            if (p->silent_until) {
+                if (now < p->silent_until) {
+                    continue;
+                }
+                p->silent_until = 0;
+                p->up_time = now;
+                p->waiting = true;
+                p->next_due_us = now_us;
+            }
+
+            // Catch up without bursting if the thread was starved
+            if (now_us - p->next_due_us > period_us) {
+                p->next_due_us = now_us;
+            }
+            if (now_us >= p->next_due_us) {
+                sim_peer_queue(p, p->next_due_us);
+                p->next_due_us += period_us;
+            }
+            wake_us = MIN(wake_us, p->next_due_us);
+        }
+
+        // Connection events that came due, in order
+        while (1) {
+            int u = sim_radio_next();
+
+            if (sim_radio[u].anchor_us > now_us) {
+                wake_us = MIN(wake_us, sim_radio[u].anchor_us);
+                break;
+            }
+            sim_radio_event(u, sim_radio[u].anchor_us);
+        }
+
+        if (wake_us > now_us) {
+            k_usleep(wake_us - now_us);
+        } else {
+            k_yield();
+        }
+    }
+}
+
+static void sim_delivered(int dev)
+{
+    struct sim_peer *p;
+
+    phone_samples++;
+    if (dev < 0 || dev >= PEER_COUNT) {
+        return;
+    }
+
+    p = &sim_peers[dev];
+    if (!p->waiting) {
+        return;
+    }
+    p->waiting = false;
+
+    int64_t now = k_uptime_get();
+    if (!p->streamed) {
+        p->streamed = true;
+        p->stream_ms = now - p->up_time;
+        printk("SIM: device %d streaming after %u ms\n", dev, p->stream_ms);
+    } else {
+        p->reconnect_ms = now - p->lost_time;
+        printk("SIM: device %d back %u ms after link loss\n", dev, p->reconnect_ms);
+    }
+}
+
+/* Air time of len bytes of L2CAP payload sent as pdus link layer PDUs */
+static void sim_air_time(uint32_t len, uint32_t pdus)
+{
+    uint32_t us = pdus * CONFIG_BHI_SIM_PHONE_PDU_US;
+
+    if (CONFIG_BHI_SIM_PHONE_KBPS) {
+        us += len * 8 * 1000 / CONFIG_BHI_SIM_PHONE_KBPS;
+    }
+    if (us) {
+        k_usleep(us);
+    }
+}
+
+/* Phone side parsing of one frame */
+static int sim_phone_frame(const uint8_t *buf, uint16_t len)
+{
+    phone_bytes += len;
+
+    if (IS_ENABLED(CONFIG_BHI_AGG_FORMAT_HEX)) {
+        // "Device N: xx xx ..."
+        sim_delivered(strtol((const char *)buf + sizeof("Device ") - 1, NULL, 10));
+    } else {
+        const struct agg_frame_hdr *hdr = (const void *)buf;
+        uint16_t off = sizeof(*hdr);
+
+        if (len < sizeof(*hdr) || hdr->version != AGG_FRAME_VERSION) {
+            printk("SIM: phone got a malformed frame (%u bytes)\n", len);
+            return -EINVAL;
+        }
+        for (int i = 0; i < hdr->count; i++) {
+            const struct agg_rec_hdr *rec = (const void *)&buf[off];
+
+            if (off + sizeof(*rec) > len || off + sizeof(*rec) + rec->len > len) {
+                printk("SIM: phone got a truncated frame\n");
+                return -EINVAL;
+            }
+            sim_delivered(rec->dev & ~AGG_REC_DELTA);
+            off += sizeof(*rec) + rec->len;
+        }
+    }
+    return 0;
+}
+
+int sim_phone_send(const void *data, uint16_t len, uint32_t rx_cyc)
+{
+    int err = sim_phone_frame(data, len);
+
+    if (err) {
+        return err;
+    }
+
+    // One PDU: L2CAP header, ATT opcode and handle, the frame
+    sim_air_time(4 + 3 + len, 1);
+    metrics_tx_done(rx_cyc);
+    return 0;
+}
+
+#if defined(CONFIG_BHI_L2CAP)
+int sim_phone_send_sdu(const void *data, uint16_t len, uint32_t rx_cyc)
+{
+    const uint8_t *buf = data;
+    uint16_t off = 0;
+
+    while (off + 2 <= len) {
+        uint16_t frame_len = sys_get_le16(&buf[off]);
+
+        if (off + 2 + frame_len > len) {
+            printk("SIM: phone got a truncated SDU\n");
+            return -EINVAL;
+        }
+        (void)sim_phone_frame(&buf[off + 2], frame_len);
+        off += 2 + frame_len;
+    }
+
+    // SDU length field, then one K-frame with an L2CAP header per MPS
+    uint32_t pdus = DIV_ROUND_UP(2 + len, CONFIG_BHI_SIM_PHONE_MTU);
+    sim_air_time(2 + len + 4 * pdus, pdus);
+    metrics_tx_done(rx_cyc);
+    return 0;
+}
+#endif
+
+static uint32_t sim_isqrt(uint64_t v)
+{
+    uint64_t root = 0;
+
+    for (uint64_t bit = 1ULL << 62; bit; bit >>= 2) {
+        if (v >= root + bit) {
+            v -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+    }
+    return root;
+}
+
+static void sim_report_radio(void)
+{
+    uint32_t events = radio.events - report_radio.events;
+    uint32_t skip_bp = events ? (uint64_t)(radio.skipped - report_radio.skipped) * 10000 / events : 0;
+    uint32_t n = radio.lat_n - report_radio.lat_n;
+    uint64_t mean = n ? (radio.lat_sum - report_radio.lat_sum) / n : 0;
+    uint64_t sq = n ? (radio.lat_sq - report_radio.lat_sq) / n : 0;
+    char mode[32] = "default intervals";
+
+    if (sim_booked_pct >= 0) {
+        snprintk(mode, sizeof(mode), "scheduled, %d%% booked", sim_booked_pct);
+    }
+    printk("SIM   radio: %s, %u.%02u%% events skipped, sensor->hub %u us mean, "
+           "%u us jitter, %u overflowed\n", mode, skip_bp / 100, skip_bp % 100,
+           (uint32_t)mean, sim_isqrt(sq > mean * mean ? sq - mean * mean : 0),
+           radio.overflow - report_radio.overflow);
+    report_radio = radio;
+}
+
+static void sim_report_handler(struct k_work *work)
+{
+    int64_t now = k_uptime_get();
+    uint32_t elapsed = MAX(now - report_time, 1);
+    uint32_t generated = 0;
+    uint32_t drops = 0;
+
+    for (int i = 0; i < PEER_COUNT; i++) {
+        struct metrics_link m;
+
+        metrics_link_get(i, &m);
+        generated += sim_peers[i].generated;
+        drops += m.drops;
+    }
+    uint32_t drop_bp = generated ? (uint64_t)drops * 10000 / generated : 0;
+
+    printk("SIM %u s: %u B/s, %u samples/s to phone, drops %u.%02u%%, "
+           "rx->phone p50 %u us p99 %u us\n",
+           (uint32_t)((now - sim_start_time) / MSEC_PER_SEC),
+           (uint32_t)((uint64_t)(phone_bytes - report_bytes) * MSEC_PER_SEC / elapsed),
+           (uint32_t)((uint64_t)(phone_samples - report_samples) * MSEC_PER_SEC / elapsed),
+           drop_bp / 100, drop_bp % 100,
+           metrics_percentile(METRICS_HIST_E2E, 50), metrics_percentile(METRICS_HIST_E2E, 99));
+    sim_report_radio();
+
+    if (IS_ENABLED(CONFIG_BHI_DECODE)) {
+        struct bhi_decode_stats dec;
+
+        bhi_decode_stats_get(&dec);
+        printk("SIM   decode: %u ns/frame avg, %u ns max, %u events, %u rejected\n",
+               dec.frames ? (uint32_t)k_cyc_to_ns_floor64(dec.cycles / dec.frames) : 0,
+               (uint32_t)k_cyc_to_ns_floor64(dec.cycles_max), dec.events, dec.errors);
+    }
+
+    if (IS_ENABLED(CONFIG_BHI_AGG_DELTA)) {
+        struct pipeline_stats pipe;
+
+        pipeline_stats_get(&pipe);
+        uint32_t ratio = pipe.coded_bytes ? (uint64_t)pipe.raw_bytes * 100 / pipe.coded_bytes : 0;
+        printk("SIM   delta: ratio %u.%02u, %u keyframes\n", ratio / 100, ratio % 100,
+               pipe.keyframes);
+    }
+
+    for (int i = 0; i < PEER_COUNT; i++) {
+        const struct sim_peer *p = &sim_peers[i];
+
+        printk("SIM   device %d: streaming after %u ms, last reconnect %u ms, %u losses\n",
+               i, p->stream_ms, p->reconnect_ms, p->losses);
+    }
+
+    report_bytes = phone_bytes;
+    report_samples = phone_samples;
+    report_time = now;
+    k_work_reschedule(&sim_report_work, K_MSEC(CONFIG_BHI_SIM_REPORT_MS));
+}
+
+void sim_start(sim_ingest_fn ingest)
+{
+    sim_ingest = ingest;
+    sim_start_time = k_uptime_get();
+    report_time = sim_start_time;
+
+    printk("SIM: %d peers, %u byte samples at %u Hz, phone at %u kbps over %s\n", PEER_COUNT,
+           CONFIG_BHI_SIM_PAYLOAD_LEN, CONFIG_BHI_SIM_RATE_HZ, CONFIG_BHI_SIM_PHONE_KBPS,
+           IS_ENABLED(CONFIG_BHI_SIM_PHONE_L2CAP) ? "L2CAP" : "notifications");
+
+    k_thread_create(&sim_peers_thread, sim_peers_stack, SIM_PEERS_STACK_SIZE,
+                    sim_peers_run, NULL, NULL, NULL, SIM_PEERS_PRIORITY, 0, K_NO_WAIT);
+    k_thread_name_set(&sim_peers_thread, "sim_peers");
+    k_work_reschedule(&sim_report_work, K_MSEC(CONFIG_BHI_SIM_REPORT_MS));
+}
@@ -0,0 +1,36 @@
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <zephyr/kernel.h>
+
+/* Host simulation (CONFIG_BHI_SIM), meant for native_sim: synthetic
+ * sensors and a synthetic phone replace the radio so the aggregation
+ * path can be benchmarked without hardware.
+ *
+ * Each peer in the devicetree table produces CONFIG_BHI_SIM_PAYLOAD_LEN
+ * byte samples at CONFIG_BHI_SIM_RATE_HZ from a thread at BT RX priority.
+ * Peers periodically go silent to exercise link loss. The phone drains
+ * notifications, or L2CAP SDUs with CONFIG_BHI_SIM_PHONE_L2CAP, at
+ * CONFIG_BHI_SIM_PHONE_KBPS plus CONFIG_BHI_SIM_PHONE_PDU_US per link
+ * layer packet, and parses every frame it receives. A benchmark line is printed every CONFIG_BHI_SIM_REPORT_MS.
+ *
+ * Samples reach the hub at their peer's connection events, on one
+ * modeled radio shared with the phone's events; an event due while
+ * another runs is skipped. With CONFIG_BHI_SIM_CONN_SCHED the links get
+ * the connection event schedule, otherwise default intervals. The
+ * radio line reports skipped events and the sensor to hub latency and
+ * its jitter for either.
+ */
+
+/* Receives every simulated sample, like the GATT notify callback */
+typedef void (*sim_ingest_fn)(int idx, const void *data, uint16_t len, uint32_t rx_cyc);
+
+void sim_start(sim_ingest_fn ingest);
+
+/* Simulated phone: takes the place of phone_tx_send() */
+int sim_phone_send(const void *data, uint16_t len, uint32_t rx_cyc);
+
+/* ... and of phone_l2cap_send() with CONFIG_BHI_SIM_PHONE_L2CAP */
+int sim_phone_send_sdu(const void *data, uint16_t len, uint32_t rx_cyc);
+
+#endif /* SIM_H_ */
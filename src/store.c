@@ -0,0 +1,531 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/fs/fcb.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/shell/shell.h>
+
+#include "agg_frame.h"
+#include "pipeline.h"
+#include "store.h"
+#include "subs.h"
+
+#define STORE_AREA FIXED_PARTITION_ID(bhi_log_partition)
+#define STORE_MAGIC 0x42484931  // "BHI1"
+#define STORE_VERSION 1
+
+/* A batch is one FCB entry:
+ *   le32 first_seq, u8 count, u8 reserved, then per frame u8 len + frame,
+ *   zero padded to the flash write alignment. A zero len ends the batch.
+ */
+#define BATCH_HDR_LEN 6
+#define BATCH_LEN CONFIG_BHI_STORE_BATCH
+
+BUILD_ASSERT(BATCH_LEN % 4 == 0, "Batches are padded to the flash write alignment");
+
+static struct fcb log_fcb;
+static struct flash_sector log_sectors[CONFIG_BHI_STORE_MAX_SECTORS];
+static uint32_t log_align;      // Flash write alignment, divides BATCH_LEN
+static bool ready;
+
+/* Log framer and the two batch buffers, shared by the aggregate stage
+ * (filling) and the store thread (flushing, writing)
+ */
+static K_MUTEX_DEFINE(store_lock);
+static struct agg_framer log_framer;
+static uint8_t batches[2][BATCH_LEN];
+static uint16_t batch_len[2];
+static uint8_t fill;             // Batch being filled
+static int pending = -1;         // Batch waiting for the flash write, -1 if none
+
+static K_SEM_DEFINE(store_sem, 0, 1);
+static atomic_t replay_req = ATOMIC_INIT(STORE_REPLAY_STOP);
+static atomic_t replay_req_pending;
+
+/* Store thread only */
+static struct fcb_entry replay_loc;
+static uint8_t replay_buf[BATCH_LEN];
+static struct agg_framer replay_framer;
+static uint32_t replay_frame_seq;
+
+/* Updated by the aggregate stage and the store thread, read by the shell
+ * and GATT. The store thread reads the fields only it writes unlocked.
+ */
+static struct k_spinlock stats_lock;
+static struct store_stats stats = {
+    .replay_seq = STORE_REPLAY_STOP,
+};
+
+K_THREAD_STACK_DEFINE(store_stack, CONFIG_BHI_STORE_STACK_SIZE);
+static struct k_thread store_thread;
+
+static void batch_submit(void)
+{
+    if (batch_len[fill] == 0) {
+        return;
+    }
+    if (pending >= 0) {
+        // Flash is still busy with the previous batch: this one is lost
+        k_spinlock_key_t key = k_spin_lock(&stats_lock);
+        stats.lost += batches[fill][4];
+        k_spin_unlock(&stats_lock, key);
+        batch_len[fill] = 0;
+        return;
+    }
+    pending = fill;
+    fill ^= 1;
+    batch_len[fill] = 0;
+    k_sem_give(&store_sem);
+}
+
+/* Move the log framer's frame into the batch being filled */
+static void frame_to_batch(void)
+{
+    uint16_t len = agg_framer_finish(&log_framer);
+    uint8_t *b;
+
+    if (len == 0) {
+        return;
+    }
+    // Room for the padding too, so the write never runs past the buffer
+    if (ROUND_UP(batch_len[fill] + 1 + len, log_align) > BATCH_LEN) {
+        batch_submit();
+    }
+
+    b = batches[fill];
+    k_spinlock_key_t key = k_spin_lock(&stats_lock);
+    if (batch_len[fill] == 0) {
+        sys_put_le32(stats.next_seq, b);
+        b[4] = 0;
+        b[5] = 0;
+        batch_len[fill] = BATCH_HDR_LEN;
+    }
+    b[batch_len[fill]++] = len;
+    memcpy(&b[batch_len[fill]], log_framer.buf, len);
+    batch_len[fill] += len;
+    b[4]++;
+
+    stats.next_seq++;
+    stats.frames++;
+    stats.frame_bytes += len;
+    k_spin_unlock(&stats_lock, key);
+    agg_framer_reset(&log_framer, AGG_FRAME_MAX_LEN);
+}
+
+static int log_frame_flush(struct agg_framer *f)
+{
+    frame_to_batch();
+    return 0;
+}
+
+/* Add a record, split into pieces that each fit an empty frame of f->cap.
+ * flush sends the full frame of f and starts an empty one.
+ */
+static int framer_add_split(struct agg_framer *f, int (*flush)(struct agg_framer *f),
+                            uint8_t dev, uint16_t seq, uint32_t ts, const uint8_t *data,
+                            uint8_t len)
+{
+    int piece_max = f->cap - sizeof(struct agg_frame_hdr) - sizeof(struct agg_rec_hdr);
+
+    if (piece_max <= 0) {
+        return -EMSGSIZE;
+    }
+    do {
+        uint8_t n = MIN(len, piece_max);
+        uint8_t piece_dev = n < len ? dev | AGG_REC_MORE : dev;
+        int err = agg_framer_add(f, piece_dev, seq, ts, data, n);
+
+        if (err == -ENOSPC) {
+            err = flush(f);
+            if (!err) {
+                err = agg_framer_add(f, piece_dev, seq, ts, data, n);
+            }
+        }
+        if (err) {
+            return err;
+        }
+        data += n;
+        len -= n;
+    } while (len);
+
+    return 0;
+}
+
+int store_item(const struct agg_data_item *item)
+{
+    int err;
+
+    if (!ready) {
+        return -ENODEV;
+    }
+
+    // Raw notifications run up to AGG_FRAME_MAX_LEN, past one record
+    k_mutex_lock(&store_lock, K_FOREVER);
+    err = framer_add_split(&log_framer, log_frame_flush, item->dev, item->seq,
+                           item->timestamp, item->data, item->len);
+    k_mutex_unlock(&store_lock);
+
+    return err;
+}
+
+static void store_flush(void)
+{
+    k_mutex_lock(&store_lock, K_FOREVER);
+    frame_to_batch();
+    batch_submit();
+    k_mutex_unlock(&store_lock);
+}
+
+static uint32_t entry_first_seq(const struct fcb_entry *loc)
+{
+    uint8_t hdr[BATCH_HDR_LEN];
+
+    if (flash_area_read(log_fcb.fap, FCB_ENTRY_FA_DATA_OFF(*loc), hdr, sizeof(hdr))) {
+        return 0;
+    }
+    return sys_get_le32(hdr);
+}
+
+static void oldest_update(void)
+{
+    struct fcb_entry loc = { 0 };
+    bool empty = fcb_getnext(&log_fcb, &loc);
+    uint32_t first = empty ? 0 : entry_first_seq(&loc);
+
+    k_spinlock_key_t key = k_spin_lock(&stats_lock);
+    stats.first_seq = empty ? stats.next_seq : first;
+    k_spin_unlock(&stats_lock, key);
+}
+
+/* One flash write per batch; erases the oldest sector when full */
+static void store_write_pending(void)
+{
+    struct fcb_entry loc;
+    uint16_t len;
+    uint8_t *b;
+    int err;
+
+    k_mutex_lock(&store_lock, K_FOREVER);
+    int idx = pending;
+    k_mutex_unlock(&store_lock);
+
+    if (idx < 0) {
+        return;
+    }
+    b = batches[idx];
+    len = ROUND_UP(batch_len[idx], log_align);
+    memset(&b[batch_len[idx]], 0, len - batch_len[idx]);
+
+    err = fcb_append(&log_fcb, len, &loc);
+    if (err == -ENOSPC) {
+        err = fcb_rotate(&log_fcb);
+        k_spinlock_key_t key = k_spin_lock(&stats_lock);
+        stats.erases++;
+        k_spin_unlock(&stats_lock, key);
+        oldest_update();
+        // The replay cursor may have pointed into the erased sector
+        replay_loc = (struct fcb_entry){ 0 };
+        if (!err) {
+            err = fcb_append(&log_fcb, len, &loc);
+        }
+    }
+    if (!err) {
+        err = flash_area_write(log_fcb.fap, FCB_ENTRY_FA_DATA_OFF(loc), b, len);
+    }
+    if (!err) {
+        err = fcb_append_finish(&log_fcb, &loc);
+    }
+    k_spinlock_key_t key = k_spin_lock(&stats_lock);
+    if (err) {
+        stats.lost += b[4];
+    } else {
+        stats.flash_writes++;
+        stats.flash_bytes += len;
+    }
+    k_spin_unlock(&stats_lock, key);
+    if (err) {
+        printk("Store: writing %u frames failed (err %d)\n", b[4], err);
+    }
+
+    k_mutex_lock(&store_lock, K_FOREVER);
+    batch_len[idx] = 0;
+    pending = -1;
+    k_mutex_unlock(&store_lock);
+}
+
+static void replay_seq_set(uint32_t seq, uint32_t replayed)
+{
+    k_spinlock_key_t key = k_spin_lock(&stats_lock);
+    stats.replay_seq = seq;
+    stats.replayed += replayed;
+    k_spin_unlock(&stats_lock, key);
+}
+
+static void replay_stop(const char *why)
+{
+    if (stats.replay_seq != STORE_REPLAY_STOP) {
+        printk("Store: replay %s at %u, %u frames sent\n", why, stats.replay_seq,
+               stats.replayed);
+    }
+    replay_seq_set(STORE_REPLAY_STOP, 0);
+}
+
+static int replay_frame_flush(struct agg_framer *f)
+{
+    int err;
+
+    f->seq = replay_frame_seq;
+    err = pipeline_send_frame(f->buf, agg_framer_finish(f));
+    agg_framer_reset(f, f->cap);
+    return err;
+}
+
+/* Send a logged frame, split to the phone's frame size: the log is
+ * framed for the largest MTU. Every piece carries the frame's log
+ * sequence number. Records larger than a phone frame are split too.
+ */
+static int replay_send(uint8_t *frame, uint8_t len, uint32_t seq)
+{
+    struct agg_frame_hdr *hdr = (struct agg_frame_hdr *)frame;
+    uint16_t cap = subs_frame_cap();
+
+    hdr->flags |= AGG_FRAME_FLAG_REPLAY;
+    hdr->frame_seq = sys_cpu_to_le16((uint16_t)seq);
+    if (len <= cap) {
+        return pipeline_send_frame(frame, len);
+    }
+
+    uint32_t base_ts = sys_le32_to_cpu(hdr->base_ts);
+    uint16_t off = sizeof(*hdr);
+
+    replay_framer.flags = hdr->flags;
+    replay_frame_seq = seq;
+    agg_framer_reset(&replay_framer, cap);
+    for (uint8_t i = 0; i < hdr->count && off + sizeof(struct agg_rec_hdr) <= len; i++) {
+        const struct agg_rec_hdr *rec = (const struct agg_rec_hdr *)&frame[off];
+        const uint8_t *data = &frame[off + sizeof(*rec)];
+        uint32_t ts = base_ts + sys_le16_to_cpu(rec->ts_off);
+        uint16_t rec_seq = sys_le16_to_cpu(rec->seq);
+
+        off += sizeof(*rec) + rec->len;
+        if (off > len) {
+            break;
+        }
+
+        int err = framer_add_split(&replay_framer, replay_frame_flush, rec->dev, rec_seq, ts,
+                                   data, rec->len);
+        if (err) {
+            return err;
+        }
+    }
+    if (agg_framer_empty(&replay_framer)) {
+        return 0;
+    }
+    return replay_frame_flush(&replay_framer);
+}
+
+/* Send the frames of the next log entry that are due */
+static void replay_step(void)
+{
+    if (fcb_getnext(&log_fcb, &replay_loc)) {
+        replay_stop("done");
+        return;
+    }
+
+    uint16_t len = MIN(replay_loc.fe_data_len, sizeof(replay_buf));
+    if (flash_area_read(log_fcb.fap, FCB_ENTRY_FA_DATA_OFF(replay_loc), replay_buf, len)) {
+        replay_stop("read error");
+        return;
+    }
+
+    uint32_t seq = sys_get_le32(replay_buf);
+    uint8_t count = replay_buf[4];
+    if (seq + count <= stats.replay_seq) {
+        return;
+    }
+
+    for (uint16_t off = BATCH_HDR_LEN; off < len && replay_buf[off]; seq++) {
+        uint8_t frame_len = replay_buf[off];
+        uint8_t *frame = &replay_buf[off + 1];
+
+        off += 1 + frame_len;
+        if (seq < stats.replay_seq || off > len) {
+            continue;
+        }
+        if (replay_send(frame, frame_len, seq)) {
+            replay_stop("phone gone");
+            return;
+        }
+        replay_seq_set(seq + 1, 1);
+    }
+}
+
+static void replay_start(uint32_t seq)
+{
+    // Everything logged so far must be in flash before the walk starts
+    store_flush();
+    store_write_pending();
+
+    k_spinlock_key_t key = k_spin_lock(&stats_lock);
+    uint32_t next_seq = stats.next_seq;
+    k_spin_unlock(&stats_lock, key);
+
+    replay_seq_set(MAX(seq, stats.first_seq), 0);
+    replay_loc = (struct fcb_entry){ 0 };
+    printk("Store: replay from %u, log holds %u..%u\n", stats.replay_seq, stats.first_seq,
+           next_seq);
+}
+
+static void store_run(void *arg1, void *arg2, void *arg3)
+{
+    int64_t flush_at = k_uptime_get() + CONFIG_BHI_STORE_FLUSH_MS;
+
+    while (1) {
+        int64_t now = k_uptime_get();
+
+        if (now >= flush_at) {
+            store_flush();
+            flush_at = now + CONFIG_BHI_STORE_FLUSH_MS;
+        }
+
+        bool replaying = stats.replay_seq != STORE_REPLAY_STOP;
+        k_sem_take(&store_sem, replaying ? K_NO_WAIT : K_MSEC(flush_at - now));
+
+        store_write_pending();
+
+        if (atomic_cas(&replay_req_pending, 1, 0)) {
+            uint32_t seq = atomic_get(&replay_req);
+
+            if (seq == STORE_REPLAY_STOP) {
+                replay_stop("stopped");
+            } else {
+                replay_start(seq);
+            }
+        }
+
+        if (stats.replay_seq != STORE_REPLAY_STOP) {
+            replay_step();
+        }
+    }
+}
+
+int store_replay(uint32_t seq)
+{
+    if (!ready) {
+        return -ENODEV;
+    }
+    atomic_set(&replay_req, seq);
+    atomic_set(&replay_req_pending, 1);
+    k_sem_give(&store_sem);
+    return 0;
+}
+
+void store_stats_get(struct store_stats *out)
+{
+    k_spinlock_key_t key = k_spin_lock(&stats_lock);
+    *out = stats;
+    k_spin_unlock(&stats_lock, key);
+}
+
+int store_init(void)
+{
+    uint32_t cnt = ARRAY_SIZE(log_sectors);
+    struct fcb_entry loc = { 0 };
+    int err;
+
+    err = flash_area_get_sectors(STORE_AREA, &cnt, log_sectors);
+    if (err) {
+        printk("Store: no log partition (err %d)\n", err);
+        return err;
+    }
+
+    log_fcb.f_magic = STORE_MAGIC;
+    log_fcb.f_version = STORE_VERSION;
+    log_fcb.f_sector_cnt = cnt;
+    log_fcb.f_scratch_cnt = 0;
+    log_fcb.f_sectors = log_sectors;
+    err = fcb_init(STORE_AREA, &log_fcb);
+    if (err) {
+        printk("Store: log init failed (err %d)\n", err);
+        return err;
+    }
+
+    log_align = flash_area_align(log_fcb.fap);
+    if (log_align == 0 || BATCH_LEN % log_align) {
+        printk("Store: batch size %u is not a multiple of the flash write size %u\n",
+               BATCH_LEN, log_align);
+        return -EINVAL;
+    }
+
+    // Sequence numbers carry on from the newest batch in flash
+    while (fcb_getnext(&log_fcb, &loc) == 0) {
+        uint8_t hdr[BATCH_HDR_LEN];
+
+        if (flash_area_read(log_fcb.fap, FCB_ENTRY_FA_DATA_OFF(loc), hdr, sizeof(hdr)) == 0) {
+            stats.next_seq = sys_get_le32(hdr) + hdr[4];
+        }
+    }
+    oldest_update();
+
+    agg_framer_init(&log_framer);
+    agg_framer_init(&replay_framer);
+    ready = true;
+
+    printk("Store: %u sectors, frames %u..%u in flash\n", cnt, stats.first_seq,
+           stats.next_seq);
+
+    k_thread_create(&store_thread, store_stack, K_THREAD_STACK_SIZEOF(store_stack),
+                    store_run, NULL, NULL, NULL, CONFIG_BHI_STORE_PRIORITY, 0, K_NO_WAIT);
+    k_thread_name_set(&store_thread, "store");
+    return 0;
+}
+
+#if defined(CONFIG_SHELL)
+static int cmd_store(const struct shell *sh, size_t argc, char **argv)
+{
+    struct store_stats s;
+
+    store_stats_get(&s);
+    shell_print(sh, "log %u..%u, replay %s%u", s.first_seq, s.next_seq,
+                s.replay_seq == STORE_REPLAY_STOP ? "idle " : "at ",
+                s.replay_seq == STORE_REPLAY_STOP ? s.replayed : s.replay_seq);
+    shell_print(sh, "frames %u (%u B), flash writes %u (%u B), erases %u, lost %u",
+                s.frames, s.frame_bytes, s.flash_writes, s.flash_bytes, s.erases, s.lost);
+    if (s.frame_bytes) {
+        uint32_t amp = (uint64_t)s.flash_bytes * 100 / s.frame_bytes;
+
+        shell_print(sh, "write amplification %u.%02u", amp / 100, amp % 100);
+    }
+    return 0;
+}
+
+static int cmd_store_replay(const struct shell *sh, size_t argc, char **argv)
+{
+    uint32_t seq = argc > 1 ? strtoul(argv[1], NULL, 0) : 0;
+    int err = store_replay(seq);
+
+    if (err) {
+        shell_error(sh, "Replay failed (err %d)", err);
+    }
+    return err;
+}
+
+static int cmd_store_stop(const struct shell *sh, size_t argc, char **argv)
+{
+    return store_replay(STORE_REPLAY_STOP);
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(bhi_store_cmds,
+    SHELL_CMD_ARG(replay, NULL, "Replay the log to the phone [from seq]", cmd_store_replay, 1, 1),
+    SHELL_CMD(stop, NULL, "Stop a replay", cmd_store_stop),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_SUBCMD_ADD((bhi), store, &bhi_store_cmds, "Store and forward log", cmd_store, 1, 0);
+#endif
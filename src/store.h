@@ -0,0 +1,62 @@
+#ifndef STORE_H_
+#define STORE_H_
+
+#include <zephyr/types.h>
+
+#include "agg_pool.h"
+
+/* Store and forward: samples the phone cannot take (not connected, or
+ * behind and refused by the backpressure policy) are framed like the
+ * live stream and appended to a circular log in the bhi_log_partition
+ * flash partition instead of being dropped.
+ *
+ * Every logged frame gets a log sequence number, monotonic across
+ * reboots. Frames are collected into CONFIG_BHI_STORE_BATCH sized
+ * batches in RAM and each batch is written with a single flash write;
+ * when the partition is full the oldest sector is erased. A batch still
+ * in RAM is written after CONFIG_BHI_STORE_FLUSH_MS or before a replay.
+ *
+ * The log holds the notifications exactly as the sensors sent them:
+ * records are never decoded, reduced or delta coded. On replay a frame
+ * goes out as an aggregate notification with AGG_FRAME_FLAG_REPLAY set
+ * and frame_seq holding the low 16 bits of its log sequence number.
+ * Frames are logged at the largest frame size and split on replay when
+ * a phone takes smaller ones; the pieces share the frame_seq. Records
+ * that do not fit are split with AGG_REC_MORE, see agg_frame.h.
+ * Replay runs in its own thread at the rate the TX stage takes frames,
+ * interleaved with the live stream.
+ */
+#define STORE_REPLAY_STOP UINT32_MAX
+
+struct store_stats {
+    uint32_t first_seq;     // Oldest frame still in flash
+    uint32_t next_seq;      // Sequence number of the next logged frame
+    uint32_t replay_seq;    // Next frame to replay, STORE_REPLAY_STOP if idle
+    uint32_t frames;        // Frames logged since boot
+    uint32_t frame_bytes;
+    uint32_t flash_writes;
+    uint32_t flash_bytes;   // Written to flash, padding and batch headers included
+    uint32_t erases;        // Sectors erased to make room
+    uint32_t lost;          // Frames lost because flash could not keep up
+    uint32_t replayed;
+};
+
+/* Replay characteristic value, little endian: u32 first_seq, next_seq,
+ * replay_seq. A write of a u32 starts a replay from that sequence
+ * number, STORE_REPLAY_STOP ends it.
+ */
+#define STORE_REPLAY_VALUE_LEN 12
+
+int store_init(void);
+
+/* Log a sample from the aggregate stage; item stays owned by the caller.
+ * Returns -ENODEV when there is no usable log partition.
+ */
+int store_item(const struct agg_data_item *item);
+
+/* Replay every logged frame from seq on, or stop with STORE_REPLAY_STOP */
+int store_replay(uint32_t seq);
+
+void store_stats_get(struct store_stats *stats);
+
+#endif /* STORE_H_ */
@@ -0,0 +1,620 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/bluetooth/gatt.h>
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+#include "link_params.h"
+#include "metrics.h"
+#include "peers.h"
+#include "phone_l2cap.h"
+#include "phone_tx.h"
+#include "sim.h"
+#include "subs.h"
+
+#define SUBS CONFIG_BHI_SUBS_MAX
+#define QUEUE CONFIG_BHI_SUBS_QUEUE
+
+/* A stalled subscriber holds its queue plus the frame its TX thread is
+ * sending. All but one stalled must still leave a frame to fill.
+ */
+BUILD_ASSERT((SUBS - 1) * (QUEUE + 1) < CONFIG_BHI_PIPE_TX_FRAMES,
+             "Stalled subscribers must leave frames for the others");
+#if !defined(CONFIG_BHI_SIM)
+BUILD_ASSERT(CONFIG_BT_MAX_CONN >= PEER_COUNT + SUBS,
+             "CONFIG_BT_MAX_CONN must cover the sensor links and every subscriber");
+#endif
+
+struct subscriber {
+    struct bt_conn *conn;
+    bool used;
+    bool subscribed;
+    uint8_t decimate;
+    uint16_t max_fps;
+    uint32_t offered;         // Frames published while listening, for decimate
+    uint32_t tokens;          // max_fps budget, in 1/1000 frames
+    int64_t refill;
+
+    /* Frames waiting for this subscriber's TX thread, oldest at head */
+    struct subs_frame *queue[QUEUE];
+    uint8_t head;
+    uint8_t count;
+    uint8_t count_max;
+    struct k_sem ready;
+
+    uint32_t sent;
+    uint32_t bytes;
+    uint32_t dropped;
+    uint32_t skipped;
+    struct k_thread thread;
+};
+
+K_MEM_SLAB_DEFINE_STATIC(frame_slab, ROUND_UP(sizeof(struct subs_frame), 4),
+                         CONFIG_BHI_PIPE_TX_FRAMES, 4);
+
+K_THREAD_STACK_ARRAY_DEFINE(subs_stacks, SUBS, CONFIG_BHI_PIPE_TX_STACK_SIZE);
+
+/* Guards the slot table against the BT, aggregate and TX threads */
+static struct k_spinlock subs_lock;
+static struct subscriber subs[SUBS];
+static atomic_t joined;
+
+#if defined(CONFIG_BHI_L2CAP)
+/* SDU being packed by a TX thread, see src/phone_l2cap.h */
+static uint8_t tx_sdu[CONFIG_BHI_L2CAP_SDU_LEN];
+static K_MUTEX_DEFINE(tx_sdu_lock);
+#endif
+
+/* Frames for conn go over the L2CAP channel rather than as notifications */
+static bool sub_use_l2cap(struct bt_conn *conn)
+{
+#if defined(CONFIG_BHI_SIM)
+    return IS_ENABLED(CONFIG_BHI_SIM_PHONE_L2CAP);
+#elif defined(CONFIG_BHI_L2CAP)
+    return conn && phone_l2cap_conn() == conn;
+#else
+    return false;
+#endif
+}
+
+/* Notification payload is the negotiated ATT MTU minus opcode and handle.
+ * On the L2CAP channel frames are packed into larger SDUs instead, each
+ * after its 2 byte length; the phone may still take small SDUs.
+ */
+static uint16_t sub_cap(struct bt_conn *conn)
+{
+#if defined(CONFIG_BHI_L2CAP)
+    if (sub_use_l2cap(conn)) {
+#if defined(CONFIG_BHI_SIM)
+        return MIN(AGG_FRAME_MAX_LEN, sizeof(tx_sdu) - 2);
+#else
+        return MIN(AGG_FRAME_MAX_LEN, phone_l2cap_mtu() - 2);
+#endif
+    }
+#endif
+#if defined(CONFIG_BHI_SIM)
+    return CONFIG_BHI_SIM_PHONE_MTU - 3;
+#else
+    const struct link_params_info *lp = link_params_get(conn);
+
+    return MIN(lp ? lp->mtu - 3 : bt_gatt_get_mtu(conn) - 3, AGG_FRAME_MAX_LEN);
+#endif
+}
+
+struct subs_frame *subs_frame_alloc(void)
+{
+    struct subs_frame *frame;
+
+    if (k_mem_slab_alloc(&frame_slab, (void **)&frame, K_FOREVER)) {
+        return NULL;
+    }
+    atomic_set(&frame->refs, 1);
+    return frame;
+}
+
+void subs_frame_unref(struct subs_frame *frame)
+{
+    if (atomic_dec(&frame->refs) == 1) {
+        k_mem_slab_free(&frame_slab, frame);
+    }
+}
+
+/* Every Nth frame, then a token bucket of max_fps holding up to a
+ * queue's worth of burst. Called with subs_lock held.
+ */
+static bool sub_admit(struct subscriber *s, int64_t now)
+{
+    if (s->decimate > 1 && s->offered++ % s->decimate) {
+        return false;
+    }
+    if (!s->max_fps) {
+        return true;
+    }
+
+    int64_t elapsed = MIN(now - s->refill, (int64_t)QUEUE * MSEC_PER_SEC);
+
+    s->tokens = MIN(s->tokens + elapsed * s->max_fps, QUEUE * MSEC_PER_SEC);
+    s->refill = now;
+    if (s->tokens < MSEC_PER_SEC) {
+        return false;
+    }
+    s->tokens -= MSEC_PER_SEC;
+    return true;
+}
+
+void subs_publish(struct subs_frame *frame)
+{
+    struct subs_frame *evicted[SUBS];
+    int n_evicted = 0;
+    int64_t now = k_uptime_get();
+    k_spinlock_key_t key = k_spin_lock(&subs_lock);
+
+    for (int i = 0; i < SUBS; i++) {
+        struct subscriber *s = &subs[i];
+
+        if (!s->used || !s->subscribed) {
+            continue;
+        }
+        if (!sub_admit(s, now)) {
+            s->skipped++;
+            continue;
+        }
+
+        atomic_inc(&frame->refs);
+        if (s->count == QUEUE) {
+            // Full: this subscriber loses its oldest frame, nobody waits
+            evicted[n_evicted++] = s->queue[s->head];
+            s->queue[s->head] = frame;
+            s->head = (s->head + 1) % QUEUE;
+            s->dropped++;
+            continue;
+        }
+        s->queue[(s->head + s->count) % QUEUE] = frame;
+        s->count++;
+        s->count_max = MAX(s->count_max, s->count);
+        k_sem_give(&s->ready);
+    }
+    k_spin_unlock(&subs_lock, key);
+
+    for (int i = 0; i < n_evicted; i++) {
+        subs_frame_unref(evicted[i]);
+    }
+    subs_frame_unref(frame);
+}
+
+/* Next frame for s, with a reference on the connection to send it on */
+static struct subs_frame *sub_pop(struct subscriber *s, struct bt_conn **conn)
+{
+    struct subs_frame *frame = NULL;
+    k_spinlock_key_t key = k_spin_lock(&subs_lock);
+
+    if (s->count) {
+        frame = s->queue[s->head];
+        s->head = (s->head + 1) % QUEUE;
+        s->count--;
+        *conn = s->conn ? bt_conn_ref(s->conn) : NULL;
+    }
+    k_spin_unlock(&subs_lock, key);
+    return frame;
+}
+
+/* Drop everything queued for s. Called with subs_lock held; returns the
+ * frames to release once it is dropped.
+ */
+static int sub_flush(struct subscriber *s, struct subs_frame **out)
+{
+    int n = s->count;
+
+    for (int i = 0; i < n; i++) {
+        out[i] = s->queue[(s->head + i) % QUEUE];
+    }
+    s->head = 0;
+    s->count = 0;
+    k_sem_reset(&s->ready);
+    return n;
+}
+
+#if defined(CONFIG_BHI_L2CAP)
+/* Pack the frame and whatever else s has queued into one SDU */
+static int sub_send_sdu(struct subscriber *s, struct bt_conn *conn, struct subs_frame *frame)
+{
+#if defined(CONFIG_BHI_SIM)
+    uint16_t cap = sizeof(tx_sdu);
+#else
+    uint16_t cap = phone_l2cap_mtu();
+#endif
+    uint32_t rx_cyc = frame->rx_cyc;
+    uint16_t len = 0;
+    int err;
+
+    k_mutex_lock(&tx_sdu_lock, K_FOREVER);
+    while (frame) {
+        struct bt_conn *next_conn = NULL;
+
+        sys_put_le16(frame->len, &tx_sdu[len]);
+        memcpy(&tx_sdu[len + 2], frame->buf, frame->len);
+        len += 2 + frame->len;
+        subs_frame_unref(frame);
+
+        if (len + 2 + AGG_FRAME_MAX_LEN > cap || k_sem_take(&s->ready, K_NO_WAIT)) {
+            break;
+        }
+        frame = sub_pop(s, &next_conn);
+        if (next_conn) {
+            bt_conn_unref(next_conn);
+        }
+    }
+
+#if defined(CONFIG_BHI_SIM)
+    err = sim_phone_send_sdu(tx_sdu, len, rx_cyc);
+#else
+    err = phone_l2cap_send(tx_sdu, len, rx_cyc);
+    if (err) {
+        printk("L2CAP SDU of %u bytes lost (err %d)\n", len, err);
+    }
+#endif
+    k_mutex_unlock(&tx_sdu_lock);
+    return err ? err : len;
+}
+#endif
+
+/* Bytes sent, or a negative error */
+static int sub_send(struct subscriber *s, struct bt_conn *conn, struct subs_frame *frame)
+{
+    uint16_t len = frame->len;
+    int err;
+
+#if defined(CONFIG_BHI_L2CAP)
+    if (sub_use_l2cap(conn)) {
+        return sub_send_sdu(s, conn, frame);
+    }
+#endif
+
+    if (frame->len > sub_cap(conn)) {
+        // Built before a subscriber with a smaller MTU joined
+        err = -EMSGSIZE;
+    } else {
+#if defined(CONFIG_BHI_SIM)
+        err = sim_phone_send(frame->buf, frame->len, frame->rx_cyc);
+#else
+        // Errors are counted and logged by phone_tx
+        err = conn ? phone_tx_send(conn, frame->buf, frame->len, frame->rx_cyc) : -ENOTCONN;
+#endif
+    }
+    subs_frame_unref(frame);
+    return err ? err : len;
+}
+
+/* TX thread of one subscriber: one notification or SDU at a time,
+ * waiting for the stack's credits on its own connection only
+ */
+static void sub_tx(void *arg1, void *arg2, void *arg3)
+{
+    struct subscriber *s = arg1;
+
+    while (1) {
+        struct bt_conn *conn = NULL;
+        struct subs_frame *frame;
+
+        k_sem_take(&s->ready, K_FOREVER);
+        frame = sub_pop(s, &conn);
+        if (!frame) {
+            // Flushed by a disconnect after the semaphore was given
+            continue;
+        }
+
+        uint32_t start = metrics_stamp();
+        int ret = sub_send(s, conn, frame);
+
+        if (conn) {
+            bt_conn_unref(conn);
+        }
+
+        k_spinlock_key_t key = k_spin_lock(&subs_lock);
+
+        if (ret < 0) {
+            s->dropped++;
+        } else {
+            s->sent++;
+            s->bytes += ret;
+        }
+        k_spin_unlock(&subs_lock, key);
+        metrics_service(METRICS_HIST_TX_SVC, start);
+    }
+}
+
+int subs_add(struct bt_conn *conn)
+{
+    k_spinlock_key_t key = k_spin_lock(&subs_lock);
+    int slot = -ENOMEM;
+
+    for (int i = 0; i < SUBS; i++) {
+        struct subscriber *s = &subs[i];
+
+        if (!s->used) {
+            s->conn = bt_conn_ref(conn);
+            s->used = true;
+            s->subscribed = false;
+            s->decimate = 0;
+            s->max_fps = 0;
+            s->sent = 0;
+            s->bytes = 0;
+            s->dropped = 0;
+            s->skipped = 0;
+            s->count_max = 0;
+            slot = i;
+            break;
+        }
+    }
+    k_spin_unlock(&subs_lock, key);
+
+    if (slot >= 0) {
+        phone_tx_reset(conn);
+    }
+    return slot;
+}
+
+int subs_remove(struct bt_conn *conn)
+{
+    struct subs_frame *flushed[QUEUE];
+    struct bt_conn *old = NULL;
+    int n = 0;
+    k_spinlock_key_t key = k_spin_lock(&subs_lock);
+
+    for (int i = 0; i < SUBS; i++) {
+        struct subscriber *s = &subs[i];
+
+        if (s->used && s->conn == conn) {
+            n = sub_flush(s, flushed);
+            old = s->conn;
+            s->conn = NULL;
+            s->used = false;
+            s->subscribed = false;
+            break;
+        }
+    }
+    k_spin_unlock(&subs_lock, key);
+
+    if (!old) {
+        return -ENOENT;
+    }
+    for (int i = 0; i < n; i++) {
+        subs_frame_unref(flushed[i]);
+    }
+    // A TX thread blocked on this connection's credits gives up now
+    phone_tx_reset(old);
+    bt_conn_unref(old);
+    return 0;
+}
+
+int subs_free(void)
+{
+    int free = 0;
+
+    for (int i = 0; i < SUBS; i++) {
+        free += !subs[i].used;
+    }
+    return free;
+}
+
+bool subs_active(void)
+{
+    bool active = false;
+    k_spinlock_key_t key = k_spin_lock(&subs_lock);
+
+    for (int i = 0; i < SUBS; i++) {
+        struct subscriber *s = &subs[i];
+
+        if (!s->used) {
+            continue;
+        }
+        // No CCC for the simulated phone
+        bool subscribed = !s->conn || phone_tx_subscribed(s->conn);
+
+        if (subscribed && !s->subscribed) {
+            s->offered = 0;
+            s->tokens = QUEUE * MSEC_PER_SEC;
+            s->refill = k_uptime_get();
+            atomic_set(&joined, 1);
+        }
+        s->subscribed = subscribed;
+        active |= subscribed;
+    }
+    k_spin_unlock(&subs_lock, key);
+    return active;
+}
+
+bool subs_joined(void)
+{
+    return atomic_cas(&joined, 1, 0);
+}
+
+uint16_t subs_frame_cap(void)
+{
+    uint16_t cap = AGG_FRAME_MAX_LEN;
+    k_spinlock_key_t key = k_spin_lock(&subs_lock);
+
+    for (int i = 0; i < SUBS; i++) {
+        if (subs[i].used && subs[i].subscribed) {
+            cap = MIN(cap, sub_cap(subs[i].conn));
+        }
+    }
+    k_spin_unlock(&subs_lock, key);
+    return cap;
+}
+
+int subs_configure(int slot, uint8_t decimate, uint16_t max_fps)
+{
+    if (slot < 0 || slot >= SUBS || !subs[slot].used) {
+        return -ENOENT;
+    }
+    // A skipped frame would break every delta chain in it
+    if (IS_ENABLED(CONFIG_BHI_AGG_DELTA) && (decimate > 1 || max_fps)) {
+        return -ENOTSUP;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&subs_lock);
+
+    subs[slot].decimate = decimate;
+    subs[slot].max_fps = max_fps;
+    subs[slot].tokens = QUEUE * MSEC_PER_SEC;
+    k_spin_unlock(&subs_lock, key);
+    return 0;
+}
+
+int subs_info_get(int slot, struct subs_info *info)
+{
+    if (slot < 0 || slot >= SUBS) {
+        return -EINVAL;
+    }
+
+    struct subscriber *s = &subs[slot];
+    k_spinlock_key_t key = k_spin_lock(&subs_lock);
+
+    info->connected = s->used;
+    info->flags = (s->subscribed ? SUBS_FLAG_SUBSCRIBED : 0) |
+                  (s->used && sub_use_l2cap(s->conn) ? SUBS_FLAG_L2CAP : 0);
+    info->decimate = s->decimate;
+    info->max_fps = s->max_fps;
+    info->cap = s->used ? sub_cap(s->conn) : 0;
+    info->queued = s->count;
+    info->queued_max = s->count_max;
+    info->sent = s->sent;
+    info->bytes = s->bytes;
+    info->dropped = s->dropped;
+    info->skipped = s->skipped;
+    k_spin_unlock(&subs_lock, key);
+    return 0;
+}
+
+int subs_traffic(const struct bt_conn *conn, uint32_t *msgs, uint32_t *bytes)
+{
+    k_spinlock_key_t key = k_spin_lock(&subs_lock);
+    int err = -ENOENT;
+
+    for (int i = 0; i < SUBS; i++) {
+        if (subs[i].used && subs[i].conn == conn) {
+            *msgs = subs[i].sent;
+            *bytes = subs[i].bytes;
+            err = 0;
+            break;
+        }
+    }
+    k_spin_unlock(&subs_lock, key);
+    return err;
+}
+
+static int sub_slot(struct bt_conn *conn)
+{
+    for (int i = 0; i < SUBS; i++) {
+        if (subs[i].used && subs[i].conn == conn) {
+            return i;
+        }
+    }
+    return -ENOENT;
+}
+
+int subs_ctrl_write(struct bt_conn *conn, const void *buf, uint16_t len)
+{
+    const uint8_t *rec = buf;
+
+    if (len != SUBS_CTRL_LEN) {
+        return -EINVAL;
+    }
+    return subs_configure(sub_slot(conn), rec[0], sys_get_le16(&rec[2]));
+}
+
+int subs_ctrl_read(struct bt_conn *conn, void *buf, uint16_t size)
+{
+    int slot = sub_slot(conn);
+    struct subs_info info;
+    uint8_t *out = buf;
+
+    if (size < SUBS_INFO_LEN) {
+        return -ENOSPC;
+    }
+    if (slot < 0 || subs_info_get(slot, &info)) {
+        return -ENOENT;
+    }
+
+    out[0] = slot;
+    out[1] = info.decimate;
+    sys_put_le16(info.max_fps, &out[2]);
+    sys_put_le16(info.cap, &out[4]);
+    out[6] = info.queued;
+    out[7] = info.flags;
+    sys_put_le32(info.sent, &out[8]);
+    sys_put_le32(info.dropped, &out[12]);
+    sys_put_le32(info.skipped, &out[16]);
+    return SUBS_INFO_LEN;
+}
+
+void subs_start(void)
+{
+    for (int i = 0; i < SUBS; i++) {
+        struct subscriber *s = &subs[i];
+        char name[] = "sub_tx0";
+
+        k_sem_init(&s->ready, 0, QUEUE);
+        k_thread_create(&s->thread, subs_stacks[i], K_THREAD_STACK_SIZEOF(subs_stacks[i]),
+                        sub_tx, s, NULL, NULL, CONFIG_BHI_PIPE_TX_PRIORITY, 0, K_NO_WAIT);
+        name[sizeof(name) - 2] += i;
+        k_thread_name_set(&s->thread, name);
+    }
+
+    if (IS_ENABLED(CONFIG_BHI_SIM)) {
+        // The simulated phone has no connection and is always listening
+        subs[0].used = true;
+    }
+}
+
+#if defined(CONFIG_SHELL)
+static int cmd_subs(const struct shell *sh, size_t argc, char **argv)
+{
+    shell_print(sh, "slot %-10s %5s %8s %7s %6s %10s %8s %8s", "state", "cap", "decimate",
+                "max_fps", "queue", "sent", "dropped", "skipped");
+    for (int i = 0; i < SUBS; i++) {
+        struct subs_info info;
+
+        subs_info_get(i, &info);
+        if (!info.connected) {
+            shell_print(sh, "%4d %-10s", i, "free");
+            continue;
+        }
+        shell_print(sh, "%4d %-10s %5u %8u %7u %3u/%-2u %10u %8u %8u", i,
+                    !(info.flags & SUBS_FLAG_SUBSCRIBED) ? "connected" :
+                    (info.flags & SUBS_FLAG_L2CAP) ? "l2cap" : "notify",
+                    info.cap, info.decimate, info.max_fps, info.queued, info.queued_max,
+                    info.sent, info.dropped, info.skipped);
+    }
+    return 0;
+}
+
+static int cmd_subs_limit(const struct shell *sh, size_t argc, char **argv)
+{
+    int err = subs_configure(strtol(argv[1], NULL, 0), strtoul(argv[2], NULL, 0),
+                             strtoul(argv[3], NULL, 0));
+
+    if (err == -ENOTSUP) {
+        shell_error(sh, "Limits break delta coded streams");
+    } else if (err) {
+        shell_error(sh, "No subscriber in slot %s", argv[1]);
+    }
+    return err;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(bhi_subs_cmds,
+    SHELL_CMD_ARG(limit, NULL, "Thin a subscriber's stream <slot> <decimate> <max_fps>",
+                  cmd_subs_limit, 4, 0),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_SUBCMD_ADD((bhi), subs, &bhi_subs_cmds, "Phone stream subscribers", cmd_subs, 1, 0);
+#endif
@@ -0,0 +1,110 @@
+#ifndef SUBS_H_
+#define SUBS_H_
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/bluetooth/conn.h>
+
+#include "agg_frame.h"
+
+/* Fan-out of the aggregate stream to up to CONFIG_BHI_SUBS_MAX phones or
+ * gateways at once. The aggregate stage encodes every frame once into a
+ * shared, reference counted buffer. Each subscriber keeps references in
+ * its own queue of CONFIG_BHI_SUBS_QUEUE frames, drained by its own TX
+ * thread at the pace of its own link:
+ *
+ *   aggregate stage --+-> queue -> TX thread -> phone 0
+ *     subs_publish()  +-> queue -> TX thread -> phone 1
+ *
+ * A subscriber whose queue is full loses its oldest frame, so a slow one
+ * never holds the others back. Since a frame is encoded once for all of
+ * them, frames are sized to the smallest MTU among the subscribers: one
+ * phone on a small MTU shrinks the frames every phone gets.
+ *
+ * A subscriber can thin its copy of the stream to every Nth frame and to
+ * at most so many frames per second, through the subscriber
+ * characteristic:
+ *
+ *   write: | decimate | rsvd | max_fps (2) |
+ *   read:  | slot | decimate | max_fps (2) | cap (2) | queued | flags |
+ *          | sent (4) | dropped (4) | skipped (4) |
+ *
+ * decimate 0 or 1 and max_fps 0 mean no limit. Skipped frames would
+ * break the delta chains of CONFIG_BHI_AGG_DELTA, so there limits are
+ * refused with -ENOTSUP.
+ */
+#define SUBS_CTRL_LEN 4
+#define SUBS_INFO_LEN 20
+
+#define SUBS_FLAG_SUBSCRIBED BIT(0)
+#define SUBS_FLAG_L2CAP BIT(1)
+
+/* One encoded frame, shared by every subscriber queue it sits in */
+struct subs_frame {
+    atomic_t refs;
+    uint32_t rx_cyc;     /* Metrics stamp of the oldest sample inside */
+    uint16_t len;
+    uint8_t buf[AGG_FRAME_MAX_LEN];
+};
+
+struct subs_info {
+    bool connected;
+    uint8_t flags;
+    uint8_t decimate;
+    uint16_t max_fps;
+    uint16_t cap;          // Largest frame its link takes
+    uint8_t queued;
+    uint8_t queued_max;
+    uint32_t sent;         // Notifications or SDUs
+    uint32_t bytes;
+    uint32_t dropped;      // Lost to a full queue or a send error
+    uint32_t skipped;      // Thinned out by decimate and max_fps
+};
+
+/* Start the TX threads. In simulation slot 0 is the simulated phone. */
+void subs_start(void);
+
+/* Take a slot for a new phone connection, -ENOMEM when all are taken */
+int subs_add(struct bt_conn *conn);
+
+/* Free the slot of conn and drop its queue. -ENOENT if it had none. */
+int subs_remove(struct bt_conn *conn);
+
+/* Slots still free for another phone */
+int subs_free(void);
+
+/* True if at least one subscriber listens. Picks up CCC changes, so the
+ * aggregate stage calls it for every sample.
+ */
+bool subs_active(void);
+
+/* True once after a subscriber started listening: delta chains must
+ * restart with keyframes.
+ */
+bool subs_joined(void);
+
+/* Largest frame every listening subscriber can take */
+uint16_t subs_frame_cap(void);
+
+/* A free frame with one reference, blocking while all are in use */
+struct subs_frame *subs_frame_alloc(void);
+
+void subs_frame_unref(struct subs_frame *frame);
+
+/* Queue frame to every listening subscriber, consuming the caller's
+ * reference. Never blocks.
+ */
+void subs_publish(struct subs_frame *frame);
+
+/* Subscriber characteristic of conn, see above */
+int subs_ctrl_write(struct bt_conn *conn, const void *buf, uint16_t len);
+int subs_ctrl_read(struct bt_conn *conn, void *buf, uint16_t size);
+
+int subs_configure(int slot, uint8_t decimate, uint16_t max_fps);
+
+int subs_info_get(int slot, struct subs_info *info);
+
+/* Running totals of what went out to conn, -ENOENT if it is no subscriber */
+int subs_traffic(const struct bt_conn *conn, uint32_t *msgs, uint32_t *bytes);
+
+#endif /* SUBS_H_ */
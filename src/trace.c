@@ -0,0 +1,160 @@
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/shell/shell.h>
+
+#include "trace.h"
+
+BUILD_ASSERT(IS_POWER_OF_TWO(CONFIG_BHI_TRACE_ENTRIES),
+             "Trace ring size must be a power of two");
+
+#define TRACE_MASK (CONFIG_BHI_TRACE_ENTRIES - 1)
+
+/* Writers reserve a slot by bumping head, fill it in, then publish it by
+ * storing the slot's sequence number (index + 1). The reader only
+ * consumes slots whose sequence matches and rechecks it after copying,
+ * so a writer lapping the reader is detected instead of printing a torn
+ * event. When full the oldest events are overwritten.
+ */
+struct trace_slot {
+    atomic_t seq;
+    struct trace_event evt;
+};
+
+static struct trace_slot ring[CONFIG_BHI_TRACE_ENTRIES];
+static atomic_t head;
+static uint32_t tail;
+static uint32_t lost;
+static K_MUTEX_DEFINE(reader_lock);
+
+static const char *const type_names[] = {
+    [TRACE_NOTIFY] = "notify",
+    [TRACE_INDICATE] = "indicate",
+    [TRACE_ADV_FOUND] = "adv found",
+    [TRACE_DISC_ATTR] = "disc attr",
+    [TRACE_DROP] = "drop",
+    [TRACE_BAD_FRAME] = "bad frame",
+    [TRACE_RATE] = "rate",
+};
+
+void trace_record(enum trace_type type, uint8_t link, const void *data, uint16_t len)
+{
+    uint32_t idx = (uint32_t)atomic_inc(&head);
+    struct trace_slot *slot = &ring[idx & TRACE_MASK];
+
+    atomic_set(&slot->seq, 0);
+    compiler_barrier();
+
+    slot->evt.cyc = k_cycle_get_32();
+    slot->evt.link = link;
+    slot->evt.type = type;
+    slot->evt.len = len;
+    if (data) {
+        memcpy(slot->evt.data, data, MIN(len, sizeof(slot->evt.data)));
+    }
+
+    compiler_barrier();
+    atomic_set(&slot->seq, idx + 1);
+}
+
+/* One printk per event so deferred logging keeps lines intact */
+static void trace_print(const struct trace_event *evt)
+{
+    char line[48 + 3 * CONFIG_BHI_TRACE_PAYLOAD_LEN];
+    int n;
+
+    n = snprintk(line, sizeof(line), "[%10u us] dev %u %s len %u",
+                 k_cyc_to_us_floor32(evt->cyc), evt->link,
+                 evt->type < ARRAY_SIZE(type_names) ? type_names[evt->type] : "?", evt->len);
+
+    switch (evt->type) {
+    case TRACE_ADV_FOUND:
+        n += snprintk(line + n, sizeof(line) - n, " rssi %d", (int8_t)evt->data[0]);
+        break;
+    case TRACE_DISC_ATTR:
+        n += snprintk(line + n, sizeof(line) - n, " handle 0x%04x",
+                      evt->data[0] | (evt->data[1] << 8));
+        break;
+    case TRACE_RATE:
+        n += snprintk(line + n, sizeof(line) - n, " 1/%u -> 1/%u", 1U << evt->data[0],
+                      1U << evt->data[1]);
+        break;
+    default:
+        for (int i = 0; i < MIN(evt->len, sizeof(evt->data)) && n < sizeof(line); i++) {
+            n += snprintk(line + n, sizeof(line) - n, " %02x", evt->data[i]);
+        }
+        if (evt->len > sizeof(evt->data) && n < sizeof(line)) {
+            snprintk(line + n, sizeof(line) - n, " ...");
+        }
+        break;
+    }
+    printk("%s\n", line);
+}
+
+int trace_dump(void)
+{
+    struct trace_event evt;
+    int printed = 0;
+
+    k_mutex_lock(&reader_lock, K_FOREVER);
+
+    while (tail != (uint32_t)atomic_get(&head)) {
+        uint32_t newest = (uint32_t)atomic_get(&head);
+        struct trace_slot *slot = &ring[tail & TRACE_MASK];
+
+        if (newest - tail > CONFIG_BHI_TRACE_ENTRIES) {
+            lost += newest - tail - CONFIG_BHI_TRACE_ENTRIES;
+            tail = newest - CONFIG_BHI_TRACE_ENTRIES;
+            continue;
+        }
+
+        if ((uint32_t)atomic_get(&slot->seq) != tail + 1) {
+            // Still being written; pick it up on the next pass
+            break;
+        }
+        evt = slot->evt;
+        compiler_barrier();
+        if ((uint32_t)atomic_get(&slot->seq) != tail + 1) {
+            // Overwritten while copying
+            continue;
+        }
+
+        trace_print(&evt);
+        tail++;
+        printed++;
+    }
+
+    if (lost) {
+        printk("Trace: %u events overwritten before they were printed\n", lost);
+        lost = 0;
+    }
+
+    k_mutex_unlock(&reader_lock);
+    return printed;
+}
+
+#if defined(CONFIG_BHI_TRACE_DRAIN_THREAD)
+static void trace_drain(void *arg1, void *arg2, void *arg3)
+{
+    while (1) {
+        k_msleep(CONFIG_BHI_TRACE_DRAIN_MS);
+        trace_dump();
+    }
+}
+
+K_THREAD_DEFINE(trace_drain_thread, 1024, trace_drain, NULL, NULL, NULL,
+                K_LOWEST_APPLICATION_THREAD_PRIO, 0, 0);
+#endif
+
+#if defined(CONFIG_SHELL)
+static int cmd_trace(const struct shell *sh, size_t argc, char **argv)
+{
+    shell_print(sh, "%d events", trace_dump());
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((bhi), trace, NULL, "Print and clear the event trace", cmd_trace, 1, 0);
+#endif
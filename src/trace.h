@@ -0,0 +1,50 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <zephyr/kernel.h>
+
+/* Binary event trace for the hot paths. Recording copies a few bytes
+ * into a lock-free RAM ring and never formats anything; events are
+ * printed later by a low-priority drain thread or by "bhi trace".
+ *
+ * Each call site has a level. Sites above CONFIG_BHI_TRACE_LEVEL compile
+ * to nothing, so release builds pay nothing for per-sample tracing.
+ */
+#define TRACE_LEVEL_ERR   1
+#define TRACE_LEVEL_INFO  2
+#define TRACE_LEVEL_DEBUG 3
+
+enum trace_type {
+    TRACE_NOTIFY,     // Sample notification, payload prefix attached
+    TRACE_INDICATE,   // Indication, payload prefix attached
+    TRACE_ADV_FOUND,  // Peer seen while scanning, data is the RSSI
+    TRACE_DISC_ATTR,  // Attribute found during discovery, data is the handle
+    TRACE_DROP,       // Sample lost before reaching the queue
+    TRACE_BAD_FRAME,  // Notification the BHI decoder rejected, payload prefix attached
+    TRACE_RATE,       // Rate control moved a stream, data is the old and new level
+};
+
+struct trace_event {
+    uint32_t cyc;     // k_cycle_get_32() when recorded
+    uint8_t link;
+    uint8_t type;
+    uint16_t len;     // Full length of the traced data
+    uint8_t data[CONFIG_BHI_TRACE_PAYLOAD_LEN];
+};
+
+/* Record an event if level is compiled in. Safe from any context. */
+#define TRACE(level, type, link, data, len)                 \
+    do {                                                    \
+        if ((level) <= CONFIG_BHI_TRACE_LEVEL) {            \
+            trace_record((type), (link), (data), (len));    \
+        }                                                   \
+    } while (0)
+
+void trace_record(enum trace_type type, uint8_t link, const void *data, uint16_t len);
+
+/* Print and consume everything recorded so far. Returns the number of
+ * events printed.
+ */
+int trace_dump(void);
+
+#endif /* TRACE_H_ */
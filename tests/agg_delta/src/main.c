@@ -0,0 +1,253 @@
+#include <string.h>
+
+#include <zephyr/ztest.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+
+#include "agg_delta.h"
+
+#define KEYFRAME CONFIG_BHI_AGG_DELTA_KEYFRAME
+
+/* The phone side of src/agg_delta.h, written from the format description
+ * rather than the encoder so the two can disagree.
+ */
+struct ref_stream {
+    bool valid;
+    uint8_t dev;
+    uint8_t sensor;
+    uint8_t channels;
+    int16_t last[AGG_DELTA_MAX_CH];
+};
+
+static struct ref_stream ref[8];
+static struct agg_delta codec;
+
+static struct ref_stream *ref_stream(uint8_t dev, uint8_t sensor)
+{
+    struct ref_stream *free = NULL;
+
+    for (int i = 0; i < ARRAY_SIZE(ref); i++) {
+        if (ref[i].valid && ref[i].dev == dev && ref[i].sensor == sensor) {
+            return &ref[i];
+        }
+        if (!ref[i].valid && !free) {
+            free = &ref[i];
+        }
+    }
+    zassert_not_null(free, "Reference decoder out of streams");
+    free->valid = true;
+    free->dev = dev;
+    free->sensor = sensor;
+    free->channels = 0;
+    return free;
+}
+
+static int get_varint(const uint8_t *in, int len, int *pos, uint16_t *v)
+{
+    uint32_t x = 0;
+
+    for (int shift = 0; *pos < len && shift < 21; shift += 7) {
+        uint8_t b = in[(*pos)++];
+
+        x |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = x;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Returns the decoded sample length, or -1 for a delta the phone would
+ * ignore until the next keyframe
+ */
+static int ref_decode(uint8_t dev, uint8_t sensor, const uint8_t *in, int len, uint8_t *out)
+{
+    int off = sensor ? 1 : 0;
+    struct ref_stream *s = ref_stream(dev & ~AGG_REC_DELTA, sensor);
+
+    if (!(dev & AGG_REC_DELTA)) {
+        int channels = (len - off) / 2;
+
+        if (!((len - off) & 1) && channels > 0 && channels <= AGG_DELTA_MAX_CH) {
+            for (int ch = 0; ch < channels; ch++) {
+                s->last[ch] = sys_get_le16(&in[off + 2 * ch]);
+            }
+            s->channels = channels;
+        }
+        memcpy(out, in, len);
+        return len;
+    }
+
+    if (!s->channels) {
+        return -1;
+    }
+    memcpy(out, in, off);
+    int pos = off;
+
+    for (int ch = 0; ch < s->channels; ch++) {
+        uint16_t z;
+
+        zassert_ok(get_varint(in, len, &pos, &z), "Varint runs past the record");
+        s->last[ch] += (int16_t)((z >> 1) ^ -(z & 1));
+        sys_put_le16(s->last[ch], &out[off + 2 * ch]);
+    }
+    zassert_equal(pos, len, "Record has %d bytes after the last channel", len - pos);
+    return off + 2 * s->channels;
+}
+
+/* Code one sample and check the phone gets it back unchanged. Returns
+ * whether it went out as a delta.
+ */
+static bool round_trip(uint8_t dev, uint8_t sensor, const uint8_t *data, uint8_t len)
+{
+    uint8_t coded[AGG_DELTA_OUT_LEN(255)];
+    uint8_t decoded[255];
+    uint8_t rec_dev = dev;
+    uint8_t n = agg_delta_encode(&codec, &rec_dev, sensor, data, len, coded);
+
+    zassert_equal(rec_dev & ~AGG_REC_DELTA, dev, "Encoder changed the device index");
+    if (rec_dev & AGG_REC_DELTA) {
+        zassert_true(n < len, "Delta of %u bytes for a %u byte sample", n, len);
+    } else {
+        zassert_equal(n, len, "Keyframe of %u bytes for a %u byte sample", n, len);
+    }
+    zassert_equal(ref_decode(rec_dev, sensor, coded, n, decoded), len, "Length changed");
+    zassert_mem_equal(decoded, data, len, "Sample changed in coding");
+    return rec_dev & AGG_REC_DELTA;
+}
+
+/* Sensor id followed by channels le16 values */
+static uint8_t sample(uint8_t *buf, uint8_t sensor, const int16_t *v, int channels)
+{
+    int off = 0;
+
+    if (sensor) {
+        buf[off++] = sensor;
+    }
+    for (int ch = 0; ch < channels; ch++) {
+        sys_put_le16(v[ch], &buf[off + 2 * ch]);
+    }
+    return off + 2 * channels;
+}
+
+static void before(void *fixture)
+{
+    ARG_UNUSED(fixture);
+    agg_delta_init(&codec);
+    memset(ref, 0, sizeof(ref));
+}
+
+ZTEST(agg_delta, test_round_trip_lossless)
+{
+    static const int16_t step[] = { 1, -1, 63, -64, 64, -65, 8191, -8192, 8192, 32767, -32768 };
+    int16_t v[4] = { 0, 1000, -1000, 32767 };
+    uint8_t buf[1 + 2 * ARRAY_SIZE(v)];
+    int deltas = 0;
+
+    for (int i = 0; i < 200; i++) {
+        for (int ch = 0; ch < ARRAY_SIZE(v); ch++) {
+            // Wraps modulo 2^16, which the coding must survive
+            v[ch] = (int16_t)(v[ch] + step[(i + 3 * ch) % ARRAY_SIZE(step)] / (ch + 1));
+        }
+        deltas += round_trip(2, 34, buf, sample(buf, 34, v, ARRAY_SIZE(v)));
+    }
+    zassert_true(deltas > 100, "Only %d of 200 samples delta coded", deltas);
+    zassert_true(codec.coded_bytes < codec.raw_bytes, "No gain: %u of %u bytes",
+                 codec.coded_bytes, codec.raw_bytes);
+}
+
+ZTEST(agg_delta, test_keyframe_interval)
+{
+    int16_t v[3] = { 100, 200, 300 };
+    uint8_t buf[1 + 2 * ARRAY_SIZE(v)];
+
+    for (int i = 0; i < 5 * (KEYFRAME + 1); i++) {
+        v[0]++;
+        bool delta = round_trip(0, 1, buf, sample(buf, 1, v, ARRAY_SIZE(v)));
+
+        zassert_equal(delta, i % (KEYFRAME + 1) != 0, "Sample %d: delta %d", i, delta);
+    }
+    zassert_equal(codec.keyframes, 5, "%u keyframes", codec.keyframes);
+}
+
+ZTEST(agg_delta, test_channel_count_change)
+{
+    int16_t v[6] = { 1, 2, 3, 4, 5, 6 };
+    uint8_t buf[1 + 2 * ARRAY_SIZE(v)];
+
+    round_trip(1, 0, buf, sample(buf, 0, v, 3));
+    zassert_true(round_trip(1, 0, buf, sample(buf, 0, v, 3)), "Same shape not delta coded");
+    // A new shape restarts the stream with a keyframe
+    zassert_false(round_trip(1, 0, buf, sample(buf, 0, v, 6)), "Shape change delta coded");
+    zassert_true(round_trip(1, 0, buf, sample(buf, 0, v, 6)), "New shape not delta coded");
+    zassert_false(round_trip(1, 0, buf, sample(buf, 0, v, 1)), "Shape change delta coded");
+}
+
+ZTEST(agg_delta, test_raw_samples)
+{
+    static const uint8_t odd[] = { 129, 0x34, 0x12, 0x01 };  // Pressure, le24
+    int16_t v[AGG_DELTA_MAX_CH + 1] = { 0 };
+    uint8_t buf[2 * ARRAY_SIZE(v)];
+
+    // Not int16 channels, or too many of them: always sent as is
+    for (int i = 0; i < 3; i++) {
+        zassert_false(round_trip(0, 129, odd, sizeof(odd)), "Odd length delta coded");
+        zassert_false(round_trip(0, 0, buf, sample(buf, 0, v, ARRAY_SIZE(v))),
+                      "Channel count beyond the limit delta coded");
+    }
+    zassert_equal(codec.keyframes, 0, "Raw samples counted as keyframes");
+}
+
+ZTEST(agg_delta, test_large_step_falls_back)
+{
+    int16_t v[3] = { 0, 0, 0 };
+    uint8_t buf[2 * ARRAY_SIZE(v)];
+
+    round_trip(0, 0, buf, sample(buf, 0, v, ARRAY_SIZE(v)));
+    // Three 3-byte varints are no smaller than three raw channels
+    v[0] = v[1] = v[2] = 20000;
+    zassert_false(round_trip(0, 0, buf, sample(buf, 0, v, ARRAY_SIZE(v))),
+                  "Larger delta sent");
+    v[0]++;
+    zassert_true(round_trip(0, 0, buf, sample(buf, 0, v, ARRAY_SIZE(v))),
+                 "Fallback keyframe did not update the stream");
+}
+
+ZTEST(agg_delta, test_streams_and_resync)
+{
+    int16_t v[2] = { 7, 7 };
+    uint8_t buf[1 + 2 * ARRAY_SIZE(v)];
+
+    // Same sensor on two devices, two sensors on one device
+    for (int i = 0; i < 2; i++) {
+        round_trip(0, 10, buf, sample(buf, 10, v, ARRAY_SIZE(v)));
+        round_trip(1, 10, buf, sample(buf, 10, v, ARRAY_SIZE(v)));
+        round_trip(1, 12, buf, sample(buf, 12, v, ARRAY_SIZE(v)));
+    }
+    zassert_equal(codec.keyframes, 3, "%u keyframes", codec.keyframes);
+
+    agg_delta_resync(&codec, 1 | AGG_REC_DELTA, 10);
+    zassert_true(round_trip(0, 10, buf, sample(buf, 10, v, ARRAY_SIZE(v))), "Wrong stream");
+    zassert_false(round_trip(1, 10, buf, sample(buf, 10, v, ARRAY_SIZE(v))), "Not resynced");
+
+    agg_delta_resync_all(&codec);
+    zassert_false(round_trip(0, 10, buf, sample(buf, 10, v, ARRAY_SIZE(v))), "Not resynced");
+    zassert_false(round_trip(1, 12, buf, sample(buf, 12, v, ARRAY_SIZE(v))), "Not resynced");
+}
+
+ZTEST(agg_delta, test_eviction)
+{
+    int16_t v[2] = { 0, 0 };
+    uint8_t buf[1 + 2 * ARRAY_SIZE(v)];
+
+    // One stream more than the coder tracks: each evicts the oldest
+    for (int i = 0; i < 3; i++) {
+        for (int s = 0; s <= CONFIG_BHI_AGG_DELTA_STREAMS; s++) {
+            zassert_false(round_trip(0, 10 + s, buf, sample(buf, 10 + s, v, ARRAY_SIZE(v))),
+                          "Evicted stream %d delta coded", s);
+        }
+    }
+}
+
+ZTEST_SUITE(agg_delta, NULL, NULL, before, NULL, NULL);
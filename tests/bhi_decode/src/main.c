@@ -0,0 +1,164 @@
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/ztest.h>
+#include <zephyr/sys/util.h>
+
+#include "bhi_decode.h"
+
+/* Frames come straight from the air, so every malformed one must be
+ * rejected without touching the hub clock or reading past its end.
+ */
+
+static struct bhi_decoder dec;
+static struct bhi_record recs[8];
+
+static void before(void *fixture)
+{
+    ARG_UNUSED(fixture);
+    dec.ts = 0;
+    bhi_decode_stats_reset();
+}
+
+ZTEST(bhi_decode, test_samples_and_padding)
+{
+    static const uint8_t frame[] = {
+        0x00,                                       // Padding
+        1, 0x01, 0x00, 0x02, 0x00, 0x03, 0x00,      // Accelerometer
+        0xf8, 0x01, 0x02, 0x03,                     // Meta event
+        34, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,          // Rotation vector
+        48,                                         // Tilt, no payload
+        129, 0x10, 0x20, 0x30,                      // Pressure
+        0xff,
+    };
+    struct bhi_decode_stats stats;
+
+    zassert_equal(bhi_decode(&dec, frame, sizeof(frame), recs, ARRAY_SIZE(recs)), 4);
+    zassert_equal(recs[0].sensor, 1);
+    zassert_equal(recs[0].len, 6);
+    zassert_equal(recs[0].data, &frame[2], "Record does not point into the frame");
+    zassert_equal(recs[1].sensor, 34);
+    zassert_equal(recs[1].len, 10);
+    zassert_equal(recs[2].sensor, 48);
+    zassert_equal(recs[2].len, 0);
+    zassert_equal(recs[3].sensor, 129);
+    zassert_equal(recs[3].len, 3);
+    zassert_equal(recs[3].data, &frame[sizeof(frame) - 4]);
+
+    bhi_decode_stats_get(&stats);
+    zassert_equal(stats.frames, 1);
+    zassert_equal(stats.events, 4);
+    zassert_equal(stats.errors, 0);
+}
+
+ZTEST(bhi_decode, test_timestamp_deltas)
+{
+    static const uint8_t frame[] = {
+        0xf7, 0x00, 0x01, 0x00, 0x00, 0x01,         // Full: 2^32 + 256
+        1, 0, 0, 0, 0, 0, 0,
+        0xf5, 0x40,                                 // Small: +64
+        1, 0, 0, 0, 0, 0, 0,
+        0xfc, 0x00, 0x10,                           // Large, wake-up: +4096
+        1, 0, 0, 0, 0, 0, 0,
+        0xfb, 0x01,                                 // Small, wake-up: +1
+    };
+    static const uint8_t next[] = {
+        0xf6, 0xff, 0xff,                           // Large: +65535
+        10, 0, 0, 0, 0, 0, 0,
+    };
+    const uint64_t base = (1ULL << 32) + 256;
+
+    zassert_equal(bhi_decode(&dec, frame, sizeof(frame), recs, ARRAY_SIZE(recs)), 3);
+    zassert_equal(recs[0].ts, base);
+    zassert_equal(recs[1].ts, base + 64);
+    zassert_equal(recs[2].ts, base + 64 + 4096);
+    // The trailing timestamp moves the clock for the next notification
+    zassert_equal(dec.ts, base + 64 + 4096 + 1);
+
+    zassert_equal(bhi_decode(&dec, next, sizeof(next), recs, ARRAY_SIZE(recs)), 1);
+    zassert_equal(recs[0].ts, base + 64 + 4096 + 1 + 65535);
+    zassert_equal(dec.ts, recs[0].ts);
+}
+
+ZTEST(bhi_decode, test_unknown_id)
+{
+    static const uint8_t frame[] = {
+        0xf5, 0x10,
+        1, 0, 0, 0, 0, 0, 0,
+        0x02, 0, 0, 0,                              // Not in the event table
+        1, 0, 0, 0, 0, 0, 0,
+    };
+    struct bhi_decode_stats stats;
+
+    dec.ts = 1000;
+    zassert_equal(bhi_decode(&dec, frame, sizeof(frame), recs, ARRAY_SIZE(recs)), -EBADMSG);
+    zassert_equal(dec.ts, 1000, "Rejected frame moved the hub clock");
+
+    bhi_decode_stats_get(&stats);
+    zassert_equal(stats.frames, 1);
+    zassert_equal(stats.errors, 1);
+    zassert_equal(stats.events, 0);
+}
+
+ZTEST(bhi_decode, test_truncated_frames)
+{
+    static const uint8_t frame[] = {
+        0xf7, 0x01, 0x02, 0x03, 0x04, 0x05,
+        34, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+    };
+    static const uint8_t ts_only[] = { 0xf6, 0x01 };
+
+    // Every proper prefix that ends inside an event
+    for (int len = 1; len < sizeof(frame); len++) {
+        int ret = bhi_decode(&dec, frame, len, recs, ARRAY_SIZE(recs));
+
+        if (len == 6) {
+            zassert_equal(ret, 0, "Prefix of %d bytes", len);
+            dec.ts = 0;
+            continue;
+        }
+        zassert_equal(ret, -EBADMSG, "Prefix of %d bytes: %d", len, ret);
+        zassert_equal(dec.ts, 0, "Prefix of %d bytes moved the hub clock", len);
+    }
+    zassert_equal(bhi_decode(&dec, ts_only, sizeof(ts_only), recs, ARRAY_SIZE(recs)),
+                  -EBADMSG);
+    zassert_equal(bhi_decode(&dec, frame, 0, recs, ARRAY_SIZE(recs)), 0);
+}
+
+ZTEST(bhi_decode, test_more_events_than_records)
+{
+    uint8_t frame[3 * 7 + 2];
+    struct bhi_decode_stats stats;
+
+    for (int i = 0; i < 3; i++) {
+        frame[7 * i] = 1;
+        memset(&frame[7 * i + 1], i, 6);
+    }
+    frame[21] = 0xf5;
+    frame[22] = 0x20;
+
+    // The events that fit are kept and the clock still sees the whole frame
+    zassert_equal(bhi_decode(&dec, frame, sizeof(frame), recs, 2), 2);
+    zassert_equal(recs[0].data, &frame[1]);
+    zassert_equal(recs[1].data, &frame[8]);
+    zassert_equal(dec.ts, 0x20);
+
+    bhi_decode_stats_get(&stats);
+    zassert_equal(stats.events, 2);
+    zassert_equal(stats.truncated, 1);
+    zassert_equal(stats.errors, 0);
+}
+
+ZTEST(bhi_decode, test_sensor_kinds)
+{
+    zassert_equal(bhi_sensor_kind(0x02), BHI_KIND_NONE);
+    zassert_equal(bhi_sensor_len(0x02), 0);
+    zassert_equal(bhi_sensor_kind(0xfd), BHI_KIND_TS);
+    zassert_equal(bhi_sensor_len(0xfd), 5);
+    zassert_true(bhi_sensor_s16(43));
+    zassert_true(bhi_sensor_s16(128));
+    zassert_false(bhi_sensor_s16(129));
+    zassert_false(bhi_sensor_s16(52));
+}
+
+ZTEST_SUITE(bhi_decode, NULL, NULL, before, NULL, NULL);